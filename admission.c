@@ -0,0 +1,79 @@
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "admission.h"
+
+//sessions_cond est signalée à chaque place libérée ; le serveur à threads s'en sert
+//aussi pour attendre la fin de ses threads de requête.
+pthread_mutex_t sessions_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sessions_cond = PTHREAD_COND_INITIALIZER;
+struct SessionSlot sessions[MAX_SESSIONS];
+int active_sessions = 0;
+int waiting_requests = 0;
+
+//Compte les sessions actives du client et du fichier donnés.
+void count_sessions(struct in_addr client, const char *filename, int *client_sessions, int *file_sessions)
+{
+    *client_sessions = 0;
+    *file_sessions = 0;
+    for (int i = 0; i < MAX_SESSIONS; ++i) {
+        if (sessions[i].filename == NULL)
+            continue;
+        if (sessions[i].client.s_addr == client.s_addr)
+            (*client_sessions)++;
+        if (strcmp(sessions[i].filename, filename) == 0)
+            (*file_sessions)++;
+    }
+}
+
+//Réserve une place de session pour le client et le fichier. Si une limite est atteinte,
+//la requête attend qu'une session se termine, au plus ADMISSION_WAIT_SECONDS secondes
+//et à condition que la file d'attente ne soit pas pleine. Renvoie l'indice de la place,
+//ou -1 si la requête doit être refusée. Sans wait (fil d'écoute), elle ne bloque jamais
+//et renvoie ADMISSION_QUEUED quand la requête devrait attendre.
+int admit_session(struct in_addr client, const char *filename, bool wait)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ADMISSION_WAIT_SECONDS;
+
+    pthread_mutex_lock(&sessions_mutex);
+    while (1) {
+        int client_sessions, file_sessions;
+        count_sessions(client, filename, &client_sessions, &file_sessions);
+        if (active_sessions < MAX_SESSIONS && client_sessions < MAX_SESSIONS_PER_CLIENT && file_sessions < MAX_SESSIONS_PER_FILE)
+            break;
+
+        if (waiting_requests >= MAX_WAITING_REQUESTS || !wait) {
+            pthread_mutex_unlock(&sessions_mutex);
+            return waiting_requests >= MAX_WAITING_REQUESTS ? -1 : ADMISSION_QUEUED;
+        }
+
+        waiting_requests++;
+        int result = pthread_cond_timedwait(&sessions_cond, &sessions_mutex, &deadline);
+        waiting_requests--;
+        if (result == ETIMEDOUT) {
+            pthread_mutex_unlock(&sessions_mutex);
+            return -1;
+        }
+    }
+
+    int slot = 0;
+    while (sessions[slot].filename != NULL)
+        slot++;
+    sessions[slot].client = client;
+    sessions[slot].filename = filename;
+    active_sessions++;
+    pthread_mutex_unlock(&sessions_mutex);
+    return slot;
+}
+
+void release_session(int slot)
+{
+    pthread_mutex_lock(&sessions_mutex);
+    sessions[slot].filename = NULL;
+    active_sessions--;
+    pthread_cond_broadcast(&sessions_cond);
+    pthread_mutex_unlock(&sessions_mutex);
+}
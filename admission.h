@@ -0,0 +1,35 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+//Admission des sessions, commune aux deux serveurs : au plus MAX_SESSIONS transferts en
+//cours, MAX_SESSIONS_PER_CLIENT par adresse de client et MAX_SESSIONS_PER_FILE par
+//fichier. Le serveur à threads fait attendre une requête en trop, dans son thread ; la
+//boucle du serveur epoll ne peut pas attendre et la refuse tout de suite.
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define MAX_SESSIONS 64
+#define MAX_SESSIONS_PER_CLIENT 8
+#define MAX_SESSIONS_PER_FILE 16
+#define MAX_WAITING_REQUESTS 32
+#define ADMISSION_WAIT_SECONDS 2
+#define ADMISSION_QUEUED -2
+
+//Une place de session. Une place libre a un filename nul ; filename appartient à la
+//session (paquet de la requête, état d'un transfert repris), qui le garde jusqu'à
+//release_session.
+struct SessionSlot {
+    struct in_addr client;
+    const char *filename;
+};
+
+extern pthread_mutex_t sessions_mutex;
+extern pthread_cond_t sessions_cond;
+
+void count_sessions(struct in_addr client, const char *filename, int *client_sessions, int *file_sessions);
+int admit_session(struct in_addr client, const char *filename, bool wait);
+void release_session(int slot);
+
+#endif
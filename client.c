@@ -1,23 +1,175 @@
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "transfer.h"
+#include "protocol.h"
 
 #define SERVER_PORT 69
-#define MAX_PACKET_SIZE 516
 #define TIMEOUT_SECONDS 10
+#define MAX_RESUMES 3
+#define READ_BUFFER_SIZE 65536
+
+//Statuts d'une tentative, ceux des boucles d'attente de protocol.h.
+#define TRANSFER_OK LINK_OK
+#define TRANSFER_FAILED LINK_PEER_ERROR
+#define TRANSFER_INTERRUPTED LINK_FAILED
+
+#ifdef NETSIM
+//Simulation d'un lien dégradé, pour comparer les réglages du protocole sans réseau
+//réel. Compiler le client avec -DNETSIM ; les paramètres sont lus dans l'environnement :
+//NETSIM_LOSS, NETSIM_DUP et NETSIM_REORDER en pourcentage de paquets, NETSIM_DELAY_MS
+//et NETSIM_JITTER_MS pour la latence ajoutée à chaque envoi (un aller-retour, puisque
+//chaque paquet attend sa réponse), NETSIM_RATE en Kio/s et NETSIM_SEED pour rejouer
+//exactement la même suite d'incidents. Les pertes touchent les deux sens, le reste
+//les envois du client.
+struct LinkSimulator {
+    int loss;
+    int duplicate;
+    int reorder;
+    int delay_ms;
+    int jitter_ms;
+    long rate;
+    unsigned int seed;
+    unsigned char held_packet[MAX_PACKET_SIZE];
+    size_t held_size;
+    struct sockaddr_in held_addr;
+    bool holding;
+    unsigned long sent;
+    unsigned long dropped;
+    unsigned long duplicated;
+    unsigned long reordered;
+};
+
+struct LinkSimulator link_simulator;
+
+int link_setting(const char *name, int default_value)
+{
+    const char *value = getenv(name);
+    return value != NULL ? atoi(value) : default_value;
+}
+
+void init_link_simulator()
+{
+    memset(&link_simulator, 0, sizeof(link_simulator));
+    link_simulator.loss = link_setting("NETSIM_LOSS", 0);
+    link_simulator.duplicate = link_setting("NETSIM_DUP", 0);
+    link_simulator.reorder = link_setting("NETSIM_REORDER", 0);
+    link_simulator.delay_ms = link_setting("NETSIM_DELAY_MS", 0);
+    link_simulator.jitter_ms = link_setting("NETSIM_JITTER_MS", 0);
+    link_simulator.rate = link_setting("NETSIM_RATE", 0) * 1024L;
+    link_simulator.seed = link_setting("NETSIM_SEED", 1);
+}
+
+bool link_chance(int percent)
+{
+    return percent > 0 && rand_r(&link_simulator.seed) % 100 < percent;
+}
+
+//Attend le temps de traversée du lien : latence, gigue et sérialisation au débit choisi.
+void link_wait(size_t size)
+{
+    long delay_us = link_simulator.delay_ms * 1000L;
+    if (link_simulator.jitter_ms > 0)
+        delay_us += rand_r(&link_simulator.seed) % (link_simulator.jitter_ms * 1000L);
+    if (link_simulator.rate > 0)
+        delay_us += size * 1000000L / link_simulator.rate;
+    if (delay_us > 0)
+        usleep(delay_us);
+}
+
+void release_held_packet(int client_socket)
+{
+    if (link_simulator.holding) {
+        sendto(client_socket, link_simulator.held_packet, link_simulator.held_size, 0, (const struct sockaddr *)&link_simulator.held_addr, sizeof(link_simulator.held_addr));
+        link_simulator.holding = false;
+    }
+}
+#endif
+
+//Tous les envois du client passent par ici, pour que la simulation de lien puisse
+//perdre, doubler, retarder ou réordonner les paquets.
+ssize_t link_sendto(int client_socket, const void *packet, size_t size, const struct sockaddr_in *addr)
+{
+#ifdef NETSIM
+    link_wait(size);
+    link_simulator.sent++;
+    if (link_chance(link_simulator.loss)) {
+        link_simulator.dropped++;
+        return size;
+    }
+    if (link_chance(link_simulator.duplicate)) {
+        link_simulator.duplicated++;
+        sendto(client_socket, packet, size, 0, (const struct sockaddr *)addr, sizeof(*addr));
+    }
+    if (!link_simulator.holding && link_chance(link_simulator.reorder)) {
+        //Le paquet part après le suivant, ou au plus tard quand le client se met à
+        //attendre une réponse.
+        link_simulator.reordered++;
+        memcpy(link_simulator.held_packet, packet, size);
+        link_simulator.held_size = size;
+        link_simulator.held_addr = *addr;
+        link_simulator.holding = true;
+        return size;
+    }
+
+    ssize_t result = sendto(client_socket, packet, size, 0, (const struct sockaddr *)addr, sizeof(*addr));
+    release_held_packet(client_socket);
+    return result;
+#else
+    return sendto(client_socket, packet, size, 0, (const struct sockaddr *)addr, sizeof(*addr));
+#endif
+}
+
+//Envoie une fenêtre de paquets rangés bout à bout (send_window). Avec la simulation de
+//lien, ils partent un à un pour qu'elle puisse agir sur chacun.
+int link_send_window(int client_socket, const struct sockaddr_in *addr, const unsigned char *packets, size_t count, size_t last_size)
+{
+#ifdef NETSIM
+    for (size_t i = 0; i < count; ++i) {
+        if (link_sendto(client_socket, packets + i * MAX_PACKET_SIZE, i + 1 < count ? MAX_PACKET_SIZE : last_size, addr) < 0)
+            return -1;
+    }
+    return count;
+#else
+    return send_window(client_socket, addr, packets, count, last_size);
+#endif
+}
 
-#define RRQ_OPCODE 1
-#define WRQ_OPCODE 2
-#define DATA_OPCODE 3
-#define ACK_OPCODE 4
-#define ERROR_OPCODE 5
-#define OACK_OPCODE 6
+//Paquets de la dernière réception : avec UDP_GRO, une fenêtre du serveur peut arriver
+//en une seule fois.
+struct BurstReader burst_reader;
+
+//Toutes les réceptions du client passent par ici ; la simulation de lien y perd une
+//partie des paquets entrants.
+ssize_t link_recvfrom(int client_socket, struct BurstReader *reader, unsigned char *packet, size_t size, struct sockaddr_in *addr)
+{
+#ifdef NETSIM
+    release_held_packet(client_socket);
+#endif
+    while (1) {
+        ssize_t bytes_received = receive_burst_packet(client_socket, reader, packet, size, addr);
+#ifdef NETSIM
+        if (bytes_received >= 0 && link_chance(link_simulator.loss)) {
+            link_simulator.dropped++;
+            continue;
+        }
+#endif
+        return bytes_received;
+    }
+}
 
 void handle_error_packet(const char *error_packet)
 {
@@ -27,30 +179,95 @@ void handle_error_packet(const char *error_packet)
     fprintf(stderr, "Erreur du serveur (Code d'erreur: %d): %s\n", error_code, error_message);
 }
 
-void handle_wrq(int client_socket, struct sockaddr_in server_addr, const char *filename, const char *bigfile){
-    char wrq_packet[MAX_PACKET_SIZE];
-    wrq_packet[0] = 0;
-    wrq_packet[1] = WRQ_OPCODE;
-    strcpy(wrq_packet + 2, filename);
-    wrq_packet[strlen(filename) + 2] = 0;
-    strcpy(wrq_packet + strlen(filename) + 3, "octet");
-    wrq_packet[strlen(filename) + 8] = 0;
-
-    if(bigfile != NULL){
-        strcpy(wrq_packet + strlen(filename) + 9, bigfile);
-        wrq_packet[strlen(filename) + strlen(bigfile) + 9] = 0;
+//Les boucles d'attente communes (protocol.c) passent par la simulation de lien.
+void client_link_init(struct TransferLink *link, int client_socket, struct sockaddr_in server_data_addr)
+{
+    transfer_link_init(link, client_socket, server_data_addr, &burst_reader);
+    link->send = link_send_window;
+    link->receive = link_recvfrom;
+}
+
+//Cherche une option dans l'OACK reçu et renvoie sa valeur, ou NULL si le serveur ne l'a pas acceptée.
+const char *oack_option(const unsigned char *oack_packet, size_t length, const char *name)
+{
+    const char *cursor = (const char *)oack_packet + 2;
+    const char *end = (const char *)oack_packet + length;
+
+    while (cursor < end) {
+        const char *option = cursor;
+        const char *option_end = memchr(option, '\0', end - option);
+        if (option_end == NULL || option_end == option)
+            return NULL;
+
+        const char *value = option_end + 1;
+        const char *value_end = value < end ? memchr(value, '\0', end - value) : NULL;
+        if (value_end == NULL)
+            return NULL;
+
+        if (strcasecmp(option, name) == 0)
+            return value;
+        cursor = value_end + 1;
     }
+    return NULL;
+}
 
-    size_t packet_length = strlen(filename) + 9;
+//Envoie la requête RRQ/WRQ (mode octet, options "resume", "bigfile", "rollover", "delta"
+//et "windowsize") puis attend l'OACK, en renvoyant la requête à chaque délai d'attente.
+//L'adresse du socket de données du serveur est relevée sur l'OACK. resume_offset < 0
+//désactive l'option de reprise, window_size 1 l'option windowsize, rollover NULL
+//l'option rollover.
+int send_request(int client_socket, struct sockaddr_in server_addr, int opcode, const char *filename, const char *bigfile, const char *rollover, bool delta, int window_size, off_t resume_offset,
+                 struct sockaddr_in *server_data_addr, unsigned char *oack_packet, size_t *oack_size)
+{
+    char request_packet[MAX_PACKET_SIZE];
+    char offset_text[32];
+    char window_text[8];
+    size_t filename_size = strlen(filename) + 1;
+    size_t bigfile_size = bigfile != NULL ? strlen(bigfile) + 1 : 0;
+    if (resume_offset >= 0)
+        snprintf(offset_text, sizeof(offset_text), "%lld", (long long)resume_offset);
+    snprintf(window_text, sizeof(window_text), "%d", window_size);
+
+    if (2 + filename_size + sizeof("octet") + sizeof("resume") + sizeof(offset_text) + bigfile_size + sizeof("rollover") + sizeof("1")
+        + sizeof("delta") + sizeof("1") + sizeof("windowsize") + sizeof(window_text) > MAX_PACKET_SIZE) {
+        fprintf(stderr, "Nom de fichier trop long\n");
+        return TRANSFER_FAILED;
+    }
 
+    size_t packet_length = 0;
+    request_packet[packet_length++] = 0;
+    request_packet[packet_length++] = opcode;
+    memcpy(request_packet + packet_length, filename, filename_size);
+    packet_length += filename_size;
+    memcpy(request_packet + packet_length, "octet", sizeof("octet"));
+    packet_length += sizeof("octet");
+    if (resume_offset >= 0) {
+        memcpy(request_packet + packet_length, "resume", sizeof("resume"));
+        packet_length += sizeof("resume");
+        memcpy(request_packet + packet_length, offset_text, strlen(offset_text) + 1);
+        packet_length += strlen(offset_text) + 1;
+    }
     if (bigfile != NULL) {
-        packet_length += strlen(bigfile) + 1;
+        memcpy(request_packet + packet_length, bigfile, bigfile_size);
+        packet_length += bigfile_size;
     }
-
-    if (sendto(client_socket, wrq_packet, packet_length, 0, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-    {
-        perror("Erreur lors de l'envoi du paquet WRQ");
-        return;
+    if (rollover != NULL) {
+        memcpy(request_packet + packet_length, "rollover", sizeof("rollover"));
+        packet_length += sizeof("rollover");
+        memcpy(request_packet + packet_length, rollover, sizeof("1"));
+        packet_length += sizeof("1");
+    }
+    if (delta) {
+        memcpy(request_packet + packet_length, "delta", sizeof("delta"));
+        packet_length += sizeof("delta");
+        memcpy(request_packet + packet_length, "1", sizeof("1"));
+        packet_length += sizeof("1");
+    }
+    if (window_size > 1) {
+        memcpy(request_packet + packet_length, "windowsize", sizeof("windowsize"));
+        packet_length += sizeof("windowsize");
+        memcpy(request_packet + packet_length, window_text, strlen(window_text) + 1);
+        packet_length += strlen(window_text) + 1;
     }
 
     struct timeval timeout;
@@ -58,234 +275,366 @@ void handle_wrq(int client_socket, struct sockaddr_in server_addr, const char *f
     timeout.tv_usec = 0;
     if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) < 0){
         perror("Erreur lors du réglage de l'option de délai d'attente");
-        return;
+        return TRANSFER_FAILED;
     }
 
-    struct sockaddr_in server_data_addr;
-    memset(&server_data_addr, 0, sizeof(server_data_addr));
-    socklen_t server_data_addr_len = sizeof(server_data_addr);
-    unsigned char oack_packet[4];
-    ssize_t ack_recv = recvfrom(client_socket, oack_packet, sizeof(oack_packet), 0, (struct sockaddr *)&server_data_addr, &server_data_addr_len);
-    if (ack_recv < 0) {
-        perror("Erreur lors de la réception de l'OACK");
-        return;
-    } else if (ack_recv == 0) {
-        fprintf(stderr, "Connexion fermée par le serveur.\n");
-        return;
-    }
-
-    if (oack_packet[1] != OACK_OPCODE) {
-        fprintf(stderr, "Paquet reçu n'est pas un OACK.\n");
-        return;
-    }
-
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        perror("Erreur lors de l'ouverture du fichier en écriture");
-        close(client_socket);
-        return;
-    }
-    unsigned short block_number = 1;
-    int attempts = 1;
-
-
+    int attempts = 0;
     while (1)
     {
-        unsigned char data_packet[MAX_PACKET_SIZE];
-        ssize_t bytes_read = fread(data_packet + 4, 1, 512, file);
-
-        data_packet[1] = DATA_OPCODE;
-        data_packet[2] = block_number >> 8;
-        data_packet[3] = block_number & 0xFF;
-
-        if (sendto(client_socket, data_packet, 4 + bytes_read, 0, (struct sockaddr *)&server_data_addr, server_data_addr_len) < 0)
+        if (link_sendto(client_socket, request_packet, packet_length, &server_addr) < 0)
         {
-            perror("Erreur lors de l'envoi du paquet de données");
-            break;
+            perror("Erreur lors de l'envoi de la requête");
+            return TRANSFER_FAILED;
         }
 
-        unsigned char ack_packet[4];
-        ssize_t bytes_received = recvfrom(client_socket, ack_packet, 4, 0, NULL, NULL);
-        if (bytes_received < 0)
-        {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-            {
-                if (attempts >= 2)
-                {
-                    fprintf(stderr, "Nombre maximal de tentatives atteint. Sortie...\n");
-                    break;
-                }
+        memset(server_data_addr, 0, sizeof(*server_data_addr));
+        ssize_t oack_recv = link_recvfrom(client_socket, &burst_reader, oack_packet, MAX_PACKET_SIZE, server_data_addr);
+        if (oack_recv < 0) {
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && attempts < MAX_RETRIES) {
                 attempts++;
-                fprintf(stderr, "Un délai d'attente s'est produit, nouvelle tentative...\n");
+                fprintf(stderr, "Pas de réponse du serveur, nouvelle tentative...\n");
                 continue;
             }
-            else
-            {
-                perror("Erreur de réception du paquet ACK");
-                break;
-            }
-        }
-        else if (bytes_received == 0)
-        {
-            fprintf(stderr, "Connexion fermée par le client.\n");
-            break;
+            perror("Erreur lors de la réception de l'OACK");
+            return TRANSFER_INTERRUPTED;
+        } else if (oack_recv < 4) {
+            fprintf(stderr, "Connexion fermée par le serveur.\n");
+            return TRANSFER_INTERRUPTED;
         }
 
-        if (ack_packet[1] != ACK_OPCODE || (ack_packet[2] != (block_number >> 8)) || (ack_packet[3] != (block_number & 0xFF)))
-        {
-            fprintf(stderr, "Paquet ACK invalide reçu. Sortie...\n");
-            break;
+        if (oack_packet[1] == ERROR_OPCODE) {
+            handle_error_packet((const char *)oack_packet);
+            return TRANSFER_FAILED;
         }
 
-        if (block_number == 65535 && !bigfile) {
-            fprintf(stderr, "Fichier trop volumineux. Sortie...\n");
-            break;
+        if (oack_packet[1] != OACK_OPCODE) {
+            fprintf(stderr, "Paquet reçu n'est pas un OACK.\n");
+            return TRANSFER_INTERRUPTED;
         }
 
-        block_number++;
-
-        if (block_number == 0) {
-            block_number = 1;
-        }
-
-        if (bytes_read < 512)
-            break;
+        *oack_size = oack_recv;
+        return TRANSFER_OK;
     }
+}
 
-    fclose(file);
-    close(client_socket);
+//Position de reprise acceptée par le serveur (0 s'il n'a pas renvoyé l'option).
+off_t accepted_resume_offset(const unsigned char *oack_packet, size_t oack_size)
+{
+    const char *value = oack_option(oack_packet, oack_size, "resume");
+    if (value == NULL)
+        return 0;
+
+    char *end;
+    long long offset = strtoll(value, &end, 10);
+    if (end == value || *end != '\0' || offset < 0)
+        return 0;
+    return offset;
+}
 
+//Taille de fenêtre acceptée par le serveur, ramenée entre 1 et MAX_WINDOW_BLOCKS
+//(1 s'il n'a pas renvoyé l'option).
+int accepted_window_size(const unsigned char *oack_packet, size_t oack_size)
+{
+    const char *value = oack_option(oack_packet, oack_size, "windowsize");
+    int window_size = value != NULL ? atoi(value) : 1;
+    if (window_size < 1)
+        return 1;
+    return window_size < MAX_WINDOW_BLOCKS ? window_size : MAX_WINDOW_BLOCKS;
 }
 
+//Numéro qui suit le bloc 65535 pour ce transfert : celui de l'option rollover renvoyée
+//par le serveur, sinon 1 si l'on a demandé bigfile (qu'il accepte sans la renvoyer).
+int accepted_rollover(const unsigned char *oack_packet, size_t oack_size, const char *bigfile)
+{
+    const char *value = oack_option(oack_packet, oack_size, "rollover");
+    if (value != NULL && (strcmp(value, "0") == 0 || strcmp(value, "1") == 0))
+        return value[0] - '0';
+    return bigfile != NULL ? 1 : ROLLOVER_NONE;
+}
 
-void handle_rrq(int client_socket, struct sockaddr_in server_addr, const char *filename, const char *bigfile)
+//Taille du fichier local, affichée dans le bilan du transfert.
+off_t local_file_size(const char *filename)
 {
-    char rrq_packet[MAX_PACKET_SIZE];
-    rrq_packet[0] = 0;
-    rrq_packet[1] = RRQ_OPCODE;
-    strcpy(rrq_packet + 2, filename);
-    rrq_packet[strlen(filename) + 2] = 0;
-    strcpy(rrq_packet + strlen(filename) + 3, "octet");
-    rrq_packet[strlen(filename) + 8] = 0;
-
-    if(bigfile != NULL){
-        strcpy(rrq_packet + strlen(filename) + 9, bigfile);
-        rrq_packet[strlen(filename) + strlen(bigfile) + 9] = 0;
-    }
+    struct stat stat_buf;
+    if (stat(filename, &stat_buf) < 0)
+        return 0;
+    return stat_buf.st_size;
+}
 
-    size_t packet_length = strlen(filename) + 9;
+//*progress est la position de reprise : -1 tant qu'aucune tentative n'a passé l'OACK,
+//puis le nombre d'octets acquittés par le serveur, tenu à jour à chaque fenêtre.
+int handle_wrq(int client_socket, struct sockaddr_in server_addr, const char *filename, const char *bigfile, const char *rollover, bool delta, int window_size, off_t *progress){
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Erreur lors de l'ouverture du fichier en lecture");
+        return TRANSFER_FAILED;
+    }
 
-    if (bigfile != NULL) {
-        packet_length += strlen(bigfile) + 1;
+    struct sockaddr_in server_data_addr;
+    unsigned char oack_packet[MAX_PACKET_SIZE];
+    size_t oack_size;
+    int result = send_request(client_socket, server_addr, WRQ_OPCODE, filename, bigfile, rollover, delta, window_size, *progress,
+                              &server_data_addr, oack_packet, &oack_size);
+    if (result != TRANSFER_OK) {
+        close(fd);
+        return result;
     }
 
-    if (sendto(client_socket, rrq_packet, packet_length, 0, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    //Le serveur indique combien d'octets il a déjà : on reprend l'envoi à partir de là.
+    //Le fichier est lu par morceaux de READ_BUFFER_SIZE octets à read_offset (64 bits),
+    //puis découpé en blocs : un pread par bloc coûterait trop d'appels système.
+    off_t read_offset = accepted_resume_offset(oack_packet, oack_size);
+    if (read_offset > 0)
+        printf("Reprise de l'envoi à partir de l'octet %lld\n", (long long)read_offset);
+    *progress = read_offset;
+
+    //Le mode delta n'est utilisé que si le serveur l'a accepté.
+    //Un bloc identique à celui que le serveur possède déjà est remplacé par un MATCH.
+    //Avec une fenêtre, les blocs qui suivent le dernier bloc acquitté restent dans
+    //window et ne sont pas relus : seule la fin de la fenêtre est complétée.
+    delta = delta && oack_option(oack_packet, oack_size, "delta") != NULL;
+    window_size = accepted_window_size(oack_packet, oack_size);
+    struct Sender sender;
+    sender_init(&sender, accepted_rollover(oack_packet, oack_size, bigfile), delta, 1);
+    struct TransferLink link;
+    client_link_init(&link, client_socket, server_data_addr);
+    unsigned long long hole_bytes = 0;
+    unsigned char read_buffer[READ_BUFFER_SIZE];
+    size_t buffered = 0;
+    size_t consumed = 0;
+
+    unsigned char window[MAX_WINDOW_BLOCKS][MAX_PACKET_SIZE];
+    size_t block_sizes[MAX_WINDOW_BLOCKS];
+    size_t packet_sizes[MAX_WINDOW_BLOCKS];
+    bool end_of_file = false;
+    while (1)
     {
-        perror("Erreur lors de l'envoi du paquet RRQ");
-        return;
-    }
+        //Sans rollover, la fenêtre s'arrête au bloc 65535.
+        while (!end_of_file && sender.window_sent < window_size && (sender.rollover != ROLLOVER_NONE || sender.block_number + sender.window_sent <= 65535)) {
+            int index = sender.window_sent;
+            if (consumed == buffered) {
+                ssize_t refilled = read_sparse(fd, read_buffer, sizeof(read_buffer), read_offset, &hole_bytes);
+                if (refilled < 0) {
+                    perror("Erreur lors de la lecture du fichier");
+                    result = TRANSFER_FAILED;
+                    break;
+                }
+                read_offset += refilled;
+                buffered = refilled;
+                consumed = 0;
+            }
+            size_t bytes_read = buffered - consumed < 512 ? buffered - consumed : 512;
+            memcpy(window[index] + 4, read_buffer + consumed, bytes_read);
+            consumed += bytes_read;
+            block_sizes[index] = bytes_read;
+            packet_sizes[index] = sender_packet(&sender, window[index], bytes_read);
+            end_of_file = bytes_read < 512;
+        }
 
-    struct timeval timeout;
-    timeout.tv_sec = TIMEOUT_SECONDS;
-    timeout.tv_usec = 0;
-    if (setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) < 0){
-        perror("Erreur lors du réglage de l'option de délai d'attente");
-        return;
+        if (result != TRANSFER_OK)
+            break;
+
+        int count = sender.window_sent;
+        result = send_and_wait_ack(&link, window[0], count, packet_sizes[count - 1], &sender);
+        if (result != TRANSFER_OK)
+            break;
+
+        int acked_blocks = sender.acked_blocks;
+        bool more = true;
+        for (int i = 0; i < acked_blocks && more; ++i) {
+            *progress += block_sizes[i];
+            more = sender_next(&sender, block_sizes[i]);
+        }
+        if (!more)
+            break;
+
+        //Les blocs non acquittés passent en tête de la fenêtre.
+        memmove(window, window[acked_blocks], (count - acked_blocks) * sizeof(window[0]));
+        memmove(block_sizes, block_sizes + acked_blocks, (count - acked_blocks) * sizeof(block_sizes[0]));
+        memmove(packet_sizes, packet_sizes + acked_blocks, (count - acked_blocks) * sizeof(packet_sizes[0]));
     }
+    if (sender.too_big) {
+        fprintf(stderr, "Fichier trop volumineux. Sortie...\n");
+        result = TRANSFER_FAILED;
+    }
+
+    printf("Retransmissions : %lu rapides, %lu après délai d'attente\n", sender.stats.fast, sender.stats.timeout);
+    if (delta)
+        printf("Delta : %lu blocs remplacés par un MATCH\n", sender.matched_blocks);
+    if (hole_bytes > 0)
+        printf("Lecture creuse : %llu octets de trous\n", hole_bytes);
+    close(fd);
+    return result;
+}
 
+
+//*progress est la position de reprise : -1 tant qu'aucune tentative n'a ouvert le
+//fichier, puis le nombre d'octets écrits et acquittés, tenu à jour à chaque ACK.
+int handle_rrq(int client_socket, struct sockaddr_in server_addr, const char *filename, const char *bigfile, const char *rollover, bool delta, int window_size, off_t *progress)
+{
     struct sockaddr_in server_data_addr;
-    memset(&server_data_addr, 0, sizeof(server_data_addr));
-    socklen_t server_data_addr_len = sizeof(server_data_addr);
-
-    //attendre l'OACK
-    socklen_t addr_len = sizeof(server_addr);
-    unsigned char oack_packet[4];
-    ssize_t oack_recv = recvfrom(client_socket, oack_packet, sizeof(oack_packet), 0, (struct sockaddr *)&server_data_addr, &server_data_addr_len);
-    if (oack_recv < 0) {
-        perror("Erreur lors de la réception de l'OACK");
-        return;
-    } else if (oack_recv == 0) {
-        fprintf(stderr, "Connexion fermée par le serveur.\n");
-        return;
+    unsigned char oack_packet[MAX_PACKET_SIZE];
+    size_t oack_size;
+    int result = send_request(client_socket, server_addr, RRQ_OPCODE, filename, bigfile, rollover, delta, window_size, *progress,
+                              &server_data_addr, oack_packet, &oack_size);
+    if (result != TRANSFER_OK)
+        return result;
+
+    //En reprise, on garde les octets déjà reçus que le serveur a acceptés et on écrit à la suite.
+    //En mode delta, l'ancienne copie est gardée entière : elle est réécrite sur place et
+    //tronquée à la fin du transfert. Les blocs sont écrits par pwrite à la position tenue
+    //par receiver, sur 64 bits.
+    off_t offset = accepted_resume_offset(oack_packet, oack_size);
+    delta = delta && oack_option(oack_packet, oack_size, "delta") != NULL;
+    int fd = open(filename, offset > 0 || delta ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 && delta && offset == 0)
+        fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0 && offset > 0) {
+        printf("Reprise du téléchargement à partir de l'octet %lld\n", (long long)offset);
+        if (!delta && ftruncate(fd, offset) < 0) {
+            close(fd);
+            fd = -1;
+        }
     }
-
-    if (oack_packet[1] != OACK_OPCODE) {
-        fprintf(stderr, "Paquet reçu n'est pas un OACK.\n");
-        return;
+    if (fd < 0){
+        perror("Erreur lors de l'ouverture du fichier en écriture");
+        send_error_packet(client_socket, server_data_addr, 0, "Impossible de créer le fichier");
+        return TRANSFER_FAILED;
     }
+    *progress = offset;
+
+    off_t local_size = 0;
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) == 0)
+        local_size = stat_buf.st_size;
+    unsigned long zero_blocks = 0;
+    struct WriteBatch batch;
+    batch.length = 0;
+    struct Receiver receiver;
+    receiver_init(&receiver, accepted_rollover(oack_packet, oack_size, bigfile), delta, offset);
+
+    //Avec une fenêtre, le serveur envoie ses blocs en rafales : UDP_GRO permet au noyau
+    //de les livrer en une seule réception.
+    receiver.window_size = accepted_window_size(oack_packet, oack_size);
+    bool gro = receiver.window_size > 1 && set_udp_gro(client_socket, true);
 
     //envoyer ACK
-    unsigned char ack_packet[4];
-    ack_packet[0] = 0;
-    ack_packet[1] = ACK_OPCODE;
-    ack_packet[2] = 0;
-    ack_packet[3] = 0;
-    if (sendto(client_socket, ack_packet, 4, 0, (struct sockaddr *)&server_data_addr, server_data_addr_len) < 0){
+    unsigned char ack_packet[4 + SIGNATURE_SIZE];
+    size_t ack_size = build_ack(ack_packet, 0, delta ? fd : -1, receiver.write_offset, local_size);
+    if (link_sendto(client_socket, ack_packet, ack_size, &server_data_addr) < 0){
         perror("Erreur lors de l'envoi du ACK");
-        return;
+        close(fd);
+        receiver_close(&receiver);
+        return TRANSFER_INTERRUPTED;
     }
 
-    FILE *file = fopen(filename, "wb");
-    if (file == NULL){
-        char error_packet[MAX_PACKET_SIZE];
-        memset(error_packet, 0, MAX_PACKET_SIZE);
-        error_packet[0] = 0;
-        error_packet[1] = ERROR_OPCODE;
-        error_packet[2] = 0;
-        strcpy(error_packet + 4, "Impossible de créer le fichier");
-
-        sendto(client_socket, error_packet, 4 + strlen("Impossible de créer le fichier") + 1, 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
-        return;
-    }
-
-    unsigned short block_number = 1;
+    result = TRANSFER_INTERRUPTED;
+    struct TransferLink link;
+    client_link_init(&link, client_socket, server_data_addr);
 
     while (1)
     {
         unsigned char data_packet[MAX_PACKET_SIZE];
-        ssize_t bytes_received = recvfrom(client_socket, data_packet, MAX_PACKET_SIZE, 0, (struct sockaddr *)&server_data_addr, &server_data_addr_len);
+        ssize_t bytes_received = receive_data(&link, data_packet, ack_packet, ack_size);
 
-        if (data_packet[1] == 5){
-            handle_error_packet(data_packet);
-            break;
-        }
-        
         if (bytes_received < 0)
         {
             perror("Erreur lors de la réception du paquet de données");
             break;
         }
-        else if (bytes_received == 0){
+        else if (bytes_received < 4){
             fprintf(stderr, "Connexion fermée par le serveur.\n");
             break;
         }
 
-        fwrite(data_packet + 4, 1, bytes_received - 4, file);
+        if (data_packet[1] == ERROR_OPCODE){
+            handle_error_packet((const char *)data_packet);
+            result = TRANSFER_FAILED;
+            break;
+        }
+
+        //Le serveur renvoie son OACK si notre ACK 0 s'est perdu.
+        int action = data_packet[1] == OACK_OPCODE && receiver.expected == 1 ? RECEIVE_REPEAT_ACK : receiver_accept(&receiver, data_packet, bytes_received);
 
-        unsigned char ack_packet[4];
-        ack_packet[0] = 0;
-        ack_packet[1] = ACK_OPCODE;
-        ack_packet[2] = block_number >> 8;
-        ack_packet[3] = block_number & 0xFF;
-        sendto(client_socket, ack_packet, 4, 0, (struct sockaddr *)&server_data_addr, server_data_addr_len);
+        //Un doublon du dernier bloc reçu signifie que notre ACK s'est perdu : on le renvoie.
+        if (action == RECEIVE_REPEAT_ACK)
+            link_sendto(client_socket, ack_packet, ack_size, &server_data_addr);
 
-        if (bytes_received < 516){   
+        //Un MATCH annonce un bloc identique à celui de notre copie : on le relit sur place.
+        if (action == RECEIVE_MATCH) {
+            ssize_t local_bytes = pread(fd, data_packet + 4, 512, receiver.match_offset);
+            if (local_bytes >= 0) {
+                bytes_received = 4 + local_bytes;
+                action = receiver_accept_match(&receiver, data_packet, local_bytes);
+            }
+        }
+        //Les blocs nuls ne sont pas écrits : le fichier reçu reste creux.
+        if (action == RECEIVE_DELIVER) {
+            size_t data_size = bytes_received - 4;
+            int written;
+            do {
+                written = write_sparse(fd, &batch, data_packet + 4, data_size, receiver.write_offset, local_size);
+                if (written > 0)
+                    zero_blocks++;
+            } while (written >= 0 && receiver_next(&receiver, data_packet + 4, &data_size));
+            if (written < 0) {
+                perror("Erreur lors de l'écriture du fichier");
+                send_error_packet(client_socket, server_data_addr, 3, "Erreur d'écriture du fichier");
+                result = TRANSFER_FAILED;
+                break;
+            }
+        }
+
+        //Avec une fenêtre, on n'acquitte qu'à la fin de chaque fenêtre, ou tout de suite
+        //s'il y manque un bloc.
+        if (!receiver_ack_due(&receiver))
+            continue;
+
+        //Les blocs de la fenêtre sont écrits avant d'être acquittés.
+        if (flush_writes(fd, &batch) < 0) {
+            perror("Erreur lors de l'écriture du fichier");
+            send_error_packet(client_socket, server_data_addr, 3, "Erreur d'écriture du fichier");
+            result = TRANSFER_FAILED;
             break;
         }
-        block_number++;
-        if(block_number == 0){
-            block_number = 1;
+
+        ack_size = build_ack(ack_packet, receiver.acked, delta ? fd : -1, receiver.write_offset, local_size);
+        link_sendto(client_socket, ack_packet, ack_size, &server_data_addr);
+        *progress = receiver.write_offset;
+
+        if (receiver.complete){
+            result = TRANSFER_OK;
+            break;
+        }
+        if (receiver.too_big) {
+            fprintf(stderr, "Fichier trop volumineux. Sortie...\n");
+            result = TRANSFER_FAILED;
+            break;
         }
     }
 
-    fclose(file);
+    //La taille finale est fixée par troncature : elle allonge le fichier si les derniers
+    //blocs étaient nuls et coupe la fin d'une ancienne copie plus longue (mode delta).
+    if (result == TRANSFER_OK) {
+        if (ftruncate(fd, receiver.write_offset) < 0)
+            perror("Erreur lors de la troncature du fichier");
+        if (delta)
+            printf("Delta : %lu blocs repris de la copie locale\n", receiver.matched_blocks);
+        if (zero_blocks > 0)
+            printf("Ecriture creuse : %lu blocs nuls non écrits\n", zero_blocks);
+        if (gro)
+            printf("Réception groupée : %lu paquets en %lu réceptions\n", burst_reader.packets, burst_reader.receives);
+    }
+    close(fd);
+    receiver_close(&receiver);
+    return result;
 }
 
 int main(int argc, char *argv[])
 {
     if (argc < 5)
     {
-        fprintf(stderr, "Utilisation: %s <get/put> <nom_de_fichier> 127.0.0.1 69 <bigfile (optionnel)>\n", argv[0]);
+        fprintf(stderr, "Utilisation: %s <get/put> <nom_de_fichier> 127.0.0.1 69 [bigfile] [rollover=<0|1>] [delta] [windowsize=<blocs>] [backend=<gso|sendmmsg|sendto>]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -294,18 +643,29 @@ int main(int argc, char *argv[])
     const char *server_ip = argv[3];
     const int server_port = atoi(argv[4]);
     const char *bigfile = NULL;
-    if (argc == 6){
-        bigfile = argv[5];
-        if(strcmp(bigfile, "bigfile") != 0){
-            printf("Erreur: option non trouvé '%s'\n", argv[5]);
+    const char *rollover = NULL;
+    bool delta = false;
+    int window_size = 1;
+    for (int i = 5; i < argc; ++i) {
+        if (strcmp(argv[i], "bigfile") == 0)
+            bigfile = argv[i];
+        else if (strcmp(argv[i], "rollover=0") == 0 || strcmp(argv[i], "rollover=1") == 0)
+            rollover = argv[i] + strlen("rollover=");
+        else if (strcmp(argv[i], "delta") == 0)
+            delta = true;
+        else if (strncmp(argv[i], "windowsize=", strlen("windowsize=")) == 0 && atoi(argv[i] + strlen("windowsize=")) > 0)
+            window_size = atoi(argv[i] + strlen("windowsize="));
+        else if (strncmp(argv[i], "backend=", strlen("backend=")) == 0 && parse_backend(argv[i] + strlen("backend=")) >= 0)
+            io_backend = parse_backend(argv[i] + strlen("backend="));
+        else {
+            printf("Erreur: option non trouvé '%s'\n", argv[i]);
             exit(EXIT_FAILURE);
         }
     }
 
-    int client_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (client_socket < 0)
+    if (strcmp(operation, "put") != 0 && strcmp(operation, "get") != 0)
     {
-        perror("Erreur lors de la création de la socket");
+        fprintf(stderr, "Opération non supportée\n");
         exit(EXIT_FAILURE);
     }
 
@@ -315,18 +675,58 @@ int main(int argc, char *argv[])
     server_addr.sin_addr.s_addr = inet_addr(server_ip);
     server_addr.sin_port = htons(server_port);
 
-    if (strcmp(operation, "put") == 0){
-        handle_wrq(client_socket, server_addr, filename, bigfile);
-    }
-    else if (strcmp(operation, "get") == 0){
-        handle_rrq(client_socket, server_addr, filename, bigfile);
-    }
-    else
+    //Un transfert interrompu est repris là où il s'est arrêté plutôt que recommencé, si
+    //la tentative précédente a passé l'OACK : progress compte les octets acquittés par
+    //cette exécution, jamais la taille d'un fichier laissé par une autre (qui serait
+    //périmé). Chaque tentative utilise un nouveau socket pour ignorer les paquets de la
+    //précédente. En mode delta, on recommence, mais les blocs déjà transférés ne sont
+    //plus que des MATCH.
+#ifdef NETSIM
+    init_link_simulator();
+#endif
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int result = TRANSFER_INTERRUPTED;
+    off_t progress = -1;
+    for (int attempt = 0; attempt <= MAX_RESUMES && result == TRANSFER_INTERRUPTED; ++attempt)
     {
-        fprintf(stderr, "Opération non supportée\n");
-        exit(EXIT_FAILURE);
+        if (attempt > 0) {
+            fprintf(stderr, "Transfert interrompu, reprise (tentative %d/%d)...\n", attempt, MAX_RESUMES);
+            sleep(1);
+        }
+        if (delta)
+            progress = -1;
+
+        int client_socket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (client_socket < 0)
+        {
+            perror("Erreur lors de la création de la socket");
+            exit(EXIT_FAILURE);
+        }
+        burst_reader_init(&burst_reader);
+
+        if (strcmp(operation, "put") == 0){
+            result = handle_wrq(client_socket, server_addr, filename, bigfile, rollover, delta, window_size, &progress);
+        }
+        else {
+            result = handle_rrq(client_socket, server_addr, filename, bigfile, rollover, delta, window_size, &progress);
+        }
+
+        close(client_socket);
+    }
+
+    if (result == TRANSFER_OK) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        long long size = local_file_size(filename);
+        printf("Transfert terminé en %.3f s : %lld octets, %.1f Kio/s\n", seconds, size, seconds > 0 ? size / 1024.0 / seconds : 0);
     }
+#ifdef NETSIM
+    printf("Lien simulé : %lu paquets envoyés, %lu perdus, %lu doublés, %lu réordonnés\n",
+           link_simulator.sent, link_simulator.dropped, link_simulator.duplicated, link_simulator.reordered);
+#endif
 
-    close(client_socket);
-    return 0;
+    return result == TRANSFER_OK ? EXIT_SUCCESS : EXIT_FAILURE;
 }
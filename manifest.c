@@ -0,0 +1,208 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "manifest.h"
+
+pthread_mutex_t chunk_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct ChunkCacheEntry chunk_cache[CHUNK_CACHE_ENTRIES];
+unsigned long chunk_cache_clock = 0;
+
+//Chemin d'un morceau : CHUNK_DIR/ab/abcdef..., son hachage en hexadécimal, réparti
+//dans des sous-répertoires selon son premier octet.
+void chunk_path(const unsigned char *hash, char *path, size_t path_size)
+{
+    char hex[2 * CHUNK_HASH_SIZE + 1];
+    for (int i = 0; i < CHUNK_HASH_SIZE; ++i)
+        sprintf(hex + 2 * i, "%02x", hash[i]);
+    snprintf(path, path_size, "%s/%.2s/%s", CHUNK_DIR, hex, hex);
+}
+
+//Charge un morceau de length octets dans data, depuis le cache ou depuis le stockage
+//(il entre alors dans le cache). Renvoie -1 si le morceau manque ou n'a pas la taille
+//attendue.
+int load_chunk(const unsigned char *hash, size_t length, unsigned char *data, bool *cached)
+{
+    pthread_mutex_lock(&chunk_mutex);
+    for (int i = 0; i < CHUNK_CACHE_ENTRIES; ++i) {
+        if (chunk_cache[i].length == length && memcmp(chunk_cache[i].hash, hash, CHUNK_HASH_SIZE) == 0) {
+            memcpy(data, chunk_cache[i].data, length);
+            chunk_cache[i].last_used = ++chunk_cache_clock;
+            pthread_mutex_unlock(&chunk_mutex);
+            *cached = true;
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&chunk_mutex);
+    *cached = false;
+
+    char path[PATH_MAX];
+    chunk_path(hash, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    ssize_t bytes_read = read(fd, data, length);
+    close(fd);
+    if (bytes_read != (ssize_t)length)
+        return -1;
+
+    pthread_mutex_lock(&chunk_mutex);
+    int oldest = 0;
+    for (int i = 1; i < CHUNK_CACHE_ENTRIES; ++i) {
+        if (chunk_cache[i].last_used < chunk_cache[oldest].last_used)
+            oldest = i;
+    }
+    memcpy(chunk_cache[oldest].hash, hash, CHUNK_HASH_SIZE);
+    memcpy(chunk_cache[oldest].data, data, length);
+    chunk_cache[oldest].length = length;
+    chunk_cache[oldest].last_used = ++chunk_cache_clock;
+    pthread_mutex_unlock(&chunk_mutex);
+    return 0;
+}
+
+//Marque le fichier ouvert sur fd comme manifeste. Seul le serveur en pose la marque :
+//un client ne peut pas la donner à un fichier qu'il envoie.
+int mark_manifest(int fd)
+{
+    return fsetxattr(fd, MANIFEST_XATTR, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC) - 1, 0);
+}
+
+//Retire la marque d'un fichier réécrit sur place, qui n'est plus un manifeste.
+int unmark_manifest(int fd)
+{
+    if (fremovexattr(fd, MANIFEST_XATTR) < 0 && errno != ENODATA && errno != ENOTSUP)
+        return -1;
+    return 0;
+}
+
+//Lit l'en-tête du manifeste ouvert sur fd. Renvoie false si le fichier n'est pas marqué
+//comme manifeste, ou si ce manifeste n'est pas complet et cohérent : il est alors servi
+//tel quel.
+bool read_manifest_header(int fd, struct ManifestHeader *header)
+{
+    char mark[sizeof(MANIFEST_MAGIC)];
+    ssize_t mark_size = fgetxattr(fd, MANIFEST_XATTR, mark, sizeof(mark));
+    if (mark_size != sizeof(MANIFEST_MAGIC) - 1 || memcmp(mark, MANIFEST_MAGIC, mark_size) != 0)
+        return false;
+
+    struct stat stat_buf;
+    if (pread(fd, header, sizeof(*header), 0) != sizeof(*header) || fstat(fd, &stat_buf) < 0)
+        return false;
+    return memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) == 0
+        && header->chunk_count == (header->size + CHUNK_SIZE - 1) / CHUNK_SIZE
+        && (uint64_t)stat_buf.st_size == sizeof(*header) + (uint64_t)header->chunk_count * CHUNK_HASH_SIZE;
+}
+
+//Taille du fichier tel qu'il est servi : celle qu'indique son manifeste s'il est rangé
+//dans le stockage dédupliqué. *manifest, s'il n'est pas nul, dit lequel des deux cas.
+off_t stored_file_size(const char *filename, bool *manifest)
+{
+    if (manifest != NULL)
+        *manifest = false;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct ManifestHeader header;
+    struct stat stat_buf;
+    off_t size = 0;
+    if (read_manifest_header(fd, &header)) {
+        size = header.size;
+        if (manifest != NULL)
+            *manifest = true;
+    } else if (fstat(fd, &stat_buf) == 0) {
+        size = stat_buf.st_size;
+    }
+    close(fd);
+    return size;
+}
+
+//Ouvre le manifeste du fichier ouvert sur fd, s'il en est un. Renvoie 1 si c'est le cas,
+//0 pour un fichier ordinaire (manifest reste vide), -1 si sa liste de morceaux ne peut
+//pas être lue.
+int manifest_open(struct Manifest *manifest, int fd)
+{
+    memset(manifest, 0, sizeof(*manifest));
+    struct ManifestHeader header;
+    if (!read_manifest_header(fd, &header))
+        return 0;
+
+    size_t hashes_size = (size_t)header.chunk_count * CHUNK_HASH_SIZE;
+    manifest->size = header.size;
+    manifest->chunk_count = header.chunk_count;
+    manifest->chunks = malloc(hashes_size + 1);
+    if (manifest->chunks == NULL || pread(fd, manifest->chunks, hashes_size, sizeof(header)) != (ssize_t)hashes_size) {
+        free(manifest->chunks);
+        manifest->chunks = NULL;
+        return -1;
+    }
+    return 1;
+}
+
+//Charge dans buffer (CHUNK_SIZE octets) la fin du morceau qui contient offset (tout le
+//morceau si offset en est le début). Renvoie le nombre d'octets chargés, 0 en fin de
+//fichier, -1 si le morceau ne peut pas être lu.
+ssize_t manifest_chunk(struct Manifest *manifest, off_t offset, unsigned char *buffer)
+{
+    if (offset >= manifest->size)
+        return 0;
+
+    uint32_t index = offset / CHUNK_SIZE;
+    off_t chunk_start = (off_t)index * CHUNK_SIZE;
+    size_t length = manifest->size - chunk_start < CHUNK_SIZE ? (size_t)(manifest->size - chunk_start) : CHUNK_SIZE;
+    bool cached;
+    if (index >= manifest->chunk_count || load_chunk(manifest->chunks[index], length, buffer, &cached) < 0)
+        return -1;
+    manifest->chunk_reads++;
+    if (cached)
+        manifest->cache_hits++;
+
+    size_t skip = offset - chunk_start;
+    memmove(buffer, buffer + skip, length - skip);
+    return length - skip;
+}
+
+//Lit size octets du fichier décrit, à offset, comme pread : pour une lecture bloc par
+//bloc, le morceau courant est gardé dans buffer et n'est chargé qu'une fois.
+ssize_t manifest_read(struct Manifest *manifest, unsigned char *data, size_t size, off_t offset)
+{
+    if (manifest->buffer == NULL) {
+        manifest->buffer = malloc(CHUNK_SIZE);
+        if (manifest->buffer == NULL)
+            return -1;
+    }
+
+    size_t total = 0;
+    while (total < size && offset < manifest->size) {
+        off_t chunk_start = offset / CHUNK_SIZE * CHUNK_SIZE;
+        if (manifest->buffer_length == 0 || manifest->buffer_offset != chunk_start) {
+            ssize_t length = manifest_chunk(manifest, chunk_start, manifest->buffer);
+            if (length <= 0)
+                return -1;
+            manifest->buffer_offset = chunk_start;
+            manifest->buffer_length = length;
+        }
+
+        size_t part = chunk_start + manifest->buffer_length - offset;
+        if (part > size - total)
+            part = size - total;
+        memcpy(data + total, manifest->buffer + (offset - chunk_start), part);
+        total += part;
+        offset += part;
+    }
+    return total;
+}
+
+void manifest_close(struct Manifest *manifest)
+{
+    free(manifest->chunks);
+    free(manifest->buffer);
+    memset(manifest, 0, sizeof(*manifest));
+}
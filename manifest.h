@@ -0,0 +1,71 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+//Lecture du stockage dédupliqué, commune aux deux serveurs. Le serveur à threads
+//(option -d) découpe un fichier écrit en morceaux de CHUNK_SIZE octets, rangés une seule
+//fois dans CHUNK_DIR sous le nom de leur SHA-256, et remplace le fichier par un
+//manifeste : un en-tête suivi des hachages de ses morceaux dans l'ordre (le dernier est
+//plus court si size n'est pas un multiple de CHUNK_SIZE). Un manifeste est marqué hors
+//du contenu, par l'attribut étendu MANIFEST_XATTR : un fichier ordinaire qui commence
+//par MANIFEST_MAGIC est servi tel quel.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define CHUNK_DIR ".tftp_chunks"
+#define MANIFEST_MAGIC "TFTPMAN1"
+#define MANIFEST_XATTR "user.tftp.manifest"
+#define CHUNK_SIZE 65536
+#define CHUNK_HASH_SIZE 32
+#define CHUNK_CACHE_ENTRIES 64
+
+struct ManifestHeader {
+    char magic[8];
+    uint64_t size;
+    uint32_t chunk_count;
+    uint32_t reserved;
+};
+
+//Place du cache des morceaux, partagé par toutes les lectures. Une place libre a un
+//length nul (un morceau n'est jamais vide) ; la place remplacée est celle dont
+//last_used est le plus ancien.
+struct ChunkCacheEntry {
+    unsigned char hash[CHUNK_HASH_SIZE];
+    size_t length;
+    unsigned long last_used;
+    unsigned char data[CHUNK_SIZE];
+};
+
+//Un manifeste ouvert : size est la taille du fichier qu'il décrit, chunks la liste de
+//ses morceaux (jamais nulle une fois ouvert, même vide). buffer garde le dernier morceau
+//lu par manifest_read, qui commence à buffer_offset. chunk_reads compte les morceaux
+//chargés, cache_hits ceux trouvés dans le cache.
+struct Manifest {
+    off_t size;
+    uint32_t chunk_count;
+    unsigned char (*chunks)[CHUNK_HASH_SIZE];
+    unsigned char *buffer;
+    off_t buffer_offset;
+    size_t buffer_length;
+    unsigned long chunk_reads;
+    unsigned long cache_hits;
+};
+
+//chunk_mutex protège le cache des morceaux ; le serveur à threads s'en sert aussi pour
+//ses compteurs du taux de déduplication.
+extern pthread_mutex_t chunk_mutex;
+
+void chunk_path(const unsigned char *hash, char *path, size_t path_size);
+int load_chunk(const unsigned char *hash, size_t length, unsigned char *data, bool *cached);
+int mark_manifest(int fd);
+int unmark_manifest(int fd);
+bool read_manifest_header(int fd, struct ManifestHeader *header);
+off_t stored_file_size(const char *filename, bool *manifest);
+int manifest_open(struct Manifest *manifest, int fd);
+ssize_t manifest_chunk(struct Manifest *manifest, off_t offset, unsigned char *buffer);
+ssize_t manifest_read(struct Manifest *manifest, unsigned char *data, size_t size, off_t offset);
+void manifest_close(struct Manifest *manifest);
+
+#endif
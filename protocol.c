@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "trace.h"
+
+const struct OptionSpec option_table[] = {
+    {"bigfile", false},
+    {"resume", true},
+    {"blksize", true},
+    {"timeout", true},
+    {"tsize", true},
+    {"windowsize", true},
+    {"delta", true},
+    {"rollover", true},
+    {NULL, false},
+};
+
+pthread_mutex_t interrupted_uploads_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct InterruptedUpload interrupted_uploads[MAX_INTERRUPTED_UPLOADS];
+int interrupted_upload_count = 0;
+
+//Renvoie le champ terminé par un octet nul qui commence à *cursor et avance *cursor
+//juste après. Renvoie NULL si aucun octet nul n'apparaît avant end.
+const char *next_field(const char **cursor, const char *end)
+{
+    const char *field = *cursor;
+    if (field >= end)
+        return NULL;
+
+    const char *terminator = memchr(field, '\0', end - field);
+    if (terminator == NULL)
+        return NULL;
+
+    *cursor = terminator + 1;
+    return field;
+}
+
+bool option_has_value(const char *name)
+{
+    for (size_t i = 0; option_table[i].name != NULL; ++i) {
+        if (strcasecmp(name, option_table[i].name) == 0)
+            return option_table[i].has_value;
+    }
+    //Option inconnue : on suppose le format nom/valeur de la RFC 2347.
+    return true;
+}
+
+//Analyse une requête RRQ/WRQ directement dans le datagramme reçu, sans copie :
+//le nom de fichier, le mode et les options pointent à l'intérieur de packet.
+//Chaque champ doit se terminer par un octet nul avant la fin du datagramme.
+//Renvoie 0 si la requête est bien formée, -1 sinon.
+int parse_request(const char *packet, size_t length, struct TftpRequest *request)
+{
+    if (length < 4)
+        return -1;
+
+    const char *end = packet + length;
+    const char *cursor = packet + 2;
+
+    request->opcode = ((unsigned char)packet[0] << 8) | (unsigned char)packet[1];
+    request->option_count = 0;
+
+    request->filename = next_field(&cursor, end);
+    if (request->filename == NULL || request->filename[0] == '\0')
+        return -1;
+
+    request->mode = next_field(&cursor, end);
+    if (request->mode == NULL || request->mode[0] == '\0')
+        return -1;
+
+    while (cursor < end) {
+        const char *name = next_field(&cursor, end);
+        if (name == NULL)
+            return -1;
+        if (name[0] == '\0')
+            break;
+
+        const char *value = NULL;
+        if (option_has_value(name)) {
+            value = next_field(&cursor, end);
+            if (value == NULL)
+                return -1;
+        }
+
+        if (request->option_count == MAX_OPTIONS)
+            return -1;
+        request->options[request->option_count].name = name;
+        request->options[request->option_count].value = value;
+        request->option_count++;
+    }
+
+    return 0;
+}
+
+const struct TftpOption *find_option(const struct TftpRequest *request, const char *name)
+{
+    for (int i = 0; i < request->option_count; ++i) {
+        if (strcasecmp(request->options[i].name, name) == 0)
+            return &request->options[i];
+    }
+    return NULL;
+}
+
+//Position de l'écriture de filename dans la table, -1 si elle n'y est pas. Appelée
+//sous interrupted_uploads_mutex.
+int find_upload(const char *filename)
+{
+    for (int i = 0; i < interrupted_upload_count; ++i) {
+        if (strcmp(interrupted_uploads[i].filename, filename) == 0)
+            return i;
+    }
+    return -1;
+}
+
+void remove_upload(int index)
+{
+    interrupted_upload_count--;
+    memmove(interrupted_uploads + index, interrupted_uploads + index + 1, (interrupted_upload_count - index) * sizeof(interrupted_uploads[0]));
+}
+
+//Inscrit une écriture dont le fichier vient d'être ouvert, avec size octets déjà
+//acquittés, à la place d'une écriture plus ancienne du même fichier. La table pleine,
+//la plus ancienne est oubliée.
+void track_upload(const char *filename, struct sockaddr_in client_addr, off_t size)
+{
+    if (strlen(filename) >= MAX_PACKET_SIZE)
+        return;
+    pthread_mutex_lock(&interrupted_uploads_mutex);
+    int index = find_upload(filename);
+    if (index >= 0)
+        remove_upload(index);
+    if (interrupted_upload_count == MAX_INTERRUPTED_UPLOADS)
+        remove_upload(0);
+    struct InterruptedUpload *upload = &interrupted_uploads[interrupted_upload_count++];
+    strcpy(upload->filename, filename);
+    upload->client_addr = client_addr;
+    upload->size = size;
+    pthread_mutex_unlock(&interrupted_uploads_mutex);
+}
+
+//Avance la position acquittée d'une écriture, ou la retire de la table si elle est
+//terminée (size < 0). Sans effet si une nouvelle WRQ a déjà pris son entrée : une session
+//abandonnée par son client, qui attend encore ses délais, ne la fait pas revivre.
+void update_upload(const char *filename, struct sockaddr_in client_addr, off_t size)
+{
+    pthread_mutex_lock(&interrupted_uploads_mutex);
+    int index = find_upload(filename);
+    if (index >= 0 && interrupted_uploads[index].client_addr.sin_addr.s_addr == client_addr.sin_addr.s_addr
+        && interrupted_uploads[index].client_addr.sin_port == client_addr.sin_port) {
+        if (size < 0)
+            remove_upload(index);
+        else
+            interrupted_uploads[index].size = size;
+    }
+    pthread_mutex_unlock(&interrupted_uploads_mutex);
+}
+
+//Retire l'écriture de filename et renvoie le nombre d'octets que le client
+//client_address peut en reprendre : 0 si le fichier n'en a pas ou si elle venait d'un
+//autre client. Appelée par chaque WRQ, qui remplace de toute façon la copie.
+off_t take_interrupted_upload(const char *filename, in_addr_t client_address)
+{
+    off_t size = 0;
+    pthread_mutex_lock(&interrupted_uploads_mutex);
+    int index = find_upload(filename);
+    if (index >= 0) {
+        if (interrupted_uploads[index].client_addr.sin_addr.s_addr == client_address)
+            size = interrupted_uploads[index].size;
+        remove_upload(index);
+    }
+    pthread_mutex_unlock(&interrupted_uploads_mutex);
+    return size;
+}
+
+//Option "resume" : le client indique la position (en octets) à partir de laquelle reprendre.
+//La position retenue est bornée par file_size, puis renvoyée dans l'OACK : pour une
+//lecture, la taille du fichier tel que le serveur le sert ; pour une écriture, ce que
+//l'écriture interrompue du même client en a laissé (take_interrupted_upload), 0 sinon. Renvoie 0 sans l'option, -1 si sa valeur est invalide.
+off_t negotiate_resume_offset(const struct TftpRequest *request, off_t file_size, struct TftpOption *accepted_options, int *accepted_count, char *offset_text, size_t offset_text_size)
+{
+    const struct TftpOption *option = find_option(request, "resume");
+    if (option == NULL)
+        return 0;
+
+    char *end;
+    errno = 0;
+    long long offset = strtoll(option->value, &end, 10);
+    if (errno != 0 || end == option->value || *end != '\0' || offset < 0)
+        return -1;
+
+    if (offset > file_size)
+        offset = file_size;
+
+    snprintf(offset_text, offset_text_size, "%lld", offset);
+    accepted_options[*accepted_count].name = "resume";
+    accepted_options[*accepted_count].value = offset_text;
+    (*accepted_count)++;
+    return offset;
+}
+
+//Option "windowsize" (RFC 7440) : nombre de blocs envoyés avant d'attendre un ACK, borné
+//par MAX_WINDOW_BLOCKS puis renvoyé dans l'OACK. Elle n'est pas retenue en mode delta,
+//où chaque ACK porte la signature du seul bloc qui le suit. Renvoie 1 sans l'option,
+//-1 si sa valeur est invalide.
+int negotiate_window_size(const struct TftpRequest *request, bool delta, struct TftpOption *accepted_options, int *accepted_count, char *window_text, size_t window_text_size)
+{
+    const struct TftpOption *option = find_option(request, "windowsize");
+    if (option == NULL || delta)
+        return 1;
+
+    char *end;
+    long window_size = strtol(option->value, &end, 10);
+    if (end == option->value || *end != '\0' || window_size < 1 || window_size > 65535)
+        return -1;
+    if (window_size > MAX_WINDOW_BLOCKS)
+        window_size = MAX_WINDOW_BLOCKS;
+
+    snprintf(window_text, window_text_size, "%ld", window_size);
+    accepted_options[*accepted_count].name = "windowsize";
+    accepted_options[*accepted_count].value = window_text;
+    (*accepted_count)++;
+    return window_size;
+}
+
+//Option "rollover" : numéro (0 ou 1) qui suit le bloc 65535, renvoyé dans l'OACK. Sans
+//elle, l'ancienne option "bigfile" vaut rollover 1 ; sans l'une ni l'autre, le fichier
+//est borné à 65535 blocs. Renvoie 0, 1 ou ROLLOVER_NONE, -2 si la valeur est invalide.
+int negotiate_rollover(const struct TftpRequest *request, struct TftpOption *accepted_options, int *accepted_count)
+{
+    const struct TftpOption *option = find_option(request, "rollover");
+    if (option == NULL)
+        return find_option(request, "bigfile") != NULL ? 1 : ROLLOVER_NONE;
+    if (strcmp(option->value, "0") != 0 && strcmp(option->value, "1") != 0)
+        return -2;
+
+    accepted_options[*accepted_count].name = "rollover";
+    accepted_options[*accepted_count].value = option->value[0] == '0' ? "0" : "1";
+    (*accepted_count)++;
+    return option->value[0] - '0';
+}
+
+//Construit l'OACK en y recopiant les options acceptées (format nom/valeur de la RFC 2347).
+//Sans option, l'OACK garde sa forme historique de quatre octets.
+size_t build_oack(unsigned char *oack_packet, const struct TftpOption *options, int option_count)
+{
+    oack_packet[0] = 0;
+    oack_packet[1] = OACK_OPCODE;
+    if (option_count == 0) {
+        oack_packet[2] = 0;
+        oack_packet[3] = 0;
+        return 4;
+    }
+
+    size_t length = 2;
+    for (int i = 0; i < option_count; ++i) {
+        size_t name_size = strlen(options[i].name) + 1;
+        size_t value_size = strlen(options[i].value) + 1;
+        if (length + name_size + value_size > MAX_PACKET_SIZE)
+            break;
+        memcpy(oack_packet + length, options[i].name, name_size);
+        length += name_size;
+        memcpy(oack_packet + length, options[i].value, value_size);
+        length += value_size;
+    }
+    return length;
+}
+
+//Un chemin demandé doit rester sous le répertoire du serveur : pas de chemin absolu,
+//pas de composant vide, "." ou "..", ni de fichier caché (comme le catalogue).
+bool is_safe_path(const char *path)
+{
+    if (path[0] == '\0' || path[0] == '/')
+        return false;
+
+    const char *component = path;
+    while (1) {
+        const char *slash = strchr(component, '/');
+        size_t length = slash != NULL ? (size_t)(slash - component) : strlen(component);
+        if (length == 0 || component[0] == '.' || memchr(component, '\\', length) != NULL)
+            return false;
+        if (slash == NULL)
+            return true;
+        component = slash + 1;
+    }
+}
+
+//Numéro de bloc d'un paquet DATA ou ACK, -1 pour un paquet trop court.
+int packet_block(const unsigned char *packet, ssize_t size)
+{
+    return size >= 4 ? (packet[2] << 8) | packet[3] : -1;
+}
+
+#ifndef TRACE_PROBES
+//Sans sondes, TRACE_PROBE ne garde qu'un appel jamais exécuté à cette fonction : les
+//arguments restent vérifiés et comptés comme utilisés.
+void trace_probe_disabled(int first, ...)
+{
+    (void)first;
+}
+#endif
+
+//Socket de données d'un transfert, lié à un port libre de address. timeout_seconds
+//règle le délai d'attente des réceptions (SO_RCVTIMEO) des boucles bloquantes ; 0 le
+//laisse de côté, pour un socket surveillé par epoll.
+int create_data_socket(in_addr_t address, int timeout_seconds)
+{
+    int data_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (data_socket < 0) {
+        perror("Erreur lors de la création du socket de données");
+        return -1;
+    }
+
+    struct sockaddr_in data_server_addr;
+    memset(&data_server_addr, 0, sizeof(data_server_addr));
+    data_server_addr.sin_family = AF_INET;
+    data_server_addr.sin_addr.s_addr = address;
+    data_server_addr.sin_port = htons(0);
+    if (bind(data_socket, (struct sockaddr *)&data_server_addr, sizeof(data_server_addr)) < 0) {
+        perror("Erreur lors de la liaison du socket de données");
+        close(data_socket);
+        return -1;
+    }
+
+    if (timeout_seconds > 0) {
+        struct timeval timeout;
+        timeout.tv_sec = timeout_seconds;
+        timeout.tv_usec = 0;
+        if (setsockopt(data_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) < 0){
+            perror("Erreur lors du réglage de l'option de délai d'attente");
+            close(data_socket);
+            return -1;
+        }
+    }
+
+    return data_socket;
+}
+
+void send_error_packet(int socket_fd, struct sockaddr_in addr, int error_code, const char *error_message)
+{
+    unsigned char error_packet[MAX_PACKET_SIZE];
+    size_t error_size = build_error_packet(error_packet, error_code, error_message);
+    TRACE_PROBE(error, ntohs(addr.sin_port), error_code);
+    sendto(socket_fd, error_packet, error_size, 0, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+//Vrai si le paquet reçu vient du pair du transfert (même adresse et même port). Sinon
+//l'expéditeur reçoit l'erreur 5 (RFC 1350) et le paquet doit être ignoré : un socket de
+//la réserve du serveur a pu servir à un autre client.
+bool from_peer(int socket_fd, struct sockaddr_in peer_addr, struct sockaddr_in sender_addr)
+{
+    if (sender_addr.sin_addr.s_addr == peer_addr.sin_addr.s_addr && sender_addr.sin_port == peer_addr.sin_port)
+        return true;
+    send_error_packet(socket_fd, sender_addr, 5, "Identifiant de transfert inconnu");
+    return false;
+}
+
+//Réception d'un paquet, dans la rafale en cours de reader (receive_burst_packet) ou,
+//sans reader, par un simple recvfrom.
+ssize_t receive_packet(int socket_fd, struct BurstReader *reader, unsigned char *packet, size_t size, struct sockaddr_in *addr)
+{
+    if (reader != NULL)
+        return receive_burst_packet(socket_fd, reader, packet, size, addr);
+    socklen_t addr_len = sizeof(*addr);
+    return recvfrom(socket_fd, packet, size, 0, (struct sockaddr *)addr, &addr_len);
+}
+
+void transfer_link_init(struct TransferLink *link, int socket_fd, struct sockaddr_in peer, struct BurstReader *reader)
+{
+    link->socket_fd = socket_fd;
+    link->peer = peer;
+    link->reader = reader;
+    link->send = send_window;
+    link->receive = receive_packet;
+}
+
+//Envoie une fenêtre de count paquets rangés bout à bout puis attend l'ACK qui en
+//acquitte au moins le premier. La fenêtre est renvoyée à chaque délai d'attente, jusqu'à
+//MAX_RETRIES fois. Renvoie LINK_OK, LINK_PEER_ERROR ou LINK_FAILED.
+int send_and_wait_ack(struct TransferLink *link, const unsigned char *packets, size_t count, size_t last_size, struct Sender *sender)
+{
+    int port = ntohs(link->peer.sin_port);
+    int attempts = 0;
+    bool resend = true;
+
+    while (1)
+    {
+        if (resend && link->send(link->socket_fd, &link->peer, packets, count, last_size) < 0)
+        {
+            perror("Erreur lors de l'envoi du paquet");
+            return LINK_FAILED;
+        }
+
+        unsigned char ack_packet[MAX_PACKET_SIZE];
+        struct sockaddr_in sender_addr;
+        ssize_t bytes_received = link->receive(link->socket_fd, link->reader, ack_packet, MAX_PACKET_SIZE, &sender_addr);
+        if (bytes_received >= 0 && !from_peer(link->socket_fd, link->peer, sender_addr))
+        {
+            resend = false;
+            continue;
+        }
+        if (bytes_received < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (attempts >= MAX_RETRIES)
+                {
+                    fprintf(stderr, "Nombre maximal de tentatives atteint. Sortie...\n");
+                    return LINK_FAILED;
+                }
+                attempts++;
+                resend = true;
+                sender_timeout(sender);
+                TRACE_PROBE(retransmit, port, sender->block_number, 0);
+                fprintf(stderr, "Un délai d'attente s'est produit, nouvelle tentative...\n");
+                continue;
+            }
+            perror("Erreur de réception du paquet ACK");
+            return LINK_FAILED;
+        }
+        else if (bytes_received == 0)
+        {
+            fprintf(stderr, "Connexion fermée par le pair.\n");
+            return LINK_FAILED;
+        }
+
+        TRACE_PROBE(ack_receive, port, packet_block(ack_packet, bytes_received));
+        int action = sender_ack(sender, ack_packet, bytes_received);
+        if (action == ACK_DONE)
+            return LINK_OK;
+        if (action == ACK_ERROR)
+        {
+            ack_packet[bytes_received < MAX_PACKET_SIZE ? bytes_received : MAX_PACKET_SIZE - 1] = '\0';
+            fprintf(stderr, "Erreur reçue (Code d'erreur: %d): %s\n", ack_packet[3], (const char *)ack_packet + 4);
+            return LINK_PEER_ERROR;
+        }
+        if (action == ACK_INVALID)
+        {
+            fprintf(stderr, "Paquet ACK invalide reçu. Sortie...\n");
+            return LINK_FAILED;
+        }
+        resend = action == ACK_RESEND;
+        if (resend)
+            TRACE_PROBE(retransmit, port, sender->block_number, 1);
+    }
+}
+
+//Attend le prochain paquet de données, pris dans la dernière rafale du lien s'il en
+//reste. A chaque délai d'attente, le dernier paquet envoyé (OACK ou ACK) est renvoyé
+//pour relancer l'expéditeur.
+ssize_t receive_data(struct TransferLink *link, unsigned char *data_packet, const unsigned char *last_packet, size_t last_packet_size)
+{
+    int attempts = 0;
+
+    while (1)
+    {
+        struct sockaddr_in sender_addr;
+        ssize_t bytes_received = link->receive(link->socket_fd, link->reader, data_packet, MAX_PACKET_SIZE, &sender_addr);
+        if (bytes_received >= 0 && !from_peer(link->socket_fd, link->peer, sender_addr))
+            continue;
+        if (bytes_received >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return bytes_received;
+
+        if (attempts >= MAX_RETRIES)
+        {
+            fprintf(stderr, "Nombre maximal de tentatives atteint. Sortie...\n");
+            return -1;
+        }
+        attempts++;
+        fprintf(stderr, "Un délai d'attente s'est produit, renvoi du dernier paquet...\n");
+        TRACE_PROBE(retransmit, ntohs(link->peer.sin_port), packet_block(last_packet, last_packet_size), 0);
+        link->send(link->socket_fd, &link->peer, last_packet, 1, last_packet_size);
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+//Protocole TFTP commun au client et aux deux serveurs : analyse des requêtes (RRQ,
+//WRQ) et de leurs options, négociation et OACK, contrôle des chemins, socket de
+//données, et les deux boucles d'attente bloquantes (ACK d'une fenêtre, paquet de
+//données suivant) autour du cœur Sender/Receiver de transfer.h. L'analyseur est relu
+//par tests/fuzz_parse.c et mesuré par tests/bench_parse.c.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "transfer.h"
+
+#define MAX_OPTIONS 8
+#define MAX_RETRIES 3
+#define MAX_INTERRUPTED_UPLOADS 32
+
+//Résultats de send_and_wait_ack : fenêtre acquittée, erreur envoyée par le pair (le
+//transfert est refusé) ou transfert interrompu (délais épuisés, paquet invalide).
+#define LINK_OK 0
+#define LINK_PEER_ERROR 1
+#define LINK_FAILED 2
+
+struct TftpOption {
+    const char *name;
+    const char *value;
+};
+
+struct TftpRequest {
+    unsigned short opcode;
+    const char *filename;
+    const char *mode;
+    int option_count;
+    struct TftpOption options[MAX_OPTIONS];
+};
+
+//Options connues. Celles sans valeur (comme "bigfile") sont de simples drapeaux,
+//les autres suivent le format nom/valeur de la RFC 2347.
+struct OptionSpec {
+    const char *name;
+    bool has_value;
+};
+
+//Un transfert vu des boucles d'attente : son socket, son pair (un paquet venu d'une
+//autre adresse reçoit l'erreur 5) et la réception groupée en cours (NULL pour lire
+//paquet par paquet). send et receive valent send_window et receive_packet ; le client
+//les remplace pour simuler un lien dégradé (NETSIM).
+struct TransferLink {
+    int socket_fd;
+    struct sockaddr_in peer;
+    struct BurstReader *reader;
+    int (*send)(int socket_fd, const struct sockaddr_in *addr, const unsigned char *packets, size_t count, size_t last_size);
+    ssize_t (*receive)(int socket_fd, struct BurstReader *reader, unsigned char *packet, size_t size, struct sockaddr_in *addr);
+};
+
+//Une écriture en cours ou interrompue : le serveur a acquitté size octets de filename
+//au client client_addr. Seule une nouvelle WRQ venue de la même adresse peut reprendre
+//à cette position ; toute autre WRQ sur le fichier recommence au début.
+struct InterruptedUpload {
+    char filename[MAX_PACKET_SIZE];
+    struct sockaddr_in client_addr;
+    off_t size;
+};
+
+extern const struct OptionSpec option_table[];
+
+const char *next_field(const char **cursor, const char *end);
+bool option_has_value(const char *name);
+int parse_request(const char *packet, size_t length, struct TftpRequest *request);
+const struct TftpOption *find_option(const struct TftpRequest *request, const char *name);
+
+off_t negotiate_resume_offset(const struct TftpRequest *request, off_t file_size, struct TftpOption *accepted_options, int *accepted_count, char *offset_text, size_t offset_text_size);
+int negotiate_window_size(const struct TftpRequest *request, bool delta, struct TftpOption *accepted_options, int *accepted_count, char *window_text, size_t window_text_size);
+int negotiate_rollover(const struct TftpRequest *request, struct TftpOption *accepted_options, int *accepted_count);
+int find_upload(const char *filename);
+void remove_upload(int index);
+void track_upload(const char *filename, struct sockaddr_in client_addr, off_t size);
+void update_upload(const char *filename, struct sockaddr_in client_addr, off_t size);
+off_t take_interrupted_upload(const char *filename, in_addr_t client_address);
+size_t build_oack(unsigned char *oack_packet, const struct TftpOption *options, int option_count);
+bool is_safe_path(const char *path);
+int packet_block(const unsigned char *packet, ssize_t size);
+
+int create_data_socket(in_addr_t address, int timeout_seconds);
+void send_error_packet(int socket_fd, struct sockaddr_in addr, int error_code, const char *error_message);
+bool from_peer(int socket_fd, struct sockaddr_in peer_addr, struct sockaddr_in sender_addr);
+ssize_t receive_packet(int socket_fd, struct BurstReader *reader, unsigned char *packet, size_t size, struct sockaddr_in *addr);
+void transfer_link_init(struct TransferLink *link, int socket_fd, struct sockaddr_in peer, struct BurstReader *reader);
+int send_and_wait_ack(struct TransferLink *link, const unsigned char *packets, size_t count, size_t last_size, struct Sender *sender);
+ssize_t receive_data(struct TransferLink *link, unsigned char *data_packet, const unsigned char *last_packet, size_t last_packet_size);
+
+#endif
@@ -1,9 +1,13 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
@@ -11,159 +15,1593 @@
 #include <pthread.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <poll.h>
+
+#include "../transfer.h"
+#include "../protocol.h"
+#include "../admission.h"
+#include "../manifest.h"
+#include "../trace.h"
 
 #define SERVER_PORT 69
 #define IP "127.0.0.1"
-#define MAX_PACKET_SIZE 516
 #define TIMEOUT_SECONDS 5
-#define MAX_FILES 100
+#define LINGER_SECONDS 15
+#define FILE_LOCK_BUCKETS 1024
+#define FILE_LOCK_WAIT_SECONDS 2
+#define DATA_SOCKET_POOL_MIN 8
+#define DATA_SOCKET_POOL_MAX 256
+#define CATALOG_FILE ".tftp_catalog"
+#define CATALOG_MAGIC "TFTPCAT1"
+#define CATALOG_REBUILD_INTERVAL 1
+#define READAHEAD_BLOCKS (CHUNK_SIZE / 512)
+#define HANDOFF_SOCKET ".tftp_handoff"
+#define HANDOFF_MAGIC "TFTPHOF2"
+#define HANDOFF_VERSION 2
+
+//Instantané du catalogue, tel qu'enregistré dans CATALOG_FILE et chargé par mmap :
+//l'en-tête, les répertoires avec leur date de modification, les fichiers, puis les noms
+//(chaînes terminées par un octet nul). Répertoires et fichiers sont triés par nom.
+struct CatalogHeader {
+    char magic[8];
+    uint32_t file_count;
+    uint32_t dir_count;
+    uint64_t names_size;
+};
 
-#define RRQ_OPCODE 1
-#define WRQ_OPCODE 2
-#define DATA_OPCODE 3
-#define ACK_OPCODE 4
-#define ERROR_OPCODE 5
-#define OACK_OPCODE 6
+struct CatalogDir {
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t name_offset;
+    uint32_t reserved;
+};
 
-void send_error_packet(int server_socket, struct sockaddr_in client_addr, int error_code, const char *error_message);
-void *handle_request(void *arg);
-void handle_wrq(int server_socket, struct sockaddr_in client_addr, char *filename, bool bigfile);
-void handle_rrq(int server_socket, struct sockaddr_in client_addr, char *filename,bool bigfile);
+struct Catalog {
+    void *data;
+    size_t size;
+    bool mapped;
+    const struct CatalogHeader *header;
+    const struct CatalogDir *dirs;
+    const uint32_t *files;
+    const char *names;
+    unsigned char *dir_checked;
+};
+
+struct ScanEntry {
+    char *name;
+    struct timespec mtime;
+};
+
+struct ScanList {
+    struct ScanEntry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+//Lecture anticipée d'un fichier servi : les blocs sont lus par fenêtres de
+//READAHEAD_BLOCKS blocs, et le noyau est prié de charger la fenêtre suivante pendant
+//que la fenêtre courante est envoyée. stall_seconds cumule le temps passé à attendre
+//le disque, max_stall_seconds la plus longue de ces attentes. Pour un fichier rangé
+//dans le stockage dédupliqué, fd est son manifeste, ouvert dans manifest : chaque
+//fenêtre est alors un morceau, pris dans le cache des morceaux s'il y est.
+struct ReadAhead {
+    int fd;
+    unsigned char buffer[READAHEAD_BLOCKS * 512];
+    size_t length;
+    size_t position;
+    off_t next_offset;
+    unsigned long refills;
+    double stall_seconds;
+    double max_stall_seconds;
+    unsigned long long hole_bytes;
+    struct UpstreamFetch *fetch;
+    struct Manifest manifest;
+};
+
+//Écriture dédupliquée en cours : le morceau courant s'accumule dans buffer pendant que
+//hash le hache ; chaque morceau complet est rangé, s'il est nouveau, et son hachage
+//ajouté à hashes. new_chunks et new_bytes comptent ce qui a réellement été écrit.
+struct ChunkWriter {
+    unsigned char buffer[CHUNK_SIZE];
+    size_t length;
+    struct Sha256 hash;
+    unsigned char (*hashes)[CHUNK_HASH_SIZE];
+    uint32_t chunk_count;
+    uint32_t capacity;
+    uint64_t size;
+    unsigned long new_chunks;
+    unsigned long long new_bytes;
+};
+
+//Rapatriement d'un fichier depuis le serveur amont (mode relais). Les clients qui
+//demandent le fichier pendant le rapatriement lisent le fichier de cache au fur et à
+//mesure que size grandit ; progress les réveille à chaque bloc reçu. Tous les champs
+//modifiables sont protégés par fetches_mutex.
+//Verrou d'un fichier servi, retrouvé par son nom dans file_locks : créé à la première
+//demande, libéré avec sa dernière référence. Les lectures le prennent partagé ; une
+//écriture ne le prend exclusif que pour ouvrir (et tronquer) le fichier, puis pour fixer
+//sa taille ou poser son manifeste à la fin, jamais pendant qu'elle attend le réseau.
+//readers et writer sont tenus sous file_locks_mutex, ce qui permet de le rendre depuis
+//un autre thread que celui qui l'a pris (un rapatriement le fait). Une écriture en
+//attente passe avant les nouvelles lectures.
+struct FileLock {
+    struct FileLock *next;
+    unsigned long references;
+    int readers;
+    bool writer;
+    int writers_waiting;
+    pthread_cond_t released;
+    char filename[];
+};
+
+struct UpstreamFetch {
+    char filename[MAX_PACKET_SIZE];
+    char part_path[MAX_PACKET_SIZE + 8];
+    int fd;
+    off_t size;
+    bool done;
+    bool failed;
+    int references;
+    pthread_cond_t progress;
+    struct FileLock *lock;
+    struct UpstreamFetch *next;
+};
 
+//État d'un transfert en cours. Lors d'un redémarrage à chaud, il est envoyé tel quel au
+//nouveau processus, avec le socket de données (data_socket n'a de sens que dans le
+//processus qui le reçoit). Une écriture garde receiver, le dernier paquet envoyé (OACK
+//ou ACK), à renvoyer s'il s'est perdu, et dans reorder les blocs arrivés en avance ;
+//file_opened indique si l'ancien processus a déjà ouvert le fichier. Une lecture garde
+//sender et read_offset, la position du premier bloc non acquitté.
+struct TransferState {
+    unsigned short opcode;
+    char filename[MAX_PACKET_SIZE];
+    struct sockaddr_in client_addr;
+    int data_socket;
+    int window_size;
+    off_t offset;
+    bool file_opened;
+    off_t local_size;
+    unsigned long zero_blocks;
+    struct Receiver receiver;
+    bool has_reorder;
+    struct ReorderBuffer reorder;
+    unsigned char last_packet[MAX_PACKET_SIZE];
+    size_t last_packet_size;
+    struct Sender sender;
+    off_t read_offset;
+    unsigned long windows;
+    bool dedup;
+};
 
-pthread_mutex_t file_mutexes[MAX_FILES];
-char *file_names[MAX_FILES];
+//Premier message d'un redémarrage à chaud, dans les deux sens : les deux processus
+//doivent avoir le même format de TransferState. La taille seule ne suffit pas (deux
+//champs échangés, un type changé à taille égale) : layout résume la position et la
+//taille de chaque champ, et version change avec le sens des champs.
+struct HandoffHello {
+    char magic[8];
+    uint32_t version;
+    uint32_t state_size;
+    uint64_t layout;
+};
 
+void linger_final_ack(int data_socket, struct sockaddr_in client_addr, const unsigned char *ack_packet);
+uint64_t transfer_state_layout();
+void init_handoff_hello(struct HandoffHello *hello);
+bool handoff_hello_matches(const struct HandoffHello *hello);
+int acquire_data_socket();
+void release_data_socket(int data_socket);
+void adopt_data_socket();
+void forget_data_socket(int data_socket);
+unsigned long hash_filename(const char *filename);
+int add_scan_entry(struct ScanList *list, const char *name, struct timespec mtime);
+void free_scan_list(struct ScanList *list);
+int compare_scan_entries(const void *a, const void *b);
+int scan_directory(const char *path, struct timespec mtime, struct ScanList *files, struct ScanList *dirs);
+int attach_catalog(struct Catalog *catalog);
+void free_catalog(struct Catalog *catalog);
+int build_catalog(struct Catalog *catalog);
+int load_catalog_snapshot(struct Catalog *catalog);
+long find_catalog_file(const char *filename);
+long find_catalog_dir(const char *path);
+bool catalog_dir_unchanged(long dir_index, const char *path);
+void rebuild_catalog(unsigned long generation);
+bool catalog_contains(const char *filename);
+void *handle_request(void *arg);
+struct FileLock *acquire_file_lock(const char *filename);
+void release_file_lock(struct FileLock *lock);
+bool file_lock_busy(const struct FileLock *lock, bool exclusive);
+bool lock_file(struct FileLock *lock, bool exclusive, int wait_seconds, unsigned short port);
+void unlock_file(struct FileLock *lock, bool exclusive);
+void downgrade_file_lock(struct FileLock *lock);
+double elapsed_seconds(const struct timespec *start);
+int readahead_open(struct ReadAhead *reader, const char *filename, off_t offset);
+int readahead_refill(struct ReadAhead *reader);
+ssize_t readahead_block(struct ReadAhead *reader, unsigned char *block);
+void readahead_close(struct ReadAhead *reader, unsigned short port);
+int make_parent_dirs(const char *path);
+bool cached_file_exists(const char *filename);
+struct UpstreamFetch *find_fetch(const char *filename);
+struct UpstreamFetch *attach_fetch(const char *filename);
+struct UpstreamFetch *start_fetch(const char *filename);
+void release_fetch(struct UpstreamFetch *fetch);
+bool wait_fetch_start(struct UpstreamFetch *fetch);
+int wait_fetch_data(struct UpstreamFetch *fetch, off_t offset, size_t *limit);
+bool download_upstream(struct UpstreamFetch *fetch);
+void *fetch_upstream(void *arg);
+int store_chunk(const unsigned char *hash, const unsigned char *data, size_t length);
+struct ChunkWriter *chunk_writer_create();
+void chunk_writer_free(struct ChunkWriter *writer);
+int chunk_writer_flush(struct ChunkWriter *writer);
+int chunk_writer_add(struct ChunkWriter *writer, const unsigned char *data, size_t size);
+int chunk_writer_finish(struct ChunkWriter *writer, const char *filename);
+void handle_wrq(int server_socket, struct sockaddr_in client_addr, const struct TftpRequest *request, struct FileLock *file_lock);
+int open_received_file(struct TransferState *state);
+void receive_file(struct TransferState *state, struct FileLock *file_lock);
+void handle_rrq(int server_socket, struct sockaddr_in client_addr, const struct TftpRequest *request, struct FileLock *file_lock);
+void send_file(struct TransferState *state, struct FileLock *file_lock);
+bool export_transfer(struct TransferState *state);
+void *resume_transfer(void *arg);
+void *receive_handoff(void *arg);
+int send_with_descriptor(int unix_socket, const void *data, size_t size, int fd);
+ssize_t receive_with_descriptor(int unix_socket, void *data, size_t size, int *fd);
+int listen_handoff();
+int connect_previous_server(int *server_socket);
+bool hand_off(int handoff_listener, int server_socket);
+bool start_request_thread(void *(*routine)(void *), void *arg);
+void end_request_thread();
+void wait_request_threads();
+
+
+//Verrous des fichiers en cours de transfert, par nom : table de hachage dont chaque
+//case est une liste chaînée, protégée avec les verrous eux-mêmes par file_locks_mutex.
+pthread_mutex_t file_locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct FileLock *file_locks[FILE_LOCK_BUCKETS];
+
+//Catalogue des fichiers servis (toute l'arborescence du répertoire du serveur).
+struct Catalog catalog;
+pthread_rwlock_t catalog_lock = PTHREAD_RWLOCK_INITIALIZER;
+unsigned long catalog_generation = 0;
+time_t catalog_built_at = 0;
+
+//Threads de requête en cours, comptés sous sessions_mutex (admission.c) : un
+//redémarrage à chaud attend qu'ils se terminent.
+int request_threads = 0;
+
+//Mode relais : les fichiers absents sont rapatriés depuis upstream_addr.
+bool relay_enabled = false;
+struct sockaddr_in upstream_addr;
+pthread_mutex_t fetches_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct UpstreamFetch *fetches = NULL;
+
+//Réserve de sockets de données déjà créés, liés et configurés. Elle garde au plus
+//DATA_SOCKET_POOL_MIN sockets libres de plus que le nombre de transferts en cours,
+//ce qui la fait grossir pendant une rafale de requêtes et se vider ensuite.
+pthread_mutex_t data_socket_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+int data_socket_pool[DATA_SOCKET_POOL_MAX];
+int data_socket_pool_count = 0;
+int data_sockets_in_use = 0;
+
+//Redémarrage à chaud : socket UNIX vers le nouveau processus, une fois la place cédée
+//(-1 avant). export_transfer y envoie les transferts en cours.
+pthread_mutex_t handoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+int handoff_socket = -1;
+
+//Stockage dédupliqué (manifest.h) : activé par l'option -d pour les fichiers écrits ;
+//les manifestes déjà présents sont servis dans tous les cas. chunk_mutex protège aussi
+//les compteurs du taux de déduplication (octets reçus, octets réellement écrits).
+bool dedup_enabled = false;
+unsigned long long dedup_received_bytes = 0;
+unsigned long long dedup_written_bytes = 0;
+
+//Le datagramme reçu appartient à la requête : le thread qui la traite lit le nom
+//de fichier et les options directement dans packet. session est la place réservée par
+//le fil d'écoute, ou ADMISSION_QUEUED si le thread doit encore l'attendre.
 struct ClientRequest {
     int server_socket;
+    int session;
     struct sockaddr_in client_addr;
-    char filename[MAX_PACKET_SIZE];
-    unsigned short opcode;
-    bool bigfile;
+    char packet[MAX_PACKET_SIZE];
+    struct TftpRequest parsed;
 };
 
-void init_file_mutexes() {
-    for (int i = 0; i < MAX_FILES; ++i) {
-        pthread_mutex_init(&file_mutexes[i], NULL);
+//Après le dernier ACK, on reste à l'écoute pendant LINGER_SECONDS : si cet ACK est perdu,
+//le client renvoie son dernier bloc et on lui répond au lieu de le laisser échouer.
+void linger_final_ack(int data_socket, struct sockaddr_in client_addr, const unsigned char *ack_packet)
+{
+    struct timeval timeout;
+    timeout.tv_sec = LINGER_SECONDS;
+    timeout.tv_usec = 0;
+    if (setsockopt(data_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) < 0)
+        return;
+
+    unsigned char data_packet[MAX_PACKET_SIZE];
+    while (1)
+    {
+        struct sockaddr_in sender_addr;
+        socklen_t sender_addr_len = sizeof(sender_addr);
+        ssize_t bytes_received = recvfrom(data_socket, data_packet, MAX_PACKET_SIZE, 0, (struct sockaddr *)&sender_addr, &sender_addr_len);
+        if (bytes_received >= 0 && !from_peer(data_socket, client_addr, sender_addr))
+            continue;
+        if (bytes_received < 4)
+            break;
+
+        if (data_packet[1] == DATA_OPCODE && data_packet[2] == ack_packet[2] && data_packet[3] == ack_packet[3])
+            sendto(data_socket, ack_packet, 4, 0, (struct sockaddr *)&client_addr, sizeof(client_addr));
+    }
+
+    //Le socket retourne dans la réserve : on rétablit le délai d'attente habituel.
+    timeout.tv_sec = TIMEOUT_SECONDS;
+    setsockopt(data_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+}
+
+//Prend un socket de données dans la réserve, ou en crée un si elle est vide.
+int acquire_data_socket()
+{
+    int data_socket = -1;
+
+    pthread_mutex_lock(&data_socket_pool_mutex);
+    if (data_socket_pool_count > 0)
+        data_socket = data_socket_pool[--data_socket_pool_count];
+    data_sockets_in_use++;
+    pthread_mutex_unlock(&data_socket_pool_mutex);
+
+    if (data_socket < 0) {
+        data_socket = create_data_socket(inet_addr(IP), TIMEOUT_SECONDS);
+        if (data_socket < 0) {
+            pthread_mutex_lock(&data_socket_pool_mutex);
+            data_sockets_in_use--;
+            pthread_mutex_unlock(&data_socket_pool_mutex);
+        }
+    }
+    return data_socket;
+}
+
+//Rend un socket de données à la réserve. Les datagrammes encore en attente (retransmissions
+//tardives du transfert terminé) sont vidés pour ne pas être lus par le transfert suivant.
+void release_data_socket(int data_socket)
+{
+    unsigned char packet[MAX_PACKET_SIZE];
+    while (recv(data_socket, packet, sizeof(packet), MSG_DONTWAIT) >= 0)
+        ;
+
+    bool keep;
+    pthread_mutex_lock(&data_socket_pool_mutex);
+    data_sockets_in_use--;
+    keep = data_socket_pool_count < DATA_SOCKET_POOL_MAX && data_socket_pool_count < data_sockets_in_use + DATA_SOCKET_POOL_MIN;
+    if (keep)
+        data_socket_pool[data_socket_pool_count++] = data_socket;
+    pthread_mutex_unlock(&data_socket_pool_mutex);
+
+    if (!keep)
+        close(data_socket);
+}
+
+//Un socket de données reçu de l'ancien processus compte parmi ceux en service : il
+//rejoint la réserve à la fin de son transfert.
+void adopt_data_socket()
+{
+    pthread_mutex_lock(&data_socket_pool_mutex);
+    data_sockets_in_use++;
+    pthread_mutex_unlock(&data_socket_pool_mutex);
+}
+
+//Un socket de données transmis au nouveau processus est simplement fermé, sans être
+//vidé : les datagrammes en attente sont pour le nouveau processus.
+void forget_data_socket(int data_socket)
+{
+    close(data_socket);
+    pthread_mutex_lock(&data_socket_pool_mutex);
+    data_sockets_in_use--;
+    pthread_mutex_unlock(&data_socket_pool_mutex);
+}
+
+unsigned long hash_filename(const char *filename)
+{
+    unsigned long hash = 5381;
+    while (*filename != '\0')
+        hash = hash * 33 + (unsigned char)*filename++;
+    return hash;
+}
+
+int add_scan_entry(struct ScanList *list, const char *name, struct timespec mtime)
+{
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity > 0 ? list->capacity * 2 : 256;
+        struct ScanEntry *entries = realloc(list->entries, capacity * sizeof(struct ScanEntry));
+        if (entries == NULL)
+            return -1;
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+
+    list->entries[list->count].name = strdup(name);
+    if (list->entries[list->count].name == NULL)
+        return -1;
+    list->entries[list->count].mtime = mtime;
+    list->count++;
+    return 0;
+}
+
+void free_scan_list(struct ScanList *list)
+{
+    for (size_t i = 0; i < list->count; ++i)
+        free(list->entries[i].name);
+    free(list->entries);
+}
+
+int compare_scan_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct ScanEntry *)a)->name, ((const struct ScanEntry *)b)->name);
+}
+
+//Parcourt récursivement path (relatif au répertoire du serveur, "." pour la racine) et
+//relève ses fichiers réguliers et ses sous-répertoires. Les entrées cachées et les liens
+//symboliques sont ignorés.
+int scan_directory(const char *path, struct timespec mtime, struct ScanList *files, struct ScanList *dirs)
+{
+    if (add_scan_entry(dirs, path, mtime) < 0)
+        return -1;
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        perror("Error opening server directory");
+        return -1;
+    }
+
+    int result = 0;
+    struct dirent *entry;
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        char entry_path[PATH_MAX];
+        int length = strcmp(path, ".") == 0
+            ? snprintf(entry_path, sizeof(entry_path), "%s", entry->d_name)
+            : snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->d_name);
+        if (length < 0 || (size_t)length >= sizeof(entry_path) || length >= MAX_PACKET_SIZE)
+            continue;
+
+        struct stat stat_buf;
+        if (lstat(entry_path, &stat_buf) < 0)
+            continue;
+        if (S_ISREG(stat_buf.st_mode))
+            result = add_scan_entry(files, entry_path, stat_buf.st_mtim);
+        else if (S_ISDIR(stat_buf.st_mode))
+            result = scan_directory(entry_path, stat_buf.st_mtim, files, dirs);
+    }
+
+    closedir(dir);
+    return result;
+}
+
+//Renseigne les pointeurs du catalogue à partir de son image (chargée ou construite).
+int attach_catalog(struct Catalog *catalog)
+{
+    catalog->header = catalog->data;
+    catalog->dirs = (const struct CatalogDir *)(catalog->header + 1);
+    catalog->files = (const uint32_t *)(catalog->dirs + catalog->header->dir_count);
+    catalog->names = (const char *)(catalog->files + catalog->header->file_count);
+    catalog->dir_checked = calloc(catalog->header->dir_count + 1, 1);
+    return catalog->dir_checked != NULL ? 0 : -1;
+}
+
+void free_catalog(struct Catalog *catalog)
+{
+    if (catalog->data == NULL)
+        return;
+    if (catalog->mapped)
+        munmap(catalog->data, catalog->size);
+    else
+        free(catalog->data);
+    free(catalog->dir_checked);
+    memset(catalog, 0, sizeof(*catalog));
+}
+
+//Parcourt l'arborescence et construit le catalogue en mémoire, puis l'enregistre dans
+//CATALOG_FILE pour que le prochain démarrage puisse le charger sans rien parcourir.
+int build_catalog(struct Catalog *catalog)
+{
+    struct ScanList files = {0};
+    struct ScanList dirs = {0};
+    struct stat stat_buf;
+
+    if (stat(".", &stat_buf) < 0 || scan_directory(".", stat_buf.st_mtim, &files, &dirs) < 0) {
+        free_scan_list(&files);
+        free_scan_list(&dirs);
+        return -1;
+    }
+    qsort(files.entries, files.count, sizeof(struct ScanEntry), compare_scan_entries);
+    qsort(dirs.entries, dirs.count, sizeof(struct ScanEntry), compare_scan_entries);
+
+    size_t names_size = 0;
+    for (size_t i = 0; i < files.count; ++i)
+        names_size += strlen(files.entries[i].name) + 1;
+    for (size_t i = 0; i < dirs.count; ++i)
+        names_size += strlen(dirs.entries[i].name) + 1;
+
+    size_t size = sizeof(struct CatalogHeader) + dirs.count * sizeof(struct CatalogDir) + files.count * sizeof(uint32_t) + names_size;
+    memset(catalog, 0, sizeof(*catalog));
+    catalog->data = calloc(1, size);
+    if (catalog->data == NULL) {
+        free_scan_list(&files);
+        free_scan_list(&dirs);
+        return -1;
+    }
+    catalog->size = size;
+
+    struct CatalogHeader *header = catalog->data;
+    memcpy(header->magic, CATALOG_MAGIC, sizeof(header->magic));
+    header->file_count = files.count;
+    header->dir_count = dirs.count;
+    header->names_size = names_size;
+
+    struct CatalogDir *catalog_dirs = (struct CatalogDir *)(header + 1);
+    uint32_t *catalog_files = (uint32_t *)(catalog_dirs + dirs.count);
+    char *names = (char *)(catalog_files + files.count);
+    size_t name_offset = 0;
+    for (size_t i = 0; i < dirs.count; ++i) {
+        catalog_dirs[i].mtime_sec = dirs.entries[i].mtime.tv_sec;
+        catalog_dirs[i].mtime_nsec = dirs.entries[i].mtime.tv_nsec;
+        catalog_dirs[i].name_offset = name_offset;
+        strcpy(names + name_offset, dirs.entries[i].name);
+        name_offset += strlen(dirs.entries[i].name) + 1;
+    }
+    for (size_t i = 0; i < files.count; ++i) {
+        catalog_files[i] = name_offset;
+        strcpy(names + name_offset, files.entries[i].name);
+        name_offset += strlen(files.entries[i].name) + 1;
+    }
+    free_scan_list(&files);
+    free_scan_list(&dirs);
+
+    if (attach_catalog(catalog) < 0) {
+        free_catalog(catalog);
+        return -1;
+    }
+
+    //L'instantané est écrit à côté puis renommé, pour qu'un lecteur ne voie jamais un fichier à moitié écrit.
+    FILE *snapshot = fopen(CATALOG_FILE ".tmp", "wb");
+    if (snapshot != NULL) {
+        bool written = fwrite(catalog->data, 1, size, snapshot) == size;
+        if (fclose(snapshot) == 0 && written)
+            rename(CATALOG_FILE ".tmp", CATALOG_FILE);
+        else
+            unlink(CATALOG_FILE ".tmp");
+    }
+    return 0;
+}
+
+//Charge l'instantané CATALOG_FILE par mmap. Sa cohérence avec le disque n'est pas vérifiée
+//ici : chaque répertoire est comparé à sa date de modification lors de la première requête
+//qui le concerne (voir catalog_contains).
+int load_catalog_snapshot(struct Catalog *catalog)
+{
+    int fd = open(CATALOG_FILE, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) < 0 || (size_t)stat_buf.st_size < sizeof(struct CatalogHeader)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = stat_buf.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+
+    const struct CatalogHeader *header = data;
+    bool valid = memcmp(header->magic, CATALOG_MAGIC, sizeof(header->magic)) == 0
+        && header->names_size > 0
+        && size == sizeof(struct CatalogHeader) + (size_t)header->dir_count * sizeof(struct CatalogDir)
+                   + (size_t)header->file_count * sizeof(uint32_t) + header->names_size;
+
+    memset(catalog, 0, sizeof(*catalog));
+    catalog->data = data;
+    catalog->size = size;
+    catalog->mapped = true;
+    if (!valid || attach_catalog(catalog) < 0) {
+        free_catalog(catalog);
+        return -1;
+    }
+
+    if (catalog->names[header->names_size - 1] != '\0')
+        valid = false;
+    for (uint32_t i = 0; valid && i < header->dir_count; ++i)
+        valid = catalog->dirs[i].name_offset < header->names_size;
+    for (uint32_t i = 0; valid && i < header->file_count; ++i)
+        valid = catalog->files[i] < header->names_size;
+    if (!valid) {
+        free_catalog(catalog);
+        return -1;
+    }
+    return 0;
+}
+
+long find_catalog_file(const char *filename)
+{
+    long low = 0, high = (long)catalog.header->file_count - 1;
+    while (low <= high) {
+        long middle = low + (high - low) / 2;
+        int order = strcmp(filename, catalog.names + catalog.files[middle]);
+        if (order == 0)
+            return middle;
+        if (order < 0)
+            high = middle - 1;
+        else
+            low = middle + 1;
+    }
+    return -1;
+}
+
+long find_catalog_dir(const char *path)
+{
+    long low = 0, high = (long)catalog.header->dir_count - 1;
+    while (low <= high) {
+        long middle = low + (high - low) / 2;
+        int order = strcmp(path, catalog.names + catalog.dirs[middle].name_offset);
+        if (order == 0)
+            return middle;
+        if (order < 0)
+            high = middle - 1;
+        else
+            low = middle + 1;
+    }
+    return -1;
+}
+
+//Vrai si le répertoire n'a pas été modifié depuis la construction du catalogue.
+bool catalog_dir_unchanged(long dir_index, const char *path)
+{
+    struct stat stat_buf;
+    if (stat(path, &stat_buf) < 0)
+        return false;
+    return stat_buf.st_mtim.tv_sec == catalog.dirs[dir_index].mtime_sec && stat_buf.st_mtim.tv_nsec == catalog.dirs[dir_index].mtime_nsec;
+}
+
+//Reconstruit le catalogue, sauf si un autre thread l'a déjà fait depuis generation.
+//Les reconstructions sont espacées d'au moins CATALOG_REBUILD_INTERVAL secondes pour
+//qu'une rafale de requêtes vers des fichiers absents ne relance pas un parcours à chacune.
+void rebuild_catalog(unsigned long generation)
+{
+    pthread_rwlock_wrlock(&catalog_lock);
+    if (generation == catalog_generation && time(NULL) - catalog_built_at >= CATALOG_REBUILD_INTERVAL) {
+        struct Catalog rebuilt;
+        if (build_catalog(&rebuilt) == 0) {
+            free_catalog(&catalog);
+            catalog = rebuilt;
+            catalog_generation++;
+            catalog_built_at = time(NULL);
+            printf("Catalogue reconstruit : %u fichiers, %u répertoires\n", catalog.header->file_count, catalog.header->dir_count);
+        }
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+}
+
+//Indique si filename fait partie des fichiers servis. Le répertoire parent est comparé
+//à la date enregistrée dans le catalogue : une seule fois s'il contient le fichier, à
+//chaque échec sinon (pour voir les fichiers ajoutés). Un écart provoque une reconstruction.
+bool catalog_contains(const char *filename)
+{
+    char parent[MAX_PACKET_SIZE];
+    const char *slash = strrchr(filename, '/');
+    if (slash != NULL)
+        snprintf(parent, sizeof(parent), "%.*s", (int)(slash - filename), filename);
+    else
+        strcpy(parent, ".");
+
+    bool found = false;
+    for (int pass = 0; pass < 2; ++pass) {
+        pthread_rwlock_rdlock(&catalog_lock);
+        unsigned long generation = catalog_generation;
+        found = find_catalog_file(filename) >= 0;
+        long dir_index = find_catalog_dir(parent);
+        bool stale;
+        if (dir_index < 0) {
+            struct stat stat_buf;
+            stale = stat(parent, &stat_buf) == 0 && S_ISDIR(stat_buf.st_mode);
+        } else if (found && __atomic_load_n(&catalog.dir_checked[dir_index], __ATOMIC_RELAXED)) {
+            stale = false;
+        } else {
+            stale = !catalog_dir_unchanged(dir_index, parent);
+            if (!stale)
+                __atomic_store_n(&catalog.dir_checked[dir_index], 1, __ATOMIC_RELAXED);
+        }
+        pthread_rwlock_unlock(&catalog_lock);
+
+        if (!stale)
+            break;
+        if (pass == 0)
+            rebuild_catalog(generation);
+    }
+    return found;
+}
+
+//Crée les répertoires parents de path qui n'existent pas encore.
+int make_parent_dirs(const char *path)
+{
+    char directory[PATH_MAX];
+    if (strlen(path) >= sizeof(directory))
+        return -1;
+    strcpy(directory, path);
+
+    for (char *slash = strchr(directory, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(directory, 0755) < 0 && errno != EEXIST)
+            return -1;
+        *slash = '/';
+    }
+    return 0;
+}
+
+//Un fichier déjà rapatrié peut ne pas encore figurer dans le catalogue.
+bool cached_file_exists(const char *filename)
+{
+    struct stat stat_buf;
+    return lstat(filename, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode);
+}
+
+//Renvoie le rapatriement en cours de filename, en y ajoutant une référence, ou NULL.
+//fetches_mutex doit être verrouillé.
+struct UpstreamFetch *find_fetch(const char *filename)
+{
+    for (struct UpstreamFetch *fetch = fetches; fetch != NULL; fetch = fetch->next) {
+        if (strcmp(fetch->filename, filename) == 0) {
+            fetch->references++;
+            return fetch;
+        }
+    }
+    return NULL;
+}
+
+struct UpstreamFetch *attach_fetch(const char *filename)
+{
+    pthread_mutex_lock(&fetches_mutex);
+    struct UpstreamFetch *fetch = find_fetch(filename);
+    pthread_mutex_unlock(&fetches_mutex);
+    return fetch;
+}
+
+//Rejoint le rapatriement de filename depuis le serveur amont, ou le lance s'il n'y en a
+//pas : le fichier est écrit dans un fichier caché ".<nom>.part" du même répertoire,
+//renommé une fois complet. Le rapatriement tient le verrou du fichier exclusif jusque-là,
+//puis partagé jusqu'à sa dernière référence : une écriture du même nom ne tronque ni le
+//fichier en cours de cache, ni la copie que ses lecteurs lisent encore. Renvoie NULL si
+//le rapatriement ne peut pas démarrer.
+struct UpstreamFetch *start_fetch(const char *filename)
+{
+    pthread_mutex_lock(&fetches_mutex);
+    struct UpstreamFetch *fetch = find_fetch(filename);
+    if (fetch != NULL) {
+        pthread_mutex_unlock(&fetches_mutex);
+        return fetch;
+    }
+
+    fetch = calloc(1, sizeof(struct UpstreamFetch));
+    if (fetch == NULL) {
+        pthread_mutex_unlock(&fetches_mutex);
+        return NULL;
+    }
+
+    const char *basename = strrchr(filename, '/');
+    basename = basename != NULL ? basename + 1 : filename;
+    snprintf(fetch->filename, sizeof(fetch->filename), "%s", filename);
+    snprintf(fetch->part_path, sizeof(fetch->part_path), "%.*s.%s.part", (int)(basename - filename), filename, basename);
+
+    fetch->fd = -1;
+    fetch->lock = acquire_file_lock(filename);
+    if (fetch->lock != NULL && make_parent_dirs(filename) == 0)
+        fetch->fd = open(fetch->part_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fetch->fd < 0) {
+        perror("Erreur lors de la création du fichier de cache");
+        pthread_mutex_unlock(&fetches_mutex);
+        if (fetch->lock != NULL)
+            release_file_lock(fetch->lock);
+        free(fetch);
+        return NULL;
+    }
+
+    //Une référence pour l'appelant, une pour le thread de rapatriement.
+    fetch->references = 2;
+    pthread_cond_init(&fetch->progress, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, fetch_upstream, fetch) != 0) {
+        perror("Erreur lors de la création du thread de rapatriement");
+        close(fetch->fd);
+        unlink(fetch->part_path);
+        pthread_cond_destroy(&fetch->progress);
+        pthread_mutex_unlock(&fetches_mutex);
+        release_file_lock(fetch->lock);
+        free(fetch);
+        return NULL;
+    }
+    pthread_detach(thread);
+
+    fetch->next = fetches;
+    fetches = fetch;
+    pthread_mutex_unlock(&fetches_mutex);
+    return fetch;
+}
+
+void release_fetch(struct UpstreamFetch *fetch)
+{
+    pthread_mutex_lock(&fetches_mutex);
+    if (--fetch->references > 0) {
+        pthread_mutex_unlock(&fetches_mutex);
+        return;
+    }
+
+    struct UpstreamFetch **link = &fetches;
+    while (*link != fetch)
+        link = &(*link)->next;
+    *link = fetch->next;
+    pthread_mutex_unlock(&fetches_mutex);
+
+    close(fetch->fd);
+    pthread_cond_destroy(&fetch->progress);
+    unlock_file(fetch->lock, false);
+    release_file_lock(fetch->lock);
+    free(fetch);
+}
+
+//Attend que le serveur amont ait envoyé un premier bloc ou terminé le transfert.
+//Renvoie false si le rapatriement a échoué (fichier absent en amont, par exemple).
+bool wait_fetch_start(struct UpstreamFetch *fetch)
+{
+    pthread_mutex_lock(&fetches_mutex);
+    while (fetch->size == 0 && !fetch->done && !fetch->failed)
+        pthread_cond_wait(&fetch->progress, &fetches_mutex);
+    bool started = !fetch->failed;
+    pthread_mutex_unlock(&fetches_mutex);
+    return started;
+}
+
+//Attend que les données à partir de offset soient arrivées et réduit *limit à ce qui
+//peut être lu : un nombre entier de blocs tant que le rapatriement n'est pas terminé,
+//pour ne pas envoyer un bloc court qui marquerait la fin du fichier.
+int wait_fetch_data(struct UpstreamFetch *fetch, off_t offset, size_t *limit)
+{
+    pthread_mutex_lock(&fetches_mutex);
+    while (!fetch->done && !fetch->failed && fetch->size < offset + 512)
+        pthread_cond_wait(&fetch->progress, &fetches_mutex);
+
+    int result = fetch->failed ? -1 : 0;
+    if (!fetch->done && !fetch->failed) {
+        size_t available = (fetch->size - offset) / 512 * 512;
+        if (available < *limit)
+            *limit = available;
+    }
+    pthread_mutex_unlock(&fetches_mutex);
+    return result;
+}
+
+//Télécharge fetch->filename depuis le serveur amont (RRQ avec l'option bigfile) en
+//écrivant chaque bloc dans le fichier de cache et en réveillant les lecteurs.
+bool download_upstream(struct UpstreamFetch *fetch)
+{
+    int upstream_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (upstream_socket < 0) {
+        perror("Erreur lors de la création du socket amont");
+        return false;
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = TIMEOUT_SECONDS;
+    timeout.tv_usec = 0;
+    setsockopt(upstream_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout));
+
+    unsigned char request_packet[MAX_PACKET_SIZE];
+    size_t filename_length = strlen(fetch->filename);
+    request_packet[0] = 0;
+    request_packet[1] = RRQ_OPCODE;
+    memcpy(request_packet + 2, fetch->filename, filename_length + 1);
+    size_t request_size = 2 + filename_length + 1;
+    memcpy(request_packet + request_size, "octet", 6);
+    request_size += 6;
+    memcpy(request_packet + request_size, "bigfile", 8);
+    request_size += 8;
+
+    //La première réponse (OACK, DATA 1 ou ERROR) donne le port de transfert de l'amont.
+    struct sockaddr_in upstream_data_addr;
+    unsigned char packet[MAX_PACKET_SIZE];
+    ssize_t bytes_received = -1;
+    for (int attempts = 0; attempts <= MAX_RETRIES && bytes_received < 0; ++attempts) {
+        sendto(upstream_socket, request_packet, request_size, 0, (struct sockaddr *)&upstream_addr, sizeof(upstream_addr));
+        socklen_t addr_len = sizeof(upstream_data_addr);
+        bytes_received = recvfrom(upstream_socket, packet, MAX_PACKET_SIZE, 0, (struct sockaddr *)&upstream_data_addr, &addr_len);
+    }
+
+    unsigned char ack_packet[4] = {0, ACK_OPCODE, 0, 0};
+    struct Receiver receiver;
+    receiver_init(&receiver, 1, false, 0);
+    struct BurstReader reader;
+    burst_reader_init(&reader);
+    struct TransferLink link;
+    transfer_link_init(&link, upstream_socket, upstream_data_addr, &reader);
+    bool failed = false;
+    while (bytes_received >= 4) {
+        if (packet[1] == ERROR_OPCODE) {
+            fprintf(stderr, "Erreur du serveur amont pour %s : %s\n", fetch->filename, (const char *)packet + 4);
+            break;
+        }
+
+        int action = packet[1] == OACK_OPCODE && receiver.expected == 1 ? RECEIVE_REPEAT_ACK : receiver_accept(&receiver, packet, bytes_received);
+        if (action == RECEIVE_REPEAT_ACK)
+            sendto(upstream_socket, ack_packet, sizeof(ack_packet), 0, (struct sockaddr *)&upstream_data_addr, sizeof(upstream_data_addr));
+
+        if (action == RECEIVE_DELIVER) {
+            size_t data_size = bytes_received - 4;
+            do {
+                if (pwrite(fetch->fd, packet + 4, data_size, receiver.write_offset) != (ssize_t)data_size) {
+                    perror("Erreur lors de l'écriture dans le cache");
+                    send_error_packet(upstream_socket, upstream_data_addr, 0, "Erreur d'écriture");
+                    failed = true;
+                    break;
+                }
+
+                pthread_mutex_lock(&fetches_mutex);
+                fetch->size += data_size;
+                pthread_cond_broadcast(&fetch->progress);
+                pthread_mutex_unlock(&fetches_mutex);
+            } while (receiver_next(&receiver, packet + 4, &data_size));
+            if (failed)
+                break;
+
+            build_ack(ack_packet, receiver.acked, -1, 0, 0);
+            sendto(upstream_socket, ack_packet, sizeof(ack_packet), 0, (struct sockaddr *)&upstream_data_addr, sizeof(upstream_data_addr));
+            if (receiver.complete)
+                break;
+        }
+
+        bytes_received = receive_data(&link, packet, ack_packet, sizeof(ack_packet));
+    }
+
+    receiver_close(&receiver);
+    close(upstream_socket);
+    return receiver.complete;
+}
+
+void *fetch_upstream(void *arg)
+{
+    struct UpstreamFetch *fetch = (struct UpstreamFetch *)arg;
+    printf("Rapatriement de %s depuis le serveur amont\n", fetch->filename);
+
+    //Le verrou est rendu partagé une fois le fichier en place, pas avant : release_fetch
+    //le rend à la dernière référence.
+    lock_file(fetch->lock, true, 0, 0);
+    bool complete = download_upstream(fetch);
+    if (complete && rename(fetch->part_path, fetch->filename) < 0) {
+        perror("Erreur lors du renommage du fichier de cache");
+        complete = false;
+    }
+    if (!complete)
+        unlink(fetch->part_path);
+    downgrade_file_lock(fetch->lock);
+
+    pthread_mutex_lock(&fetches_mutex);
+    fetch->done = complete;
+    fetch->failed = !complete;
+    pthread_cond_broadcast(&fetch->progress);
+    pthread_mutex_unlock(&fetches_mutex);
+
+    printf("Rapatriement de %s %s (%lld octets)\n", fetch->filename, complete ? "terminé" : "échoué", (long long)fetch->size);
+    release_fetch(fetch);
+    pthread_exit(NULL);
+}
+
+//Range un morceau s'il n'est pas déjà dans le stockage. Il est écrit dans un fichier
+//temporaire puis renommé : un morceau présent est toujours complet, même si deux
+//écritures rangent le même en même temps. Renvoie 1 si le morceau a été écrit, 0 s'il
+//était déjà présent, -1 en cas d'erreur.
+int store_chunk(const unsigned char *hash, const unsigned char *data, size_t length)
+{
+    char path[PATH_MAX];
+    chunk_path(hash, path, sizeof(path));
+    struct stat stat_buf;
+    if (stat(path, &stat_buf) == 0)
+        return 0;
+
+    char temp_path[] = CHUNK_DIR "/tmp.XXXXXX";
+    int fd = mkstemp(temp_path);
+    if (fd < 0)
+        return -1;
+    bool written = write(fd, data, length) == (ssize_t)length;
+    if (close(fd) < 0)
+        written = false;
+    if (!written || make_parent_dirs(path) < 0 || rename(temp_path, path) < 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return 1;
+}
+
+struct ChunkWriter *chunk_writer_create()
+{
+    struct ChunkWriter *writer = malloc(sizeof(struct ChunkWriter));
+    if (writer == NULL)
+        return NULL;
+    writer->length = 0;
+    sha256_init(&writer->hash);
+    writer->hashes = NULL;
+    writer->chunk_count = 0;
+    writer->capacity = 0;
+    writer->size = 0;
+    writer->new_chunks = 0;
+    writer->new_bytes = 0;
+    return writer;
+}
+
+void chunk_writer_free(struct ChunkWriter *writer)
+{
+    free(writer->hashes);
+    free(writer);
+}
+
+//Termine le morceau courant : son hachage est ajouté au manifeste et il est rangé.
+int chunk_writer_flush(struct ChunkWriter *writer)
+{
+    if (writer->chunk_count == writer->capacity) {
+        uint32_t capacity = writer->capacity == 0 ? 16 : writer->capacity * 2;
+        unsigned char (*hashes)[CHUNK_HASH_SIZE] = realloc(writer->hashes, capacity * sizeof(hashes[0]));
+        if (hashes == NULL)
+            return -1;
+        writer->hashes = hashes;
+        writer->capacity = capacity;
     }
+
+    unsigned char *hash = writer->hashes[writer->chunk_count];
+    sha256_final(&writer->hash, hash);
+    int stored = store_chunk(hash, writer->buffer, writer->length);
+    if (stored < 0)
+        return -1;
+    if (stored > 0) {
+        writer->new_chunks++;
+        writer->new_bytes += writer->length;
+    }
+    writer->chunk_count++;
+    writer->length = 0;
+    sha256_init(&writer->hash);
+    return 0;
 }
 
-void destroy_file_mutexes() {
-    for (int i = 0; i < MAX_FILES; ++i) {
-        pthread_mutex_destroy(&file_mutexes[i]);
+//Ajoute un bloc reçu au morceau courant ; il est haché tout de suite, pendant qu'il
+//est encore dans le cache du processeur.
+int chunk_writer_add(struct ChunkWriter *writer, const unsigned char *data, size_t size)
+{
+    while (size > 0) {
+        size_t part = CHUNK_SIZE - writer->length;
+        if (part > size)
+            part = size;
+        memcpy(writer->buffer + writer->length, data, part);
+        sha256_update(&writer->hash, data, part);
+        writer->length += part;
+        writer->size += part;
+        data += part;
+        size -= part;
+        if (writer->length == CHUNK_SIZE && chunk_writer_flush(writer) < 0)
+            return -1;
     }
+    return 0;
 }
 
-void send_error_packet(int server_socket, struct sockaddr_in client_addr, int error_code, const char *error_message)
+//Range le dernier morceau et remplace le fichier par son manifeste, écrit à côté des
+//morceaux puis renommé : une lecture déjà commencée garde l'ancienne version.
+int chunk_writer_finish(struct ChunkWriter *writer, const char *filename)
 {
-    char error_packet[MAX_PACKET_SIZE];
-    memset(error_packet, 0, MAX_PACKET_SIZE);
-    error_packet[0] = 0;
-    error_packet[1] = ERROR_OPCODE;
-    error_packet[2] = 0;
-    error_packet[3] = error_code;
-    strcpy(error_packet + 4, error_message);
+    if (writer->length > 0 && chunk_writer_flush(writer) < 0)
+        return -1;
+
+    struct ManifestHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.size = writer->size;
+    header.chunk_count = writer->chunk_count;
+
+    char temp_path[] = CHUNK_DIR "/manifest.XXXXXX";
+    int fd = mkstemp(temp_path);
+    if (fd < 0)
+        return -1;
+    size_t hashes_size = writer->chunk_count * sizeof(writer->hashes[0]);
+    bool written = fchmod(fd, 0644) == 0
+        && mark_manifest(fd) == 0
+        && write(fd, &header, sizeof(header)) == sizeof(header)
+        && (hashes_size == 0 || write(fd, writer->hashes, hashes_size) == (ssize_t)hashes_size);
+    if (close(fd) < 0)
+        written = false;
+    if (!written || rename(temp_path, filename) < 0) {
+        unlink(temp_path);
+        return -1;
+    }
 
-    sendto(server_socket, error_packet, strlen(error_message) + 5, 0, (struct sockaddr *)&client_addr, sizeof(client_addr));
+    pthread_mutex_lock(&chunk_mutex);
+    dedup_received_bytes += writer->size;
+    dedup_written_bytes += writer->new_bytes + sizeof(header) + hashes_size;
+    unsigned long long received = dedup_received_bytes;
+    unsigned long long written_bytes = dedup_written_bytes;
+    pthread_mutex_unlock(&chunk_mutex);
+
+    printf("Stockage dédupliqué de %s : %u morceaux dont %lu nouveaux ; au total %llu octets reçus, %llu écrits (ratio %.2f)\n",
+           filename, writer->chunk_count, writer->new_chunks, received, written_bytes, written_bytes > 0 ? (double)received / written_bytes : 0.0);
+    return 0;
 }
 
 void *handle_request(void *arg) {
     struct ClientRequest *request = (struct ClientRequest *)arg;
-    int file_index = -1;
+    const char *filename = request->parsed.filename;
+    unsigned short port = ntohs(request->client_addr.sin_port);
+    TRACE_PROBE(request, port, request->parsed.opcode, filename);
+
+    //Le fil d'écoute n'a pas trouvé de place libre mais la file d'attente en avait une :
+    //le thread attend ici qu'une session se termine.
+    int session = request->session;
+    if (session == ADMISSION_QUEUED && (session = admit_session(request->client_addr.sin_addr, filename, true)) < 0) {
+        fprintf(stderr, "Requête refusée pour %s : trop de sessions en cours\n", inet_ntoa(request->client_addr.sin_addr));
+        send_error_packet(request->server_socket, request->client_addr, 0, "Serveur surchargé, réessayez plus tard");
+        TRACE_PROBE(close, port, 0, TRACE_CLOSE_REFUSED);
+        free(request);
+        end_request_thread();
+        pthread_exit(NULL);
+    }
 
-    for (int i = 0; i < MAX_FILES; ++i) {
-        if (file_names[i] != NULL && strcmp(request->filename, file_names[i]) == 0) {
-            file_index = i;
-            break;
+    if (!is_safe_path(filename)) {
+        send_error_packet(request->server_socket, request->client_addr, 2, "Accès refusé");
+        TRACE_PROBE(close, port, 0, TRACE_CLOSE_REFUSED);
+        release_session(session);
+        free(request);
+        end_request_thread();
+        pthread_exit(NULL);
+    }
+
+    //En mode relais, un fichier lu qui manque localement est demandé au serveur amont.
+    bool relayed = false;
+    if (!catalog_contains(filename)) {
+        if (!relay_enabled || request->parsed.opcode != RRQ_OPCODE) {
+            send_error_packet(request->server_socket, request->client_addr, 1, "Fichier introuvable");
+            TRACE_PROBE(close, port, 0, TRACE_CLOSE_REFUSED);
+            release_session(session);
+            free(request);
+            end_request_thread();
+            pthread_exit(NULL);
         }
+        relayed = !cached_file_exists(filename);
     }
 
-    if (file_index == -1) {
-        send_error_packet(request->server_socket, request->client_addr, 1, "Fichier introuvable");
+    struct FileLock *file_lock = NULL;
+    struct UpstreamFetch *fetch = NULL;
+    if (relayed) {
+        fetch = start_fetch(filename);
+        if (fetch == NULL || !wait_fetch_start(fetch)) {
+            if (fetch != NULL)
+                release_fetch(fetch);
+            send_error_packet(request->server_socket, request->client_addr, 1, "Fichier introuvable");
+            TRACE_PROBE(close, port, 0, TRACE_CLOSE_FAILED);
+            release_session(session);
+            free(request);
+            end_request_thread();
+            pthread_exit(NULL);
+        }
+    } else if ((file_lock = acquire_file_lock(filename)) == NULL) {
+        send_error_packet(request->server_socket, request->client_addr, 0, "Erreur interne du serveur");
+        TRACE_PROBE(close, port, 0, TRACE_CLOSE_FAILED);
+        release_session(session);
         free(request);
+        end_request_thread();
         pthread_exit(NULL);
     }
 
-    switch (request->opcode) {
+    switch (request->parsed.opcode) {
         case RRQ_OPCODE:
-            pthread_mutex_lock(&file_mutexes[file_index]);
-            handle_rrq(request->server_socket, request->client_addr, request->filename, request->bigfile);
-            pthread_mutex_unlock(&file_mutexes[file_index]);
+            handle_rrq(request->server_socket, request->client_addr, &request->parsed, file_lock);
             break;
         case WRQ_OPCODE:
-            pthread_mutex_lock(&file_mutexes[file_index]);
-            handle_wrq(request->server_socket, request->client_addr, request->filename, request->bigfile);
-            pthread_mutex_unlock(&file_mutexes[file_index]);
+            handle_wrq(request->server_socket, request->client_addr, &request->parsed, file_lock);
             break;
         default:
-            printf("Opcode %d non supporté. Envoi d'un paquet d'erreur au client\n", request->opcode);
+            printf("Opcode %d non supporté. Envoi d'un paquet d'erreur au client\n", request->parsed.opcode);
             send_error_packet(request->server_socket, request->client_addr, 1, "Opération non supportée");
+            TRACE_PROBE(close, port, 0, TRACE_CLOSE_REFUSED);
             break;
     }
 
+    if (fetch != NULL)
+        release_fetch(fetch);
+    if (file_lock != NULL)
+        release_file_lock(file_lock);
+    release_session(session);
     free(request);
+    end_request_thread();
     pthread_exit(NULL);
 }
 
-void handle_wrq(int server_socket, struct sockaddr_in client_addr, char *filename, bool bigfile) {
-    printf("Traitement de la demande d'écriture (WRQ) du client\n");
+//Renvoie le verrou de filename, créé s'il n'existe pas, en y ajoutant une référence, ou
+//NULL si la mémoire manque.
+struct FileLock *acquire_file_lock(const char *filename)
+{
+    struct FileLock **bucket = &file_locks[hash_filename(filename) % FILE_LOCK_BUCKETS];
+    pthread_mutex_lock(&file_locks_mutex);
+    struct FileLock *lock = *bucket;
+    while (lock != NULL && strcmp(lock->filename, filename) != 0)
+        lock = lock->next;
+    if (lock == NULL) {
+        size_t filename_size = strlen(filename) + 1;
+        lock = calloc(1, sizeof(struct FileLock) + filename_size);
+        if (lock == NULL) {
+            pthread_mutex_unlock(&file_locks_mutex);
+            return NULL;
+        }
+        memcpy(lock->filename, filename, filename_size);
+        pthread_cond_init(&lock->released, NULL);
+        lock->next = *bucket;
+        *bucket = lock;
+    }
+    lock->references++;
+    pthread_mutex_unlock(&file_locks_mutex);
+    return lock;
+}
 
-    int data_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (data_socket < 0) {
-        perror("Erreur lors de la création du socket de données");
-        send_error_packet(server_socket, client_addr, 1, "Erreur interne du serveur");
+void release_file_lock(struct FileLock *lock)
+{
+    pthread_mutex_lock(&file_locks_mutex);
+    if (--lock->references > 0) {
+        pthread_mutex_unlock(&file_locks_mutex);
         return;
     }
 
-    struct sockaddr_in data_server_addr;
-    memset(&data_server_addr, 0, sizeof(data_server_addr));
-    data_server_addr.sin_family = AF_INET;
-    data_server_addr.sin_addr.s_addr = inet_addr(IP);
-    data_server_addr.sin_port = htons(0);
-    if (bind(data_socket, (struct sockaddr *)&data_server_addr, sizeof(data_server_addr)) < 0) {
-        perror("Erreur lors de la liaison du socket de données");
-        send_error_packet(server_socket, client_addr, 1, "Erreur interne du serveur");
-        close(data_socket);
+    struct FileLock **link = &file_locks[hash_filename(lock->filename) % FILE_LOCK_BUCKETS];
+    while (*link != lock)
+        link = &(*link)->next;
+    *link = lock->next;
+    pthread_mutex_unlock(&file_locks_mutex);
+
+    pthread_cond_destroy(&lock->released);
+    free(lock);
+}
+
+//Le verrou ne peut pas être pris tout de suite. file_locks_mutex doit être verrouillé.
+bool file_lock_busy(const struct FileLock *lock, bool exclusive)
+{
+    return lock->writer || (exclusive ? lock->readers > 0 : lock->writers_waiting > 0);
+}
+
+//Prend le verrou d'un fichier, partagé ou exclusif, en attendant au plus wait_seconds
+//secondes (sans limite pour 0). Renvoie false si le délai expire. Les sondes lock_wait
+//et lock_acquired encadrent l'attente derrière les autres transferts du même fichier.
+bool lock_file(struct FileLock *lock, bool exclusive, int wait_seconds, unsigned short port)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += wait_seconds;
+
+    TRACE_PROBE(lock_wait, port);
+    pthread_mutex_lock(&file_locks_mutex);
+    if (exclusive)
+        lock->writers_waiting++;
+    while (file_lock_busy(lock, exclusive)) {
+        if (wait_seconds == 0) {
+            pthread_cond_wait(&lock->released, &file_locks_mutex);
+        } else if (pthread_cond_timedwait(&lock->released, &file_locks_mutex, &deadline) == ETIMEDOUT) {
+            //Les lectures retenues par cette écriture en attente peuvent repartir.
+            if (exclusive) {
+                lock->writers_waiting--;
+                pthread_cond_broadcast(&lock->released);
+            }
+            pthread_mutex_unlock(&file_locks_mutex);
+            return false;
+        }
+    }
+    if (exclusive) {
+        lock->writers_waiting--;
+        lock->writer = true;
+    } else {
+        lock->readers++;
+    }
+    pthread_mutex_unlock(&file_locks_mutex);
+    TRACE_PROBE(lock_acquired, port);
+    return true;
+}
+
+void unlock_file(struct FileLock *lock, bool exclusive)
+{
+    pthread_mutex_lock(&file_locks_mutex);
+    if (exclusive)
+        lock->writer = false;
+    else
+        lock->readers--;
+    pthread_cond_broadcast(&lock->released);
+    pthread_mutex_unlock(&file_locks_mutex);
+}
+
+//Rend le verrou exclusif en le gardant partagé, sans laisser passer d'écriture entre les deux.
+void downgrade_file_lock(struct FileLock *lock)
+{
+    pthread_mutex_lock(&file_locks_mutex);
+    lock->writer = false;
+    lock->readers++;
+    pthread_cond_broadcast(&lock->released);
+    pthread_mutex_unlock(&file_locks_mutex);
+}
+
+double elapsed_seconds(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+//Un fichier en cours de rapatriement est lu dans son fichier de cache, un fichier du
+//stockage dédupliqué morceau par morceau d'après son manifeste.
+int readahead_open(struct ReadAhead *reader, const char *filename, off_t offset)
+{
+    reader->fetch = attach_fetch(filename);
+    reader->fd = reader->fetch != NULL ? dup(reader->fetch->fd) : open(filename, O_RDONLY);
+    if (reader->fd < 0) {
+        if (reader->fetch != NULL)
+            release_fetch(reader->fetch);
+        return -1;
+    }
+
+    reader->length = 0;
+    reader->position = 0;
+    reader->next_offset = offset;
+    reader->refills = 0;
+    reader->stall_seconds = 0;
+    reader->max_stall_seconds = 0;
+    reader->hole_bytes = 0;
+
+    int manifest = manifest_open(&reader->manifest, reader->fd);
+    if (manifest < 0) {
+        close(reader->fd);
+        if (reader->fetch != NULL)
+            release_fetch(reader->fetch);
+        return -1;
+    }
+    if (manifest > 0)
+        return 0;
+
+    posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(reader->fd, offset, sizeof(reader->buffer), POSIX_FADV_WILLNEED);
+    return 0;
+}
+
+//Remplit la fenêtre suivante puis annonce au noyau celle d'après, pour que sa lecture
+//se fasse pendant l'envoi des blocs déjà en mémoire.
+int readahead_refill(struct ReadAhead *reader)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TRACE_PROBE(disk_start, reader->next_offset);
+
+    size_t limit = sizeof(reader->buffer);
+    if (reader->fetch != NULL && wait_fetch_data(reader->fetch, reader->next_offset, &limit) < 0)
+        return -1;
+
+    ssize_t length = reader->manifest.chunks != NULL ? manifest_chunk(&reader->manifest, reader->next_offset, reader->buffer)
+                                                     : read_sparse(reader->fd, reader->buffer, limit, reader->next_offset, &reader->hole_bytes);
+    if (length < 0)
+        return -1;
+    TRACE_PROBE(disk_done, reader->next_offset + length);
+
+    double stall = elapsed_seconds(&start);
+    reader->stall_seconds += stall;
+    if (stall > reader->max_stall_seconds)
+        reader->max_stall_seconds = stall;
+    reader->refills++;
+
+    reader->length = length;
+    reader->position = 0;
+    reader->next_offset += length;
+    if (reader->manifest.chunks == NULL && (size_t)length == sizeof(reader->buffer))
+        posix_fadvise(reader->fd, reader->next_offset, sizeof(reader->buffer), POSIX_FADV_WILLNEED);
+    return 0;
+}
+
+//Copie le bloc suivant (au plus 512 octets) dans block. Renvoie sa taille, 0 en fin
+//de fichier, -1 en cas d'erreur de lecture.
+ssize_t readahead_block(struct ReadAhead *reader, unsigned char *block)
+{
+    if (reader->position == reader->length && readahead_refill(reader) < 0)
+        return -1;
+
+    size_t size = reader->length - reader->position;
+    if (size > 512)
+        size = 512;
+    memcpy(block, reader->buffer + reader->position, size);
+    reader->position += size;
+    return size;
+}
+
+void readahead_close(struct ReadAhead *reader, unsigned short port)
+{
+    printf("Lecture anticipée pour le client sur le port %d : %lu fenêtres, attente disque %.3f ms (max %.3f ms), %llu octets de trous\n",
+           port, reader->refills, reader->stall_seconds * 1000, reader->max_stall_seconds * 1000, reader->hole_bytes);
+    if (reader->manifest.chunks != NULL)
+        printf("Fichier dédupliqué pour le client sur le port %d : %lu morceaux lus dont %lu depuis le cache\n",
+               port, reader->manifest.chunk_reads, reader->manifest.cache_hits);
+    manifest_close(&reader->manifest);
+    close(reader->fd);
+    if (reader->fetch != NULL)
+        release_fetch(reader->fetch);
+}
+
+void handle_wrq(int server_socket, struct sockaddr_in client_addr, const struct TftpRequest *request, struct FileLock *file_lock) {
+    printf("Traitement de la demande d'écriture (WRQ) du client\n");
+    unsigned short port = ntohs(client_addr.sin_port);
+
+    //Une écriture dans le stockage dédupliqué, ou par-dessus un fichier qui y est déjà,
+    //remplace le fichier entier : les options resume et delta ne sont pas acceptées.
+    bool manifest;
+    stored_file_size(request->filename, &manifest);
+    bool dedup = dedup_enabled || manifest;
+
+    struct TftpOption accepted_options[MAX_OPTIONS];
+    int accepted_count = 0;
+    char offset_text[32];
+    //Une reprise ne vaut que pour l'écriture interrompue de ce client sur ce fichier, et
+    //jamais au-delà de ce qu'il en reste : sinon elle repart de 0 et le fichier est tronqué.
+    off_t resumable = take_interrupted_upload(request->filename, client_addr.sin_addr.s_addr);
+    off_t file_size = stored_file_size(request->filename, NULL);
+    if (resumable > file_size)
+        resumable = file_size;
+    off_t offset = dedup ? 0 : negotiate_resume_offset(request, resumable, accepted_options, &accepted_count, offset_text, sizeof(offset_text));
+    if (offset < 0) {
+        send_error_packet(server_socket, client_addr, 8, "Option resume invalide");
+        TRACE_PROBE(close, port, 0, TRACE_CLOSE_REFUSED);
         return;
     }
 
-    struct timeval timeout;
-    timeout.tv_sec = TIMEOUT_SECONDS;
-    timeout.tv_usec = 0;
-    if (setsockopt(data_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) < 0){
-        perror("Erreur lors du réglage de l'option de délai d'attente");
-        close(data_socket);
+    bool delta = !dedup && find_option(request, "delta") != NULL;
+    if (delta) {
+        accepted_options[accepted_count].name = "delta";
+        accepted_options[accepted_count].value = "1";
+        accepted_count++;
+    }
+
+    char window_text[8];
+    int window_size = negotiate_window_size(request, delta, accepted_options, &accepted_count, window_text, sizeof(window_text));
+    if (window_size < 0) {
+        send_error_packet(server_socket, client_addr, 8, "Option windowsize invalide");
+        TRACE_PROBE(close, port, 0, TRACE_CLOSE_REFUSED);
         return;
     }
 
+    int rollover = negotiate_rollover(request, accepted_options, &accepted_count);
+    if (rollover < ROLLOVER_NONE) {
+        send_error_packet(server_socket, client_addr, 8, "Option rollover invalide");
+        TRACE_PROBE(close, port, 0, TRACE_CLOSE_REFUSED);
+        return;
+    }
 
-    unsigned char oack_packet[4];
-    oack_packet[0] = 0;
-    oack_packet[1] = OACK_OPCODE;
-    oack_packet[2] = 0;
-    oack_packet[3] = 0;
+    int data_socket = acquire_data_socket();
+    if (data_socket < 0) {
+        send_error_packet(server_socket, client_addr, 1, "Erreur interne du serveur");
+        TRACE_PROBE(close, port, 0, TRACE_CLOSE_FAILED);
+        return;
+    }
 
-    if (sendto(data_socket, oack_packet, sizeof(oack_packet), 0, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0) {
+    struct TransferState state;
+    memset(&state, 0, sizeof(state));
+    state.opcode = WRQ_OPCODE;
+    strcpy(state.filename, request->filename);
+    state.client_addr = client_addr;
+    state.data_socket = data_socket;
+    state.window_size = window_size;
+    state.offset = offset;
+    state.dedup = dedup;
+    state.last_packet_size = build_oack(state.last_packet, accepted_options, accepted_count);
+
+    if (sendto(data_socket, state.last_packet, state.last_packet_size, 0, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0) {
         perror("Erreur lors de l'envoi de l'OACK");
-        close(data_socket);
+        release_data_socket(data_socket);
+        TRACE_PROBE(close, port, 0, TRACE_CLOSE_FAILED);
         return;
     }
+    TRACE_PROBE(oack, port, state.last_packet_size);
 
-    FILE *file = fopen(filename, "wb");
-    if (file == NULL) {
-        send_error_packet(data_socket, client_addr, 1, "Impossible de créer le fichier");
-        perror("Erreur lors de l'ouverture du fichier en écriture");
-        close(data_socket);
+    receiver_init(&state.receiver, rollover, delta, offset);
+    state.receiver.window_size = window_size;
+    receive_file(&state, file_lock);
+}
+
+//Ouvre le fichier d'une écriture. En reprise, on conserve les offset premiers octets déjà
+//reçus et on écrit à la suite. En mode delta, l'ancienne copie est gardée entière : elle
+//est réécrite sur place et tronquée à la fin du transfert. Un transfert repris après un
+//redémarrage à chaud (file_opened) retrouve le fichier tel que l'ancien processus l'a laissé.
+//Les blocs sont écrits par pwrite à la position tenue par le destinataire : le fichier
+//n'a pas de position courante à placer. Hors mode delta, l'écriture est inscrite dans la
+//table des reprises (track_upload). Renvoie -1 en cas d'erreur.
+int open_received_file(struct TransferState *state)
+{
+    off_t offset = state->offset;
+    bool delta = state->receiver.delta;
+
+    int fd = open(state->filename, state->file_opened || offset > 0 || delta ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0 && !delta)
+        track_upload(state->filename, state->client_addr, state->receiver.write_offset);
+    if (state->file_opened)
+        return fd;
+
+    if (fd < 0 && delta && offset == 0)
+        fd = open(state->filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0 && offset > 0 && !delta && ftruncate(fd, offset) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    struct stat stat_buf;
+    if (fd >= 0 && fstat(fd, &stat_buf) == 0)
+        state->local_size = stat_buf.st_size;
+    state->file_opened = fd >= 0;
+    return fd;
+}
+
+//Reçoit les blocs d'une écriture, depuis le début ou là où l'ancien processus s'est arrêté.
+void receive_file(struct TransferState *state, struct FileLock *file_lock)
+{
+    int data_socket = state->data_socket;
+    struct sockaddr_in client_addr = state->client_addr;
+    struct Receiver *receiver = &state->receiver;
+    bool delta = receiver->delta;
+    unsigned short port = ntohs(client_addr.sin_port);
+
+    //Le fichier n'est ouvert (et tronqué) qu'à l'arrivée du premier bloc : une requête
+    //en double, dont la session ne reçoit jamais de données, ne l'écrase pas. Le verrou
+    //n'est tenu, exclusif, que le temps de l'ouvrir ; s'il reste pris par des lectures
+    //au-delà de FILE_LOCK_WAIT_SECONDS, l'écriture est refusée.
+    int fd = -1;
+    if (state->file_opened) {
+        if (!lock_file(file_lock, true, FILE_LOCK_WAIT_SECONDS, port)) {
+            send_error_packet(data_socket, client_addr, 0, "Serveur surchargé, réessayez plus tard");
+            fprintf(stderr, "Ecriture de %s refusée : fichier en cours de lecture\n", state->filename);
+            receiver_close(receiver);
+            release_data_socket(data_socket);
+            TRACE_PROBE(close, port, receiver->write_offset, TRACE_CLOSE_REFUSED);
+            return;
+        }
+        fd = open_received_file(state);
+        unlock_file(file_lock, true);
+        if (fd < 0) {
+            send_error_packet(data_socket, client_addr, 1, "Impossible de créer le fichier");
+            perror("Erreur lors de la réouverture du fichier en écriture");
+            receiver_close(receiver);
+            release_data_socket(data_socket);
+            TRACE_PROBE(close, port, receiver->write_offset, TRACE_CLOSE_FAILED);
+            return;
+        }
+    }
+
+    //En stockage dédupliqué, rien n'est écrit dans le fichier avant la fin : les blocs
+    //sont découpés en morceaux au fil de l'eau, puis le manifeste le remplace.
+    struct ChunkWriter *writer = NULL;
+    if (state->dedup && (writer = chunk_writer_create()) == NULL) {
+        send_error_packet(data_socket, client_addr, 1, "Erreur interne du serveur");
+        receiver_close(receiver);
+        release_data_socket(data_socket);
+        TRACE_PROBE(close, port, receiver->write_offset, TRACE_CLOSE_FAILED);
         return;
     }
 
-    unsigned short block_number = 1;
-    unsigned char ack_packet[4];
-    ack_packet[0] = 0;
-    ack_packet[1] = ACK_OPCODE;
+    //Avec une fenêtre, les blocs arrivent en rafales : UDP_GRO permet au noyau de les
+    //livrer en une seule réception.
+    struct BurstReader reader;
+    burst_reader_init(&reader);
+    struct TransferLink link;
+    transfer_link_init(&link, data_socket, client_addr, &reader);
+    bool gro = state->window_size > 1 && set_udp_gro(data_socket, true);
+    bool handed_off = false;
+    struct WriteBatch batch;
+    batch.length = 0;
     while (1) {
         unsigned char data_packet[MAX_PACKET_SIZE];
-        ssize_t bytes_received = recvfrom(data_socket, data_packet, MAX_PACKET_SIZE, 0, NULL, NULL);
+        ssize_t bytes_received = receive_data(&link, data_packet, state->last_packet, state->last_packet_size);
         if (bytes_received < 0) {
             perror("Erreur lors de la réception du paquet de données");
             break;
@@ -172,290 +1610,929 @@ void handle_wrq(int server_socket, struct sockaddr_in client_addr, char *filenam
             break;
         }
 
-        if (data_packet[1] != DATA_OPCODE) {
+        TRACE_PROBE(data_receive, port, packet_block(data_packet, bytes_received));
+        int action = receiver_accept(receiver, data_packet, bytes_received);
+        if (action == RECEIVE_INVALID) {
             fprintf(stderr, "Paquet reçu n'est pas un paquet de données. Sortie...\n");
             break;
         }
 
-        unsigned short received_block_number = (data_packet[2] << 8) | data_packet[3];
-        if (received_block_number != block_number) {
-            fprintf(stderr, "Numéro de bloc invalide. Sortie...\n");
-            break;
+        //Un doublon du dernier bloc reçu signifie que notre ACK s'est perdu : on le renvoie.
+        if (action == RECEIVE_REPEAT_ACK)
+            sendto(data_socket, state->last_packet, state->last_packet_size, 0, (struct sockaddr *)&client_addr, sizeof(client_addr));
+
+        //Un MATCH annonce un bloc identique à celui de notre copie : on le relit sur place.
+        if (action == RECEIVE_MATCH) {
+            ssize_t local_bytes = fd >= 0 ? pread(fd, data_packet + 4, 512, receiver->match_offset) : -1;
+            if (local_bytes >= 0) {
+                bytes_received = 4 + local_bytes;
+                action = receiver_accept_match(receiver, data_packet, local_bytes);
+            }
+        }
+        if (action == RECEIVE_DELIVER && writer != NULL) {
+            size_t data_size = bytes_received - 4;
+            bool stored = true;
+            TRACE_PROBE(disk_start, receiver->write_offset);
+            do {
+                stored = stored && chunk_writer_add(writer, data_packet + 4, data_size) == 0;
+            } while (receiver_next(receiver, data_packet + 4, &data_size));
+            TRACE_PROBE(disk_done, receiver->write_offset);
+            if (!stored) {
+                send_error_packet(data_socket, client_addr, 3, "Impossible de stocker le fichier");
+                perror("Erreur lors du stockage d'un morceau");
+                break;
+            }
+        } else if (action == RECEIVE_DELIVER) {
+            if (fd < 0) {
+                if (!lock_file(file_lock, true, FILE_LOCK_WAIT_SECONDS, port)) {
+                    send_error_packet(data_socket, client_addr, 0, "Serveur surchargé, réessayez plus tard");
+                    fprintf(stderr, "Ecriture de %s refusée : fichier en cours de lecture\n", state->filename);
+                    break;
+                }
+                fd = open_received_file(state);
+                unlock_file(file_lock, true);
+                if (fd < 0) {
+                    send_error_packet(data_socket, client_addr, 1, "Impossible de créer le fichier");
+                    perror("Erreur lors de l'ouverture du fichier en écriture");
+                    break;
+                }
+            }
+
+            //Les blocs nuls ne sont pas écrits : le fichier reçu reste creux.
+            size_t data_size = bytes_received - 4;
+            int written;
+            do {
+                written = write_sparse(fd, &batch, data_packet + 4, data_size, receiver->write_offset, state->local_size);
+                if (written > 0)
+                    state->zero_blocks++;
+            } while (written >= 0 && receiver_next(receiver, data_packet + 4, &data_size));
+            if (written < 0) {
+                send_error_packet(data_socket, client_addr, 3, "Erreur d'écriture du fichier");
+                perror("Erreur lors de l'écriture du fichier");
+                break;
+            }
         }
 
-        size_t data_size = bytes_received - 4;
-        fwrite(data_packet + 4, 1, data_size, file);
+        //Avec une fenêtre, on n'acquitte qu'à la fin de chaque fenêtre, ou tout de suite
+        //s'il y manque un bloc.
+        if (!receiver_ack_due(receiver))
+            continue;
+
+        //Les blocs de la fenêtre sont écrits avant d'être acquittés.
+        TRACE_PROBE(disk_start, batch.offset);
+        int flushed = fd >= 0 ? flush_writes(fd, &batch) : 0;
+        TRACE_PROBE(disk_done, receiver->write_offset);
+        if (flushed < 0) {
+            send_error_packet(data_socket, client_addr, 3, "Erreur d'écriture du fichier");
+            perror("Erreur lors de l'écriture du fichier");
+            break;
+        }
 
-        ack_packet[2] = block_number >> 8;
-        ack_packet[3] = block_number & 0xFF;
-        if (sendto(data_socket, ack_packet, sizeof(ack_packet), 0, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0) {
+        size_t ack_size = build_ack(state->last_packet, receiver->acked, delta ? fd : -1, receiver->write_offset, state->local_size);
+        if (sendto(data_socket, state->last_packet, ack_size, 0, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0) {
             perror("Erreur lors de l'envoi de l'ACK");
             break;
         }
+        state->last_packet_size = ack_size;
+        if (fd >= 0 && !delta)
+            update_upload(state->filename, client_addr, receiver->complete ? -1 : receiver->write_offset);
+        TRACE_PROBE(ack_send, port, receiver->acked);
 
-        if (data_size < 512)
+        if (receiver->complete)
             break;
 
-        if (block_number == 65535 && !bigfile) {
+        if (receiver->too_big) {
             fprintf(stderr, "Fichier trop volumineux. Sortie...\n");
             break;
         }
 
-        block_number++;
-        
-        if (block_number == 0) {
-            block_number = 1;
+        //Redémarrage à chaud : juste après un ACK, le transfert peut passer au nouveau
+        //processus, une fois traités les blocs déjà livrés par GRO.
+        if (writer == NULL && reader.position == reader.length && export_transfer(state)) {
+            handed_off = true;
+            break;
         }
     }
 
-    fclose(file);
-    close(data_socket);
+    //La taille finale est fixée par troncature : elle allonge le fichier si les derniers
+    //blocs étaient nuls et coupe la fin d'une ancienne copie plus longue (mode delta).
+    if (fd >= 0) {
+        if (receiver->complete) {
+            lock_file(file_lock, true, 0, port);
+            if (ftruncate(fd, receiver->write_offset) < 0)
+                perror("Erreur lors de la troncature du fichier");
+            unlock_file(file_lock, true);
+            if (delta)
+                printf("Delta : %lu blocs repris de la copie locale\n", receiver->matched_blocks);
+            if (state->zero_blocks > 0)
+                printf("Ecriture creuse : %lu blocs nuls non écrits\n", state->zero_blocks);
+        }
+        close(fd);
+    }
+    if (writer != NULL) {
+        if (receiver->complete) {
+            lock_file(file_lock, true, 0, port);
+            if (chunk_writer_finish(writer, state->filename) < 0)
+                perror("Erreur lors de l'écriture du manifeste");
+            unlock_file(file_lock, true);
+        }
+        chunk_writer_free(writer);
+    }
+    receiver_close(receiver);
+    if (gro)
+        printf("Réception groupée pour le client sur le port %d : %lu paquets en %lu réceptions\n", port, reader.packets, reader.receives);
+    TRACE_PROBE(close, port, receiver->write_offset, handed_off ? TRACE_CLOSE_HANDED_OFF : receiver->complete ? TRACE_CLOSE_DONE : TRACE_CLOSE_FAILED);
+
+    if (handed_off) {
+        forget_data_socket(data_socket);
+        return;
+    }
+    if (receiver->complete)
+        linger_final_ack(data_socket, client_addr, state->last_packet);
+    if (gro)
+        set_udp_gro(data_socket, false);
+    release_data_socket(data_socket);
 }
 
 
-void handle_rrq(int server_socket, struct sockaddr_in client_addr, char *filename, bool bigfile)
+void handle_rrq(int server_socket, struct sockaddr_in client_addr, const struct TftpRequest *request, struct FileLock *file_lock)
 {
     printf("Traitement de la demande de lecture (RRQ) du client\n");
-
-    int data_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (data_socket < 0){
-        perror("Erreur lors de la création du socket de données");
-        send_error_packet(server_socket, client_addr, 1, "Erreur interne du serveur");
+    unsigned short port = ntohs(client_addr.sin_port);
+
+    struct TftpOption accepted_options[MAX_OPTIONS];
+    int accepted_count = 0;
+    char offset_text[32];
+    off_t offset = negotiate_resume_offset(request, stored_file_size(request->filename, NULL), accepted_options, &accepted_count, offset_text, sizeof(offset_text));
+    if (offset < 0) {
+        send_error_packet(server_socket, client_addr, 8, "Option resume invalide");
+        TRACE_PROBE(close, port, 0, TRACE_CLOSE_REFUSED);
         return;
     }
 
-    struct sockaddr_in data_server_addr;
-    memset(&data_server_addr, 0, sizeof(data_server_addr));
-    data_server_addr.sin_family = AF_INET;
-    data_server_addr.sin_addr.s_addr = inet_addr(IP);
-    data_server_addr.sin_port = htons(0);
-    if (bind(data_socket, (struct sockaddr *)&data_server_addr, sizeof(data_server_addr)) < 0)
-    {
-        perror("Erreur lors de la liaison du socket de données");
-        send_error_packet(server_socket, client_addr, 1, "Erreur interne du serveur");
-        close(data_socket);
-        return;
+    bool delta = find_option(request, "delta") != NULL;
+    if (delta) {
+        accepted_options[accepted_count].name = "delta";
+        accepted_options[accepted_count].value = "1";
+        accepted_count++;
     }
 
-    struct timeval timeout;
-    timeout.tv_sec = TIMEOUT_SECONDS;
-    timeout.tv_usec = 0;
-    if (setsockopt(data_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) < 0){
-        perror("Erreur lors du réglage de l'option de délai d'attente");
-        close(data_socket);
+    char window_text[8];
+    int window_size = negotiate_window_size(request, delta, accepted_options, &accepted_count, window_text, sizeof(window_text));
+    if (window_size < 0) {
+        send_error_packet(server_socket, client_addr, 8, "Option windowsize invalide");
+        TRACE_PROBE(close, port, 0, TRACE_CLOSE_REFUSED);
         return;
     }
 
-    unsigned char oack_packet[4];
-    oack_packet[0] = 0;
-    oack_packet[1] = OACK_OPCODE;
-    oack_packet[2] = 0;
-    oack_packet[3] = 0;
+    int rollover = negotiate_rollover(request, accepted_options, &accepted_count);
+    if (rollover < ROLLOVER_NONE) {
+        send_error_packet(server_socket, client_addr, 8, "Option rollover invalide");
+        TRACE_PROBE(close, port, 0, TRACE_CLOSE_REFUSED);
+        return;
+    }
 
-    if (sendto(data_socket, oack_packet, sizeof(oack_packet), 0, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0) {
-        perror("Erreur lors de l'envoi de l'OACK");
-        close(data_socket);
+    //Le verrou est pris, partagé, avant l'OACK : une lecture retenue au-delà de
+    //FILE_LOCK_WAIT_SECONDS par une écriture du même fichier est refusée tout de suite
+    //plutôt que d'attendre sans fin après l'ACK 0. Sans verrou (file_lock nul), le
+    //fichier est en cours de rapatriement et n'est lu que dans le fichier de cache, que
+    //le rapatriement protège pour ses lecteurs.
+    if (file_lock != NULL && !lock_file(file_lock, false, FILE_LOCK_WAIT_SECONDS, port)) {
+        fprintf(stderr, "Lecture de %s refusée : fichier en cours d'écriture\n", request->filename);
+        send_error_packet(server_socket, client_addr, 0, "Serveur surchargé, réessayez plus tard");
+        TRACE_PROBE(close, port, 0, TRACE_CLOSE_REFUSED);
         return;
     }
 
-    unsigned char ack_packet[4];
-    ssize_t ack_recieved = recvfrom(data_socket, ack_packet, 4, 0, NULL, NULL);
-    if(ack_recieved <= 0){
-        perror("Erreur de réception du paquet ACK");
-        close(data_socket);
+    int data_socket = acquire_data_socket();
+    if (data_socket < 0) {
+        if (file_lock != NULL)
+            unlock_file(file_lock, false);
+        send_error_packet(server_socket, client_addr, 1, "Erreur interne du serveur");
+        TRACE_PROBE(close, port, 0, TRACE_CLOSE_FAILED);
         return;
     }
-    if(ack_packet[1] != ACK_OPCODE){
-        fprintf(stderr, "Paquet ACK invalide reçu. Sortie...\n");
-        close(data_socket);
+
+    struct TransferState state;
+    memset(&state, 0, sizeof(state));
+    state.opcode = RRQ_OPCODE;
+    strcpy(state.filename, request->filename);
+    state.client_addr = client_addr;
+    state.data_socket = data_socket;
+    state.window_size = window_size;
+    state.read_offset = offset;
+
+    unsigned char oack_packet[MAX_PACKET_SIZE];
+    size_t oack_size = build_oack(oack_packet, accepted_options, accepted_count);
+    sender_init(&state.sender, rollover, delta, 0);
+
+    TRACE_PROBE(oack, port, oack_size);
+    struct TransferLink link;
+    transfer_link_init(&link, data_socket, client_addr, NULL);
+    if (send_and_wait_ack(&link, oack_packet, 1, oack_size, &state.sender) != LINK_OK) {
+        fprintf(stderr, "Le client n'a pas acquitté l'OACK. Sortie...\n");
+        if (file_lock != NULL)
+            unlock_file(file_lock, false);
+        release_data_socket(data_socket);
+        TRACE_PROBE(close, port, 0, TRACE_CLOSE_FAILED);
         return;
     }
 
+    //L'OACK est acquitté par l'ACK 0 ; les données commencent au bloc 1.
+    state.sender.block_number = 1;
+    send_file(&state, file_lock);
+}
 
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL)
+//Envoie les blocs d'une lecture, depuis le début ou là où l'ancien processus s'est arrêté.
+//Le verrou du fichier, s'il y en a un, est déjà tenu partagé et libéré ici.
+void send_file(struct TransferState *state, struct FileLock *file_lock)
+{
+    int data_socket = state->data_socket;
+    struct sockaddr_in client_addr = state->client_addr;
+    struct Sender *sender = &state->sender;
+    int window_size = state->window_size;
+    unsigned short port = ntohs(client_addr.sin_port);
+    struct TransferLink link;
+    transfer_link_init(&link, data_socket, client_addr, NULL);
+
+    struct ReadAhead reader;
+    if (readahead_open(&reader, state->filename, state->read_offset) < 0)
     {
-        send_error_packet(server_socket, client_addr, 1, "Fichier introuvable");
+        if (file_lock != NULL)
+            unlock_file(file_lock, false);
+        send_error_packet(data_socket, client_addr, 1, "Fichier introuvable");
         perror("Erreur lors de l'ouverture du fichier en lecture");
-        close(data_socket);
+        release_data_socket(data_socket);
+        TRACE_PROBE(close, port, state->read_offset, TRACE_CLOSE_FAILED);
         return;
     }
 
-    unsigned short block_number = 1;
-    int attempts = 1;
-
+    //En mode delta, un bloc identique à celui du client est remplacé par un MATCH.
+    //Avec une fenêtre, les blocs qui suivent le dernier bloc acquitté restent dans
+    //window et ne sont pas relus : seule la fin de la fenêtre est complétée. Un transfert
+    //repris après un redémarrage à chaud relit, à partir de read_offset, les blocs que
+    //l'ancien processus avait envoyés sans qu'ils soient acquittés.
+    unsigned char window[MAX_WINDOW_BLOCKS][MAX_PACKET_SIZE];
+    size_t block_sizes[MAX_WINDOW_BLOCKS];
+    size_t packet_sizes[MAX_WINDOW_BLOCKS];
+    bool end_of_file = false;
+    bool handed_off = false;
+    bool complete = false;
+    sender->window_sent = 0;
+    sender->retransmitted = false;
+    sender->fast_retransmitted = false;
     while (1)
     {
-        unsigned char data_packet[MAX_PACKET_SIZE];
-        ssize_t bytes_read = fread(data_packet + 4, 1, 512, file);
-
-        data_packet[1] = DATA_OPCODE;
-        data_packet[2] = block_number >> 8;
-        data_packet[3] = block_number & 0xFF;
-
-        if (sendto(data_socket, data_packet, 4 + bytes_read, 0, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0)
-        {
-            perror("Erreur lors de l'envoi du paquet de données");
-            break;
-        }
-        printf("Sent data block %d (%ld bytes) to client on port %d\n", block_number, bytes_read, ntohs(client_addr.sin_port));
-
-        ssize_t bytes_received = recvfrom(data_socket, ack_packet, 4, 0, NULL, NULL);
-        if (bytes_received < 0)
-        {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-            {
-                if (attempts >= 2)
-                {
-                    fprintf(stderr, "Nombre maximal de tentatives atteint. Sortie...\n");
-                    break;
-                }
-                attempts++;
-                fprintf(stderr, "Un délai d'attente s'est produit, nouvelle tentative...\n");
-                continue;
-            }
-            else
-            {
-                perror("Erreur de réception du paquet ACK");
+        //Sans rollover, la fenêtre s'arrête au bloc 65535.
+        bool read_error = false;
+        while (!end_of_file && sender->window_sent < window_size && (sender->rollover != ROLLOVER_NONE || sender->block_number + sender->window_sent <= 65535)) {
+            int index = sender->window_sent;
+            ssize_t bytes_read = readahead_block(&reader, window[index] + 4);
+            if (bytes_read < 0) {
+                read_error = true;
                 break;
             }
+            block_sizes[index] = bytes_read;
+            packet_sizes[index] = sender_packet(sender, window[index], bytes_read);
+            end_of_file = bytes_read < 512;
         }
-        else if (bytes_received == 0)
-        {
-            fprintf(stderr, "Connexion fermée par le client.\n");
+        if (read_error) {
+            send_error_packet(data_socket, client_addr, 0, "Erreur de lecture du fichier");
+            perror("Erreur lors de la lecture du fichier");
             break;
         }
 
-        if (ack_packet[1] != ACK_OPCODE || (ack_packet[2] != (block_number >> 8)) || (ack_packet[3] != (block_number & 0xFF)))
-        {
-            fprintf(stderr, "Paquet ACK invalide reçu. Sortie...\n");
+        int count = sender->window_sent;
+        state->windows++;
+        TRACE_PROBE(data_send, port, sender->block_number, count);
+        if (send_and_wait_ack(&link, window[0], count, packet_sizes[count - 1], sender) != LINK_OK)
+            break;
+
+        int acked_blocks = sender->acked_blocks;
+        bool more = true;
+        for (int i = 0; i < acked_blocks && more; ++i) {
+            printf("Sent data block %d (%zu bytes) to client on port %d\n", sender->block_number, block_sizes[i], ntohs(client_addr.sin_port));
+            more = sender_next(sender, block_sizes[i]);
+            state->read_offset += block_sizes[i];
+        }
+        if (!more) {
+            complete = !sender->too_big;
             break;
         }
 
-        if (block_number == 65535 && !bigfile) {
-            send_error_packet(server_socket, client_addr, 3, "Fichier trop volumineux");
-            fprintf(stderr, "Fichier trop volumineux. Sortie...\n");
+        //Les blocs non acquittés passent en tête de la fenêtre.
+        memmove(window, window[acked_blocks], (count - acked_blocks) * sizeof(window[0]));
+        memmove(block_sizes, block_sizes + acked_blocks, (count - acked_blocks) * sizeof(block_sizes[0]));
+        memmove(packet_sizes, packet_sizes + acked_blocks, (count - acked_blocks) * sizeof(packet_sizes[0]));
+
+        //Redémarrage à chaud : entre deux fenêtres, le transfert peut passer au nouveau
+        //processus, sauf pendant un rapatriement (le fichier de cache est propre à celui-ci).
+        if (file_lock != NULL && export_transfer(state)) {
+            handed_off = true;
             break;
         }
+    }
+    if (sender->too_big) {
+        send_error_packet(data_socket, client_addr, 3, "Fichier trop volumineux");
+        fprintf(stderr, "Fichier trop volumineux. Sortie...\n");
+    }
+
+    printf("Retransmissions pour le client sur le port %d : %lu rapides, %lu après délai d'attente\n",
+           ntohs(client_addr.sin_port), sender->stats.fast, sender->stats.timeout);
+    if (sender->delta)
+        printf("Delta : %lu blocs remplacés par un MATCH\n", sender->matched_blocks);
+    if (window_size > 1)
+        printf("Fenêtres de %d blocs pour le client sur le port %d : %lu envois (%s)\n",
+               window_size, ntohs(client_addr.sin_port), state->windows, backend_name(io_backend));
+    readahead_close(&reader, port);
+    TRACE_PROBE(close, port, state->read_offset, handed_off ? TRACE_CLOSE_HANDED_OFF : complete ? TRACE_CLOSE_DONE : TRACE_CLOSE_FAILED);
+    if (file_lock != NULL)
+        unlock_file(file_lock, false);
+    if (handed_off) {
+        forget_data_socket(data_socket);
+        return;
+    }
+    release_data_socket(data_socket);
+}
+
+//Redémarrage à chaud, côté ancien processus : si un nouveau processus a pris le socket
+//d'écoute, lui envoie l'état du transfert avec son socket de données. Le fichier d'une
+//écriture, dont les blocs sont écrits avant chaque ACK, est déjà à jour pour le nouveau processus.
+//Renvoie true si le transfert a été transmis ; sinon il se poursuit ici.
+bool export_transfer(struct TransferState *state)
+{
+    pthread_mutex_lock(&handoff_mutex);
+    if (handoff_socket < 0) {
+        pthread_mutex_unlock(&handoff_mutex);
+        return false;
+    }
 
-        block_number++;
+    struct ReorderBuffer *reorder = state->receiver.reorder;
+    state->has_reorder = reorder != NULL;
+    if (reorder != NULL)
+        state->reorder = *reorder;
+    state->receiver.reorder = NULL;
+    bool sent = send_with_descriptor(handoff_socket, state, sizeof(*state), state->data_socket) == 0;
+    state->receiver.reorder = reorder;
+
+    //Si le nouveau processus ne répond plus, les transferts restants se terminent ici.
+    if (!sent) {
+        perror("Erreur lors de la transmission d'un transfert au nouveau processus");
+        close(handoff_socket);
+        handoff_socket = -1;
+    }
+    pthread_mutex_unlock(&handoff_mutex);
+    if (!sent)
+        return false;
+    printf("Transfert de %s transmis au nouveau processus (client sur le port %d)\n", state->filename, ntohs(state->client_addr.sin_port));
+    return true;
+}
+
+//Redémarrage à chaud, côté nouveau processus : poursuit un transfert reçu de l'ancien.
+void *resume_transfer(void *arg)
+{
+    struct TransferState *state = (struct TransferState *)arg;
+    if (state->has_reorder) {
+        state->receiver.reorder = malloc(sizeof(struct ReorderBuffer));
+        if (state->receiver.reorder != NULL)
+            *state->receiver.reorder = state->reorder;
+    }
 
-        if (block_number == 0) {
-            block_number = 1;
+    adopt_data_socket();
+    int session = admit_session(state->client_addr.sin_addr, state->filename, true);
+    if (session < 0) {
+        fprintf(stderr, "Transfert repris refusé pour %s : trop de sessions en cours\n", inet_ntoa(state->client_addr.sin_addr));
+        send_error_packet(state->data_socket, state->client_addr, 0, "Serveur surchargé, réessayez plus tard");
+        TRACE_PROBE(resume, ntohs(state->client_addr.sin_port), state->opcode, state->filename);
+        TRACE_PROBE(close, ntohs(state->client_addr.sin_port), 0, TRACE_CLOSE_REFUSED);
+        receiver_close(&state->receiver);
+        release_data_socket(state->data_socket);
+    } else {
+        printf("Transfert de %s repris pour le client sur le port %d\n", state->filename, ntohs(state->client_addr.sin_port));
+        TRACE_PROBE(resume, ntohs(state->client_addr.sin_port), state->opcode, state->filename);
+        struct FileLock *file_lock = acquire_file_lock(state->filename);
+        if (file_lock == NULL) {
+            send_error_packet(state->data_socket, state->client_addr, 0, "Erreur interne du serveur");
+            TRACE_PROBE(close, ntohs(state->client_addr.sin_port), 0, TRACE_CLOSE_FAILED);
+            receiver_close(&state->receiver);
+            release_data_socket(state->data_socket);
+        } else if (state->opcode == WRQ_OPCODE) {
+            receive_file(state, file_lock);
+        } else if (!lock_file(file_lock, false, FILE_LOCK_WAIT_SECONDS, ntohs(state->client_addr.sin_port))) {
+            fprintf(stderr, "Lecture reprise de %s refusée : fichier en cours d'écriture\n", state->filename);
+            send_error_packet(state->data_socket, state->client_addr, 0, "Serveur surchargé, réessayez plus tard");
+            TRACE_PROBE(close, ntohs(state->client_addr.sin_port), state->read_offset, TRACE_CLOSE_REFUSED);
+            release_data_socket(state->data_socket);
+        } else {
+            send_file(state, file_lock);
         }
+        if (file_lock != NULL)
+            release_file_lock(file_lock);
+        release_session(session);
+    }
+
+    free(state);
+    end_request_thread();
+    pthread_exit(NULL);
+}
 
-        if (bytes_read < 512)
+//Reçoit un à un les transferts de l'ancien serveur et les poursuit, chacun dans son
+//thread, jusqu'à ce que l'ancien serveur, ses derniers transferts terminés, ferme le socket.
+//Ce thread compte parmi ceux des requêtes : un nouveau redémarrage à chaud attend qu'il
+//ait tout reçu, puis transmet aussi ces transferts.
+void *receive_handoff(void *arg)
+{
+    int previous_server = (int)(intptr_t)arg;
+    unsigned long transfers = 0;
+    while (1) {
+        struct TransferState *state = malloc(sizeof(struct TransferState));
+        if (state == NULL) {
+            perror("Erreur d'allocation de mémoire pour un transfert repris");
             break;
+        }
+
+        int data_socket = -1;
+        ssize_t size = receive_with_descriptor(previous_server, state, sizeof(*state), &data_socket);
+        if (size != (ssize_t)sizeof(*state) || data_socket < 0) {
+            if (data_socket >= 0)
+                close(data_socket);
+            free(state);
+            if (size <= 0)
+                break;
+            continue;
+        }
+        state->data_socket = data_socket;
+
+        if (!start_request_thread(resume_transfer, state)) {
+            TRACE_PROBE(resume, ntohs(state->client_addr.sin_port), state->opcode, state->filename);
+            TRACE_PROBE(close, ntohs(state->client_addr.sin_port), 0, TRACE_CLOSE_FAILED);
+            close(data_socket);
+            free(state);
+            continue;
+        }
+        transfers++;
     }
 
-    fclose(file);
-    close(data_socket);
+    printf("Redémarrage à chaud terminé : %lu transferts repris de l'ancien serveur\n", transfers);
+    close(previous_server);
+    end_request_thread();
+    pthread_exit(NULL);
 }
 
-int main()
+//Envoie size octets sur le socket UNIX avec, en données annexes (SCM_RIGHTS), le
+//descripteur fd. Renvoie 0, ou -1 en cas d'erreur.
+int send_with_descriptor(int unix_socket, const void *data, size_t size, int fd)
 {
-    int file_count = 0;
-    DIR *dir;
-    struct dirent *entry;
-    struct stat stat_buf;
+    struct iovec iov = { (void *)data, size };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &fd, sizeof(fd));
+
+    return sendmsg(unix_socket, &message, MSG_NOSIGNAL) == (ssize_t)size ? 0 : -1;
+}
 
-    dir = opendir(".");
-    if (dir == NULL) {
-        perror("Error opening server directory");
-        exit(EXIT_FAILURE);
+//Reçoit un message envoyé par send_with_descriptor. *fd vaut -1 si aucun descripteur ne
+//l'accompagne. Renvoie la taille du message, 0 si l'autre processus a fermé le socket.
+ssize_t receive_with_descriptor(int unix_socket, void *data, size_t size, int *fd)
+{
+    struct iovec iov = { data, size };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    *fd = -1;
+    ssize_t length = recvmsg(unix_socket, &message, MSG_CMSG_CLOEXEC);
+    if (length < 0)
+        return -1;
+
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(header), sizeof(*fd));
     }
+    return length;
+}
 
-    while ((entry = readdir(dir)) != NULL && file_count < MAX_FILES) {
-        if (stat(entry->d_name, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode))  {
-            char *extension = strrchr(entry->d_name, '.');
-            if (extension != NULL && strcmp(extension, ".txt") == 0) {
-                file_names[file_count] = strdup(entry->d_name);
-                if (file_names[file_count] == NULL) {
-                    perror("Error copying filename");
-                    exit(EXIT_FAILURE);
-                }
-                file_count++;
+//Socket UNIX sur lequel un futur processus viendra demander la place de celui-ci.
+//Le chemin laissé par un serveur précédent (arrêté, ou qui vient de nous céder la
+//place) est remplacé. Renvoie -1 si le redémarrage à chaud est impossible.
+int listen_handoff()
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, HANDOFF_SOCKET);
+
+    int handoff_listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (handoff_listener < 0)
+        return -1;
+    unlink(HANDOFF_SOCKET);
+    if (bind(handoff_listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(handoff_listener, 1) < 0) {
+        close(handoff_listener);
+        return -1;
+    }
+    return handoff_listener;
+}
+
+//Mélange (FNV-1a) la position et la taille d'un champ dans l'empreinte du format.
+#define LAYOUT_FIELD(hash, type, field) \
+    do { \
+        uint64_t values[2] = {offsetof(type, field), sizeof(((type *)0)->field)}; \
+        const unsigned char *bytes = (const unsigned char *)values; \
+        for (size_t i = 0; i < sizeof(values); ++i) \
+            hash = (hash ^ bytes[i]) * 0x100000001b3ULL; \
+    } while (0)
+
+//Empreinte du format de TransferState, champs des Receiver, Sender et ReorderBuffer
+//inclus : deux processus dont les empreintes diffèrent ne peuvent pas échanger leurs
+//transferts octet par octet.
+uint64_t transfer_state_layout()
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    LAYOUT_FIELD(hash, struct TransferState, opcode);
+    LAYOUT_FIELD(hash, struct TransferState, filename);
+    LAYOUT_FIELD(hash, struct TransferState, client_addr);
+    LAYOUT_FIELD(hash, struct TransferState, data_socket);
+    LAYOUT_FIELD(hash, struct TransferState, window_size);
+    LAYOUT_FIELD(hash, struct TransferState, offset);
+    LAYOUT_FIELD(hash, struct TransferState, file_opened);
+    LAYOUT_FIELD(hash, struct TransferState, local_size);
+    LAYOUT_FIELD(hash, struct TransferState, zero_blocks);
+    LAYOUT_FIELD(hash, struct TransferState, receiver);
+    LAYOUT_FIELD(hash, struct TransferState, has_reorder);
+    LAYOUT_FIELD(hash, struct TransferState, reorder);
+    LAYOUT_FIELD(hash, struct TransferState, last_packet);
+    LAYOUT_FIELD(hash, struct TransferState, last_packet_size);
+    LAYOUT_FIELD(hash, struct TransferState, sender);
+    LAYOUT_FIELD(hash, struct TransferState, read_offset);
+    LAYOUT_FIELD(hash, struct TransferState, windows);
+    LAYOUT_FIELD(hash, struct TransferState, dedup);
+
+    LAYOUT_FIELD(hash, struct Receiver, rollover);
+    LAYOUT_FIELD(hash, struct Receiver, delta);
+    LAYOUT_FIELD(hash, struct Receiver, expected);
+    LAYOUT_FIELD(hash, struct Receiver, acked);
+    LAYOUT_FIELD(hash, struct Receiver, window_size);
+    LAYOUT_FIELD(hash, struct Receiver, window_received);
+    LAYOUT_FIELD(hash, struct Receiver, write_offset);
+    LAYOUT_FIELD(hash, struct Receiver, match_offset);
+    LAYOUT_FIELD(hash, struct Receiver, complete);
+    LAYOUT_FIELD(hash, struct Receiver, too_big);
+    LAYOUT_FIELD(hash, struct Receiver, matched_blocks);
+    LAYOUT_FIELD(hash, struct Receiver, reorder);
+
+    LAYOUT_FIELD(hash, struct Sender, rollover);
+    LAYOUT_FIELD(hash, struct Sender, wrapped);
+    LAYOUT_FIELD(hash, struct Sender, delta);
+    LAYOUT_FIELD(hash, struct Sender, block_number);
+    LAYOUT_FIELD(hash, struct Sender, window_sent);
+    LAYOUT_FIELD(hash, struct Sender, acked_blocks);
+    LAYOUT_FIELD(hash, struct Sender, retransmitted);
+    LAYOUT_FIELD(hash, struct Sender, fast_retransmitted);
+    LAYOUT_FIELD(hash, struct Sender, too_big);
+    LAYOUT_FIELD(hash, struct Sender, stats);
+    LAYOUT_FIELD(hash, struct Sender, next_signature);
+    LAYOUT_FIELD(hash, struct Sender, matched_blocks);
+
+    LAYOUT_FIELD(hash, struct RetransmitStats, fast);
+    LAYOUT_FIELD(hash, struct RetransmitStats, timeout);
+    LAYOUT_FIELD(hash, struct RetransmitStats, previous_retransmitted);
+    LAYOUT_FIELD(hash, struct BlockSignature, present);
+    LAYOUT_FIELD(hash, struct BlockSignature, hash);
+    LAYOUT_FIELD(hash, struct ReorderBuffer, blocks);
+    LAYOUT_FIELD(hash, struct PendingBlock, used);
+    LAYOUT_FIELD(hash, struct PendingBlock, block_number);
+    LAYOUT_FIELD(hash, struct PendingBlock, size);
+    LAYOUT_FIELD(hash, struct PendingBlock, data);
+    return hash;
+}
+
+void init_handoff_hello(struct HandoffHello *hello)
+{
+    memset(hello, 0, sizeof(*hello));
+    memcpy(hello->magic, HANDOFF_MAGIC, sizeof(hello->magic));
+    hello->version = HANDOFF_VERSION;
+    hello->state_size = sizeof(struct TransferState);
+    hello->layout = transfer_state_layout();
+}
+
+bool handoff_hello_matches(const struct HandoffHello *hello)
+{
+    struct HandoffHello expected;
+    init_handoff_hello(&expected);
+    return memcmp(hello->magic, expected.magic, sizeof(expected.magic)) == 0
+        && hello->version == expected.version
+        && hello->state_size == expected.state_size
+        && hello->layout == expected.layout;
+}
+
+//Se présente au serveur qui tourne déjà dans ce répertoire, s'il y en a un, et reçoit
+//son socket d'écoute. Renvoie le socket UNIX sur lequel arriveront ses transferts, -1
+//s'il n'y a pas de serveur en cours, -2 s'il a refusé de céder sa place.
+int connect_previous_server(int *server_socket)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, HANDOFF_SOCKET);
+
+    int previous_server = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (previous_server < 0)
+        return -1;
+    if (connect(previous_server, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(previous_server);
+        return -1;
+    }
+
+    struct HandoffHello hello;
+    init_handoff_hello(&hello);
+    struct HandoffHello answer;
+    if (send(previous_server, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)
+        || receive_with_descriptor(previous_server, &answer, sizeof(answer), server_socket) != sizeof(answer)
+        || *server_socket < 0 || !handoff_hello_matches(&answer)) {
+        if (*server_socket >= 0)
+            close(*server_socket);
+        close(previous_server);
+        return -2;
+    }
+    return previous_server;
+}
+
+//Un nouveau processus demande la place de celui-ci : s'il utilise le même format
+//d'état, on lui envoie le socket d'écoute et on cesse de lire les requêtes. Les
+//transferts en cours lui sont ensuite transmis par export_transfer. Renvoie true si
+//la place a été cédée.
+bool hand_off(int handoff_listener, int server_socket)
+{
+    int next_server = accept4(handoff_listener, NULL, NULL, SOCK_CLOEXEC);
+    if (next_server < 0)
+        return false;
+
+    struct HandoffHello hello;
+    if (recv(next_server, &hello, sizeof(hello), 0) != sizeof(hello) || !handoff_hello_matches(&hello)) {
+        fprintf(stderr, "Redémarrage à chaud refusé : format d'état incompatible\n");
+        close(next_server);
+        return false;
+    }
+
+    if (send_with_descriptor(next_server, &hello, sizeof(hello), server_socket) < 0) {
+        perror("Erreur lors de la transmission du socket d'écoute");
+        close(next_server);
+        return false;
+    }
+
+    pthread_mutex_lock(&handoff_mutex);
+    handoff_socket = next_server;
+    pthread_mutex_unlock(&handoff_mutex);
+    printf("Redémarrage à chaud : socket d'écoute transmis au nouveau processus\n");
+    return true;
+}
+
+//Les threads des requêtes (et des transferts repris) sont comptés : après avoir cédé sa
+//place, l'ancien processus attend la fin de ceux qui n'ont pas pu être transmis.
+bool start_request_thread(void *(*routine)(void *), void *arg)
+{
+    pthread_mutex_lock(&sessions_mutex);
+    request_threads++;
+    pthread_mutex_unlock(&sessions_mutex);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, routine, arg) != 0) {
+        perror("Erreur lors de la création du thread");
+        end_request_thread();
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+void end_request_thread()
+{
+    pthread_mutex_lock(&sessions_mutex);
+    request_threads--;
+    pthread_cond_broadcast(&sessions_cond);
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+void wait_request_threads()
+{
+    pthread_mutex_lock(&sessions_mutex);
+    while (request_threads > 0)
+        pthread_cond_wait(&sessions_cond, &sessions_mutex);
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+int main(int argc, char *argv[])
+{
+    //Sans argument, le serveur sert son répertoire. Avec l'adresse et le port d'un
+    //serveur amont, il sert de relais et garde en cache les fichiers rapatriés ; un
+    //troisième argument change le port d'écoute, pour placer le relais à côté de l'amont.
+    //-B choisit l'envoi des fenêtres : gso, sendmmsg ou sendto (voir io_backend).
+    int server_port = SERVER_PORT;
+    const char *program = argv[0];
+    bool usage_error = false;
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-d") == 0) {
+            dedup_enabled = true;
+        } else if (strcmp(argv[1], "-B") == 0 && argc > 2 && parse_backend(argv[2]) >= 0) {
+            io_backend = parse_backend(argv[2]);
+            argv++;
+            argc--;
+        } else {
+            usage_error = true;
+            break;
+        }
+        argv++;
+        argc--;
+    }
+    if (usage_error || (argc != 1 && argc != 3 && argc != 4)) {
+        fprintf(stderr, "Utilisation: %s [-d] [-B gso|sendmmsg|sendto] [<ip_amont> <port_amont> [port_local]]\n", program);
+        exit(EXIT_FAILURE);
+    }
+    if (argc >= 3) {
+        relay_enabled = true;
+        memset(&upstream_addr, 0, sizeof(upstream_addr));
+        upstream_addr.sin_family = AF_INET;
+        upstream_addr.sin_addr.s_addr = inet_addr(argv[1]);
+        upstream_addr.sin_port = htons(atoi(argv[2]));
+        if (argc == 4)
+            server_port = atoi(argv[3]);
+        printf("Mode relais : serveur amont %s:%s\n", argv[1], argv[2]);
+    }
+    //Option -d : les fichiers écrits sont rangés dans le stockage dédupliqué.
+    if (dedup_enabled) {
+        if (mkdir(CHUNK_DIR, 0755) < 0 && errno != EEXIST) {
+            perror("Impossible de créer le répertoire des morceaux");
+            exit(EXIT_FAILURE);
+        }
+        //Les manifestes sont marqués par un attribut étendu : sans lui, ils seraient
+        //servis tels quels.
+        char probe_path[] = CHUNK_DIR "/xattr.XXXXXX";
+        int probe_fd = mkstemp(probe_path);
+        if (probe_fd < 0 || mark_manifest(probe_fd) < 0) {
+            perror("Attributs étendus indisponibles pour le stockage dédupliqué");
+            if (probe_fd >= 0) {
+                close(probe_fd);
+                unlink(probe_path);
             }
+            exit(EXIT_FAILURE);
         }
+        close(probe_fd);
+        unlink(probe_path);
+        printf("Stockage dédupliqué dans %s (morceaux de %d octets)\n", CHUNK_DIR, CHUNK_SIZE);
     }
 
-    closedir(dir);
+    printf("Envoi des fenêtres : %s\n", backend_name(io_backend));
+    if (load_catalog_snapshot(&catalog) == 0) {
+        printf("Catalogue chargé depuis %s : %u fichiers, %u répertoires\n", CATALOG_FILE, catalog.header->file_count, catalog.header->dir_count);
+    } else if (build_catalog(&catalog) == 0) {
+        catalog_built_at = time(NULL);
+        printf("Catalogue construit : %u fichiers, %u répertoires\n", catalog.header->file_count, catalog.header->dir_count);
+    } else {
+        fprintf(stderr, "Impossible de construire le catalogue des fichiers\n");
+        exit(EXIT_FAILURE);
+    }
 
-    init_file_mutexes();
+    for (int i = 0; i < DATA_SOCKET_POOL_MIN; ++i) {
+        int data_socket = create_data_socket(inet_addr(IP), TIMEOUT_SECONDS);
+        if (data_socket < 0)
+            break;
+        data_socket_pool[data_socket_pool_count++] = data_socket;
+    }
 
-    int server_socket;
+    //Redémarrage à chaud : si un serveur tourne déjà dans ce répertoire, ce processus
+    //prend sa place sans interrompre les transferts. Il reçoit son socket d'écoute, puis
+    //chacun de ses transferts en cours, qu'il poursuit là où l'ancien s'est arrêté.
+    int server_socket = -1;
     struct sockaddr_in server_addr, client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
 
-    server_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (server_socket < 0)
-    {
-        perror("Erreur lors de la création du socket serveur");
+    int previous_server = connect_previous_server(&server_socket);
+    if (previous_server == -2) {
+        fprintf(stderr, "Le serveur en cours a refusé de céder sa place\n");
         exit(EXIT_FAILURE);
     }
+    if (previous_server >= 0) {
+        printf("Redémarrage à chaud : socket d'écoute repris du serveur précédent\n");
+        if (!start_request_thread(receive_handoff, (void *)(intptr_t)previous_server))
+            exit(EXIT_FAILURE);
+    } else {
+        server_socket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (server_socket < 0)
+        {
+            perror("Erreur lors de la création du socket serveur");
+            exit(EXIT_FAILURE);
+        }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr(IP);
-    server_addr.sin_port = htons(SERVER_PORT);
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = inet_addr(IP);
+        server_addr.sin_port = htons(server_port);
 
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-    {
-        perror("Erreur de liaison du socket du serveur");
-        exit(EXIT_FAILURE);
+        if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        {
+            perror("Erreur de liaison du socket du serveur");
+            exit(EXIT_FAILURE);
+        }
+        printf("Serveur en écoute sur le port %d...\n", server_port);
     }
 
-    printf("Serveur en écoute sur le port %d...\n", SERVER_PORT);
-    char request_packet[MAX_PACKET_SIZE];
+    int handoff_listener = listen_handoff();
+    if (handoff_listener < 0)
+        perror("Redémarrage à chaud indisponible");
+
+    struct ClientRequest *request = NULL;
+    struct pollfd fds[2];
+    fds[0].fd = server_socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = handoff_listener;
+    fds[1].events = POLLIN;
 
     while (1)
     {
-        memset(request_packet, 0, MAX_PACKET_SIZE);
-        ssize_t bytes_received = recvfrom(server_socket, request_packet, MAX_PACKET_SIZE, 0, (struct sockaddr *)&client_addr, &client_addr_len);
+        if (request == NULL) {
+            request = malloc(sizeof(struct ClientRequest));
+            if (request == NULL) {
+                perror("Erreur d'allocation de mémoire pour la requête client");
+                sleep(1);
+                continue;
+            }
+        }
+
+        if (poll(fds, handoff_listener >= 0 ? 2 : 1, -1) < 0)
+            continue;
+        if ((fds[1].revents & POLLIN) && hand_off(handoff_listener, server_socket))
+            break;
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        ssize_t bytes_received = recvfrom(server_socket, request->packet, MAX_PACKET_SIZE, MSG_DONTWAIT, (struct sockaddr *)&client_addr, &client_addr_len);
         if (bytes_received < 0)
         {
-            perror("Erreur de réception du paquet de requête");
+            if (errno != EAGAIN)
+                perror("Erreur de réception du paquet de requête");
             continue;
         }
-        unsigned short opcode;
-        memcpy(&opcode, request_packet, sizeof(opcode));
-        opcode = ntohs(opcode);
 
-        struct ClientRequest *request = malloc(sizeof(struct ClientRequest));
-        if (request == NULL) {
-            perror("Erreur d'allocation de mémoire pour la requête client");
+        if (parse_request(request->packet, bytes_received, &request->parsed) < 0) {
+            fprintf(stderr, "Requête mal formée reçue. Envoi d'un paquet d'erreur au client\n");
+            send_error_packet(server_socket, client_addr, 4, "Requête mal formée");
             continue;
         }
-        request->bigfile = false;
 
         request->server_socket = server_socket;
         request->client_addr = client_addr;
-        strcpy(request->filename, request_packet + 2);
-        request->opcode = opcode;
 
-        char *option= request_packet + strlen(request->filename) + 9;
-
-        while (*option != '\0') {
-            if (strcmp(option, "bigfile") == 0) {
-                request->bigfile = true;
-                break;
-            }
-            option += strlen(option) + 1;
+        //Une requête en trop est refusée ici, sans thread ni recherche dans le catalogue ;
+        //seule celle qui peut encore attendre une place part dans son thread sans en avoir.
+        request->session = admit_session(client_addr.sin_addr, request->parsed.filename, false);
+        //Une requête qui n'atteint pas son thread a ses sondes ici, dans le fil d'écoute.
+        if (request->session == -1) {
+            fprintf(stderr, "Requête refusée pour %s : trop de sessions en cours\n", inet_ntoa(client_addr.sin_addr));
+            send_error_packet(server_socket, client_addr, 0, "Serveur surchargé, réessayez plus tard");
+            TRACE_PROBE(request, ntohs(client_addr.sin_port), request->parsed.opcode, request->parsed.filename);
+            TRACE_PROBE(close, ntohs(client_addr.sin_port), 0, TRACE_CLOSE_REFUSED);
+            continue;
         }
 
-        pthread_t thread;
-        if (pthread_create(&thread, NULL, handle_request, (void *)request) != 0) {
-            perror("Erreur lors de la création du thread");
-            free(request);
+        if (!start_request_thread(handle_request, (void *)request)) {
+            if (request->session >= 0)
+                release_session(request->session);
+            TRACE_PROBE(request, ntohs(client_addr.sin_port), request->parsed.opcode, request->parsed.filename);
+            TRACE_PROBE(close, ntohs(client_addr.sin_port), 0, TRACE_CLOSE_FAILED);
+            continue;
         }
+        request = NULL;
     }
 
-    close(server_socket);
+    //La place est cédée : les transferts qui n'ont pas pu être transmis (rapatriements,
+    //attente du dernier ACK) se terminent ici, puis le nouveau processus est prévenu de
+    //la fin par la fermeture du socket.
+    free(request);
+    close(handoff_listener);
+    wait_request_threads();
+    pthread_mutex_lock(&handoff_mutex);
+    close(handoff_socket);
+    handoff_socket = -1;
+    pthread_mutex_unlock(&handoff_mutex);
+    printf("Redémarrage à chaud : tous les transferts sont transmis ou terminés, sortie\n");
 
-    for (int i = 0; i < file_count; i++) {
-        free(file_names[i]);
-    }
+    close(server_socket);
 
-    destroy_file_mutexes();
+    free_catalog(&catalog);
     return 0;
 }
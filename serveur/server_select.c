@@ -1,297 +1,764 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sched.h>
+
+#include "../transfer.h"
+#include "../protocol.h"
+#include "../admission.h"
+#include "../timers.h"
+#include "../manifest.h"
 
 #define SERVER_PORT 69
 #define IP "127.0.0.1"
-#define MAX_PACKET_SIZE 516
 #define TIMEOUT_SECONDS 5
+#define LINGER_SECONDS 15
+#define MAX_EVENTS 256
+#define BUSY_POLL_USECS 50
+#define LATENCY_BUCKETS 24
+
+//Coroutines sans pile : une session est une fonction qui reprend, à chaque paquet reçu
+//ou délai d'attente, à la ligne où elle s'était arrêtée (resume_line). Ses variables
+//locales ne survivent pas à CO_YIELD : tout ce qui doit durer vit dans struct Session.
+#define CO_BEGIN(session) switch ((session)->resume_line) { case 0:
+#define CO_YIELD(session) do { (session)->resume_line = __LINE__; return false; case __LINE__:; } while (0)
+#define CO_END(session) } return true
+
+//Un transfert en cours, qui attend un paquet sur data_socket ou son échéance (timer).
+//sender sert aux lectures (RRQ), receiver aux écritures (WRQ). last_packet est le
+//dernier paquet envoyé, renvoyé tel quel après un délai d'attente. fd est le fichier lu
+//ou écrit (par pread et pwrite, à des positions sur 64 bits) ; un fichier lu qui est un
+//manifeste du stockage dédupliqué est lu morceau par morceau dans manifest. slot est sa place dans
+//l'admission (admission.c), rendue dès la fin du transfert ; lingering indique qu'une
+//écriture terminée attend encore, au cas où son dernier ACK serait perdu. responses,
+//response_us et max_response_us résument ses temps de réponse.
+struct Session {
+    int resume_line;
+    unsigned short opcode;
+    bool delta;
+    bool lingering;
+    int slot;
+    int data_socket;
+    struct sockaddr_in client_addr;
+    char *filename;
+    int fd;
+    struct Manifest manifest;
+    off_t offset;
+    off_t local_size;
+    size_t data_size;
+    int attempts;
+    unsigned long zero_blocks;
+    unsigned long long hole_bytes;
+    union {
+        struct Sender sender;
+        struct Receiver receiver;
+    };
+    unsigned long responses;
+    double response_us;
+    double max_response_us;
+    struct Timer timer;
+    struct Session *previous;
+    struct Session *next;
+    size_t last_packet_size;
+    unsigned char last_packet[MAX_PACKET_SIZE];
+};
+
+//Histogramme des temps de réponse : le compartiment i compte les réponses envoyées moins
+//de 2^(i+1) microsecondes après l'arrivée (horodatée par le noyau) du paquet qui les a
+//provoquées, et au moins 2^i pour i > 0. Le dernier compartiment reçoit aussi tout le reste.
+struct LatencyHistogram {
+    unsigned long counts[LATENCY_BUCKETS];
+    unsigned long total;
+};
+
+long long monotonic_ms();
+int open_data_socket();
+bool file_in_use(const char *filename, unsigned short opcode);
+void session_link(struct Session *session);
+void session_unlink(struct Session *session);
+void session_arm(struct Session *session);
+bool session_send(struct Session *session);
+void start_session(int server_socket, struct sockaddr_in client_addr, const struct TftpRequest *request);
+bool resume_rrq(struct Session *session, unsigned char *packet, size_t size);
+bool resume_wrq(struct Session *session, unsigned char *packet, size_t size);
+void run_session(struct Session *session, unsigned char *packet, size_t size);
+void receive_session_packet(struct Session *session);
+void expire_sessions();
+void finish_received_file(struct Session *session);
+void end_session(struct Session *session);
+void record_response(struct Session *session);
+double latency_percentile(const struct LatencyHistogram *histogram, double fraction);
+void print_latency_histogram();
+bool set_busy_poll(int socket_fd);
+bool start_busy_poll(int cpu, bool fifo);
+ssize_t receive_request(int server_socket, char *packet, struct sockaddr_in *client_addr, double *queued_seconds);
+
+//Toutes les sessions tournent dans la boucle de main, sur un seul thread, et sont
+//chaînées dans sessions_head. Leurs échéances sont rangées dans la roue timers, qui
+//donne aussi le délai d'epoll_wait.
+struct Session *sessions_head = NULL;
+struct TimerWheel timers;
+unsigned long session_count = 0;
+int epoll_fd = -1;
+
+//Mode d'attente active (option -b) : la boucle, fixée sur un cœur, interroge epoll sans
+//jamais dormir, et chaque socket demande au noyau d'attendre activement ses paquets
+//(SO_BUSY_POLL). packet_arrival est l'heure d'arrivée du paquet que traite la session
+//en cours (tv_sec nul hors d'un tel traitement) ; latencies cumule les temps de réponse
+//de toutes les sessions, affichés chaque fois que le serveur redevient inactif.
+bool busy_poll = false;
+struct timespec packet_arrival;
+struct LatencyHistogram latencies;
+
+//Socket de données d'une session, sans délai d'attente : c'est epoll qui attend.
+int open_data_socket()
+{
+    int data_socket = create_data_socket(inet_addr(IP), 0);
+    if (data_socket < 0)
+        return -1;
+
+    //L'heure d'arrivée de chaque paquet sert à mesurer le temps de réponse.
+    int timestamps = 1;
+    setsockopt(data_socket, SOL_SOCKET, SO_TIMESTAMPNS, &timestamps, sizeof(timestamps));
+    if (busy_poll)
+        set_busy_poll(data_socket);
+    return data_socket;
+}
 
-#define RRQ_OPCODE 1
-#define WRQ_OPCODE 2
-#define DATA_OPCODE 3
-#define ACK_OPCODE 4
-#define ERROR_OPCODE 5
-#define OACK_OPCODE 6
+long long monotonic_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-void send_error_packet(int server_socket, struct sockaddr_in client_addr, int error_code, const char *error_message);
-void handle_wrq(int server_socket, struct sockaddr_in client_addr, char *filename, bool bigfile);
-void handle_rrq(int server_socket, struct sockaddr_in client_addr, char *filename, bool bigfile);
+//Un fichier en cours d'écriture n'est ni lu ni réécrit par une autre session ; plusieurs
+//lectures d'un même fichier peuvent en revanche se dérouler ensemble.
+bool file_in_use(const char *filename, unsigned short opcode)
+{
+    for (struct Session *session = sessions_head; session != NULL; session = session->next) {
+        if (session->lingering)
+            continue;
+        if ((opcode == WRQ_OPCODE || session->opcode == WRQ_OPCODE) && strcmp(session->filename, filename) == 0)
+            return true;
+    }
+    return false;
+}
+
+void session_link(struct Session *session)
+{
+    session->previous = NULL;
+    session->next = sessions_head;
+    if (sessions_head != NULL)
+        sessions_head->previous = session;
+    sessions_head = session;
+}
 
+void session_unlink(struct Session *session)
+{
+    if (session->previous != NULL)
+        session->previous->next = session->next;
+    else
+        sessions_head = session->next;
+    if (session->next != NULL)
+        session->next->previous = session->previous;
+    session->previous = NULL;
+    session->next = NULL;
+    timer_cancel(&timers, &session->timer);
+}
 
-void send_error_packet(int server_socket, struct sockaddr_in client_addr, int error_code, const char *error_message){
-    char error_packet[MAX_PACKET_SIZE];
-    memset(error_packet, 0, MAX_PACKET_SIZE);
-    error_packet[0] = 0;
-    error_packet[1] = ERROR_OPCODE;
-    error_packet[2] = 0;
-    error_packet[3] = error_code;
-    strcpy(error_packet + 4, error_message);
+//Repousse l'échéance de la session à TIMEOUT_SECONDS, ou à LINGER_SECONDS pour une
+//écriture terminée qui attend encore.
+void session_arm(struct Session *session)
+{
+    timer_arm(&timers, &session->timer, monotonic_ms() + (session->lingering ? LINGER_SECONDS : TIMEOUT_SECONDS) * 1000);
+}
 
-    sendto(server_socket, error_packet, strlen(error_message) + 5, 0, (struct sockaddr *)&client_addr, sizeof(client_addr));
+bool session_send(struct Session *session)
+{
+    if (sendto(session->data_socket, session->last_packet, session->last_packet_size, 0, (struct sockaddr *)&session->client_addr, sizeof(session->client_addr)) < 0) {
+        perror("Erreur lors de l'envoi du paquet");
+        return false;
+    }
+    record_response(session);
+    return true;
 }
 
-void handle_wrq(int server_socket, struct sockaddr_in client_addr, char *filename, bool bigfile) {
-    printf("Traitement de la demande d'écriture (WRQ) du client\n");
+//Compte le temps écoulé entre l'arrivée du paquet en cours de traitement et la réponse
+//qui vient d'être envoyée. Seule la première réponse à un paquet est comptée ; un envoi
+//sur délai d'attente n'en est pas une.
+void record_response(struct Session *session)
+{
+    if (packet_arrival.tv_sec == 0)
+        return;
 
-    int data_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (data_socket < 0) {
-        perror("Erreur lors de la création du socket de données");
-        send_error_packet(server_socket, client_addr, 1, "Erreur interne du serveur");
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    double elapsed_us = (now.tv_sec - packet_arrival.tv_sec) * 1e6 + (now.tv_nsec - packet_arrival.tv_nsec) / 1e3;
+    packet_arrival.tv_sec = 0;
+    if (elapsed_us < 0)
+        elapsed_us = 0;
+
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && elapsed_us >= (double)(2UL << bucket))
+        bucket++;
+    latencies.counts[bucket]++;
+    latencies.total++;
+
+    session->responses++;
+    session->response_us += elapsed_us;
+    if (elapsed_us > session->max_response_us)
+        session->max_response_us = elapsed_us;
+}
+
+//Borne supérieure (en microsecondes) du compartiment où tombe la fraction demandée des
+//réponses : une estimation par excès du centile, à un facteur 2 près.
+double latency_percentile(const struct LatencyHistogram *histogram, double fraction)
+{
+    unsigned long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        seen += histogram->counts[i];
+        if (seen > 0 && seen >= fraction * histogram->total)
+            return (double)(2UL << i);
+    }
+    return 0;
+}
+
+void print_latency_histogram()
+{
+    if (latencies.total == 0)
         return;
+
+    printf("Temps de réponse (%s) sur %lu réponses : médiane < %.0f µs, 99e centile < %.0f µs\n",
+           busy_poll ? "attente active" : "attente passive", latencies.total,
+           latency_percentile(&latencies, 0.5), latency_percentile(&latencies, 0.99));
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        if (latencies.counts[i] > 0)
+            printf("  < %8lu µs : %lu\n", 2UL << i, latencies.counts[i]);
     }
+}
 
-    struct sockaddr_in data_server_addr;
-    memset(&data_server_addr, 0, sizeof(data_server_addr));
-    data_server_addr.sin_family = AF_INET;
-    data_server_addr.sin_addr.s_addr = inet_addr(IP);
-    data_server_addr.sin_port = htons(0);
-    if (bind(data_socket, (struct sockaddr *)&data_server_addr, sizeof(data_server_addr)) < 0) {
-        perror("Erreur lors de la liaison du socket de données");
-        send_error_packet(server_socket, client_addr, 1, "Erreur interne du serveur");
-        close(data_socket);
+//Crée la session d'un RRQ ou d'un WRQ, avec son propre socket de données, et prépare
+//son OACK. La suite du transfert se déroule dans resume_rrq ou resume_wrq, au fil des
+//paquets reçus par la boucle de main.
+void start_session(int server_socket, struct sockaddr_in client_addr, const struct TftpRequest *request)
+{
+    if (request->opcode == RRQ_OPCODE)
+        printf("Traitement de la demande de lecture (RRQ) du client\n");
+    else
+        printf("Traitement de la demande d'écriture (WRQ) du client\n");
+
+    if (file_in_use(request->filename, request->opcode)) {
+        send_error_packet(server_socket, client_addr, 0, "Fichier en cours de transfert, réessayez plus tard");
         return;
     }
 
-    struct timeval timeout;
-    timeout.tv_sec = TIMEOUT_SECONDS;
-    timeout.tv_usec = 0;
-    if (setsockopt(data_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) < 0){
-        perror("Erreur lors du réglage de l'option de délai d'attente");
-        close(data_socket);
+    //Mêmes limites que le serveur à threads ; la boucle ne pouvant pas attendre qu'une
+    //place se libère, une requête en trop est refusée tout de suite.
+    char *filename = strdup(request->filename);
+    int slot = filename != NULL ? admit_session(client_addr.sin_addr, filename, false) : -1;
+    if (filename != NULL && slot < 0) {
+        fprintf(stderr, "Requête refusée pour %s : trop de sessions en cours\n", inet_ntoa(client_addr.sin_addr));
+        send_error_packet(server_socket, client_addr, 0, "Serveur surchargé, réessayez plus tard");
+        free(filename);
         return;
     }
 
+    struct TftpOption accepted_options[MAX_OPTIONS];
+    int accepted_count = 0;
+    char offset_text[32];
+    //Une écriture ne reprend que l'écriture interrompue de ce client sur ce fichier.
+    off_t file_size = stored_file_size(request->filename, NULL);
+    if (request->opcode == WRQ_OPCODE) {
+        off_t resumable = take_interrupted_upload(request->filename, client_addr.sin_addr.s_addr);
+        file_size = resumable < file_size ? resumable : file_size;
+    }
+    off_t offset = negotiate_resume_offset(request, file_size, accepted_options, &accepted_count, offset_text, sizeof(offset_text));
+    if (offset < 0) {
+        send_error_packet(server_socket, client_addr, 8, "Option resume invalide");
+        if (slot >= 0)
+            release_session(slot);
+        free(filename);
+        return;
+    }
 
-    unsigned char oack_packet[4];
-    oack_packet[0] = 0;
-    oack_packet[1] = OACK_OPCODE;
-    oack_packet[2] = 0;
-    oack_packet[3] = 0;
+    bool delta = find_option(request, "delta") != NULL;
+    if (delta) {
+        accepted_options[accepted_count].name = "delta";
+        accepted_options[accepted_count].value = "1";
+        accepted_count++;
+    }
 
-    if (sendto(data_socket, oack_packet, sizeof(oack_packet), 0, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0) {
-        perror("Erreur lors de l'envoi de l'OACK");
-        close(data_socket);
+    int rollover = negotiate_rollover(request, accepted_options, &accepted_count);
+    if (rollover < ROLLOVER_NONE) {
+        send_error_packet(server_socket, client_addr, 8, "Option rollover invalide");
+        if (slot >= 0)
+            release_session(slot);
+        free(filename);
         return;
     }
 
-    FILE *file = fopen(filename, "wb");
-    if (file == NULL) {
-        send_error_packet(data_socket, client_addr, 1, "Impossible de créer le fichier");
-        perror("Erreur lors de l'ouverture du fichier en écriture");
-        close(data_socket);
+    struct Session *session = calloc(1, sizeof(*session));
+    int data_socket = open_data_socket();
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = session;
+    if (session == NULL || filename == NULL || data_socket < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data_socket, &event) < 0) {
+        send_error_packet(server_socket, client_addr, 1, "Erreur interne du serveur");
+        if (data_socket >= 0)
+            close(data_socket);
+        if (slot >= 0)
+            release_session(slot);
+        free(filename);
+        free(session);
         return;
     }
 
-    unsigned short block_number = 1;
-    unsigned char ack_packet[4];
-    ack_packet[0] = 0;
-    ack_packet[1] = ACK_OPCODE;
+    session->opcode = request->opcode;
+    session->delta = delta;
+    session->data_socket = data_socket;
+    session->client_addr = client_addr;
+    session->filename = filename;
+    session->slot = slot;
+    session->fd = -1;
+    session->offset = offset;
+    if (request->opcode == RRQ_OPCODE)
+        sender_init(&session->sender, rollover, delta, 0);
+    else
+        receiver_init(&session->receiver, rollover, delta, offset);
+    session->last_packet_size = build_oack(session->last_packet, accepted_options, accepted_count);
+    timer_init(&session->timer, session);
+    session_link(session);
+    session_count++;
+
+    run_session(session, NULL, 0);
+}
+
+//Lecture : envoie l'OACK, puis chaque bloc après l'ACK du précédent. packet vaut NULL
+//quand la session reprend sur un délai d'attente. Renvoie vrai quand le transfert est fini.
+bool resume_rrq(struct Session *session, unsigned char *packet, size_t size)
+{
+    struct Sender *sender = &session->sender;
+
+    CO_BEGIN(session);
+    if (!session_send(session))
+        return true;
+
     while (1) {
-        unsigned char data_packet[MAX_PACKET_SIZE];
-        ssize_t bytes_received = recvfrom(data_socket, data_packet, MAX_PACKET_SIZE, 0, NULL, NULL);
-        if (bytes_received < 0) {
-            perror("Erreur lors de la réception du paquet de données");
-            break;
-        } else if (bytes_received == 0) {
-            fprintf(stderr, "Connexion fermée par le client.\n");
-            break;
+        session->attempts = 0;
+        while (1) {
+            CO_YIELD(session);
+            if (packet == NULL) {
+                if (session->attempts >= MAX_RETRIES) {
+                    fprintf(stderr, "Nombre maximal de tentatives atteint. Sortie...\n");
+                    return true;
+                }
+                session->attempts++;
+                sender_timeout(sender);
+                fprintf(stderr, "Un délai d'attente s'est produit, nouvelle tentative...\n");
+                if (!session_send(session))
+                    return true;
+                continue;
+            }
+
+            int action = sender_ack(sender, packet, size);
+            if (action == ACK_DONE)
+                break;
+            if (action == ACK_ERROR || action == ACK_INVALID) {
+                fprintf(stderr, "Paquet ACK invalide reçu. Sortie...\n");
+                return true;
+            }
+            if (action == ACK_RESEND && !session_send(session))
+                return true;
         }
 
-        if (data_packet[1] != DATA_OPCODE) {
-            fprintf(stderr, "Paquet reçu n'est pas un paquet de données. Sortie...\n");
-            break;
+        //L'OACK est acquitté par l'ACK 0 ; les données commencent au bloc 1.
+        if (sender->block_number == 0 && !sender->wrapped) {
+            session->fd = open(session->filename, O_RDONLY);
+            if (session->fd < 0) {
+                send_error_packet(session->data_socket, session->client_addr, 1, "Fichier introuvable");
+                perror("Erreur lors de l'ouverture du fichier en lecture");
+                return true;
+            }
+            if (manifest_open(&session->manifest, session->fd) < 0) {
+                send_error_packet(session->data_socket, session->client_addr, 0, "Erreur de lecture du fichier");
+                fprintf(stderr, "Manifeste illisible : %s\n", session->filename);
+                return true;
+            }
+            posix_fadvise(session->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            sender->block_number = 1;
+        } else {
+            printf("Sent data block %d (%zu bytes) to client on port %d\n", sender->block_number, session->data_size, ntohs(session->client_addr.sin_port));
+            if (!sender_next(sender, session->data_size))
+                break;
         }
 
-        unsigned short received_block_number = (data_packet[2] << 8) | data_packet[3];
-        if (received_block_number != block_number) {
-            fprintf(stderr, "Numéro de bloc invalide. Sortie...\n");
-            break;
+        //En mode delta, un bloc identique à celui du client est remplacé par un MATCH.
+        ssize_t bytes_read = session->manifest.chunks != NULL
+                                 ? manifest_read(&session->manifest, session->last_packet + 4, 512, session->offset)
+                                 : read_sparse(session->fd, session->last_packet + 4, 512, session->offset, &session->hole_bytes);
+        if (bytes_read < 0) {
+            send_error_packet(session->data_socket, session->client_addr, 0, "Erreur de lecture du fichier");
+            perror("Erreur lors de la lecture du fichier");
+            return true;
         }
+        session->offset += bytes_read;
+        session->data_size = bytes_read;
+        session->last_packet_size = sender_packet(sender, session->last_packet, bytes_read);
+        if (!session_send(session))
+            return true;
+    }
 
-        size_t data_size = bytes_received - 4;
-        fwrite(data_packet + 4, 1, data_size, file);
+    if (sender->too_big) {
+        send_error_packet(session->data_socket, session->client_addr, 3, "Fichier trop volumineux");
+        fprintf(stderr, "Fichier trop volumineux. Sortie...\n");
+    }
+    CO_END(session);
+}
 
-        ack_packet[2] = block_number >> 8;
-        ack_packet[3] = block_number & 0xFF;
-        if (sendto(data_socket, ack_packet, sizeof(ack_packet), 0, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0) {
-            perror("Erreur lors de l'envoi de l'ACK");
-            break;
-        }
+//Ecriture : envoie l'OACK, puis écrit chaque bloc reçu et l'acquitte. Le fichier n'est
+//ouvert (et tronqué) qu'à l'arrivée du premier bloc : une requête en double, dont la
+//session ne reçoit jamais de données, ne l'écrase pas.
+bool resume_wrq(struct Session *session, unsigned char *packet, size_t size)
+{
+    struct Receiver *receiver = &session->receiver;
 
-        if (data_size < 512)
-            break;
+    CO_BEGIN(session);
+    if (!session_send(session))
+        return true;
 
-        if (block_number == 65535 && !bigfile) {
-            fprintf(stderr, "Fichier trop volumineux. Sortie...\n");
-            break;
+    while (1) {
+        CO_YIELD(session);
+        if (packet == NULL) {
+            if (session->attempts >= MAX_RETRIES) {
+                fprintf(stderr, "Nombre maximal de tentatives atteint. Sortie...\n");
+                return true;
+            }
+            session->attempts++;
+            fprintf(stderr, "Un délai d'attente s'est produit, renvoi du dernier paquet...\n");
+            if (!session_send(session))
+                return true;
+            continue;
         }
+        session->attempts = 0;
 
-        block_number++;
-        
-        if (block_number == 0) {
-            block_number = 1;
+        int action = receiver_accept(receiver, packet, size);
+        if (action == RECEIVE_INVALID) {
+            fprintf(stderr, "Paquet reçu n'est pas un paquet de données. Sortie...\n");
+            return true;
         }
-    }
 
-    fclose(file);
-    close(data_socket);
-}
+        //Un doublon du dernier bloc reçu signifie que notre ACK s'est perdu : on le renvoie.
+        if (action == RECEIVE_REPEAT_ACK && !session_send(session))
+            return true;
 
+        //Un MATCH annonce un bloc identique à celui de notre copie : on le relit sur place.
+        if (action == RECEIVE_MATCH) {
+            ssize_t local_bytes = session->fd >= 0 ? pread(session->fd, packet + 4, 512, receiver->match_offset) : -1;
+            if (local_bytes >= 0) {
+                size = 4 + local_bytes;
+                action = receiver_accept_match(receiver, packet, local_bytes);
+            }
+        }
+        if (action != RECEIVE_DELIVER)
+            continue;
 
-void handle_rrq(int server_socket, struct sockaddr_in client_addr, char *filename, bool bigfile)
-{
-    printf("Traitement de la demande de lecture (RRQ) du client\n");
+        //En reprise, on conserve les offset premiers octets déjà reçus et on écrit à la suite ;
+        //l'écriture est inscrite dans la table des reprises (track_upload).
+        //En mode delta, l'ancienne copie est gardée entière : elle est réécrite sur place
+        //et tronquée à la fin du transfert.
+        if (session->fd < 0) {
+            off_t offset = session->offset;
+            int fd = open(session->filename, offset > 0 || session->delta ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0 && session->delta && offset == 0)
+                fd = open(session->filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+            //Un manifeste réécrit sur place devient un fichier ordinaire.
+            if (fd >= 0 && unmark_manifest(fd) < 0) {
+                close(fd);
+                fd = -1;
+            }
+            if (fd >= 0 && offset > 0 && !session->delta && ftruncate(fd, offset) < 0) {
+                close(fd);
+                fd = -1;
+            }
+            struct stat stat_buf;
+            if (fd >= 0 && fstat(fd, &stat_buf) == 0)
+                session->local_size = stat_buf.st_size;
+            if (fd < 0) {
+                send_error_packet(session->data_socket, session->client_addr, 1, "Impossible de créer le fichier");
+                perror("Erreur lors de l'ouverture du fichier en écriture");
+                return true;
+            }
+            session->fd = fd;
+            if (!session->delta)
+                track_upload(session->filename, session->client_addr, offset);
+        }
 
-    int data_socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (data_socket < 0){
-        perror("Erreur lors de la création du socket de données");
-        send_error_packet(server_socket, client_addr, 1, "Erreur interne du serveur");
-        return;
-    }
+        //Les blocs nuls ne sont pas écrits : le fichier reçu reste creux.
+        size_t data_size = size - 4;
+        int written;
+        do {
+            written = write_sparse(session->fd, NULL, packet + 4, data_size, receiver->write_offset, session->local_size);
+            if (written > 0)
+                session->zero_blocks++;
+        } while (written >= 0 && receiver_next(receiver, packet + 4, &data_size));
+        if (written < 0) {
+            send_error_packet(session->data_socket, session->client_addr, 3, "Erreur d'écriture du fichier");
+            perror("Erreur lors de l'écriture du fichier");
+            return true;
+        }
 
-    struct sockaddr_in data_server_addr;
-    memset(&data_server_addr, 0, sizeof(data_server_addr));
-    data_server_addr.sin_family = AF_INET;
-    data_server_addr.sin_addr.s_addr = inet_addr(IP);
-    data_server_addr.sin_port = htons(0);
-    if (bind(data_socket, (struct sockaddr *)&data_server_addr, sizeof(data_server_addr)) < 0)
-    {
-        perror("Erreur lors de la liaison du socket de données");
-        send_error_packet(server_socket, client_addr, 1, "Erreur interne du serveur");
-        close(data_socket);
-        return;
+        session->last_packet_size = build_ack(session->last_packet, receiver->acked, session->delta ? session->fd : -1, receiver->write_offset, session->local_size);
+        if (!session_send(session))
+            return true;
+        if (!session->delta)
+            update_upload(session->filename, session->client_addr, receiver->complete ? -1 : receiver->write_offset);
+
+        if (receiver->complete)
+            break;
+
+        if (receiver->too_big) {
+            fprintf(stderr, "Fichier trop volumineux. Sortie...\n");
+            return true;
+        }
     }
 
-    struct timeval timeout;
-    timeout.tv_sec = TIMEOUT_SECONDS;
-    timeout.tv_usec = 0;
-    if (setsockopt(data_socket, SOL_SOCKET, SO_RCVTIMEO, (const char *)&timeout, sizeof(timeout)) < 0){
-        perror("Erreur lors du réglage de l'option de délai d'attente");
-        close(data_socket);
-        return;
+    //Après le dernier ACK, le fichier est fermé et la place d'admission rendue, mais la
+    //session reste à l'écoute pendant LINGER_SECONDS : si cet ACK est perdu, le client
+    //renvoie son dernier bloc et on lui répond au lieu de le laisser échouer.
+    finish_received_file(session);
+    release_session(session->slot);
+    session->slot = -1;
+    session->lingering = true;
+    while (1) {
+        CO_YIELD(session);
+        if (packet == NULL)
+            return true;
+        if (size >= 4 && packet[1] == DATA_OPCODE && packet[2] == session->last_packet[2] && packet[3] == session->last_packet[3] && !session_send(session))
+            return true;
     }
+    CO_END(session);
+}
 
-    unsigned char oack_packet[4];
-    oack_packet[0] = 0;
-    oack_packet[1] = OACK_OPCODE;
-    oack_packet[2] = 0;
-    oack_packet[3] = 0;
+//Fait reprendre la session sur un paquet (ou sur son échéance si packet est NULL), puis
+//la termine ou la remet en attente.
+void run_session(struct Session *session, unsigned char *packet, size_t size)
+{
+    bool done = session->opcode == RRQ_OPCODE ? resume_rrq(session, packet, size) : resume_wrq(session, packet, size);
+    if (done)
+        end_session(session);
+    else
+        session_arm(session);
+}
 
-    if (sendto(data_socket, oack_packet, sizeof(oack_packet), 0, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0) {
-        perror("Erreur lors de l'envoi de l'OACK");
-        close(data_socket);
+//Un paquet venu d'un autre port que celui du client est refusé sans réveiller la session.
+void receive_session_packet(struct Session *session)
+{
+    unsigned char packet[MAX_PACKET_SIZE];
+    struct sockaddr_in sender_addr;
+    struct iovec iov = { packet, MAX_PACKET_SIZE };
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = &sender_addr;
+    message.msg_namelen = sizeof(sender_addr);
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t bytes_received = recvmsg(session->data_socket, &message, MSG_DONTWAIT);
+    if (bytes_received < 0)
         return;
-    }
-
-    unsigned char ack_packet[4];
-    ssize_t ack_recieved = recvfrom(data_socket, ack_packet, 4, 0, NULL, NULL);
-    if(ack_recieved <= 0){
-        perror("Erreur de réception du paquet ACK");
-        close(data_socket);
+    if (sender_addr.sin_addr.s_addr != session->client_addr.sin_addr.s_addr || sender_addr.sin_port != session->client_addr.sin_port) {
+        send_error_packet(session->data_socket, sender_addr, 5, "Identifiant de transfert inconnu");
         return;
     }
-    if(ack_packet[1] != ACK_OPCODE){
-        fprintf(stderr, "Paquet ACK invalide reçu. Sortie...\n");
-        close(data_socket);
-        return;
+
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_TIMESTAMPNS)
+            memcpy(&packet_arrival, CMSG_DATA(header), sizeof(packet_arrival));
     }
+    run_session(session, packet, bytes_received);
+    packet_arrival.tv_sec = 0;
+}
 
+//Fait reprendre sur un délai d'attente chaque session dont l'échéance est passée.
+void expire_sessions()
+{
+    long long now = monotonic_ms();
+    struct Timer *timer;
+    while ((timer = timer_expire(&timers, now)) != NULL)
+        run_session(timer->data, NULL, 0);
+}
 
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL)
-    {
-        send_error_packet(server_socket, client_addr, 1, "Fichier introuvable");
-        perror("Erreur lors de l'ouverture du fichier en lecture");
-        close(data_socket);
+//Ferme le fichier d'une écriture. Terminée, sa taille finale est fixée par troncature :
+//elle l'allonge si les derniers blocs étaient nuls et coupe la fin d'une ancienne copie
+//plus longue (mode delta).
+void finish_received_file(struct Session *session)
+{
+    if (session->fd < 0)
         return;
+    if (session->receiver.complete) {
+        if (ftruncate(session->fd, session->receiver.write_offset) < 0)
+            perror("Erreur lors de la troncature du fichier");
+        if (session->delta)
+            printf("Delta : %lu blocs repris de la copie locale\n", session->receiver.matched_blocks);
+        if (session->zero_blocks > 0)
+            printf("Ecriture creuse : %lu blocs nuls non écrits\n", session->zero_blocks);
     }
+    close(session->fd);
+    session->fd = -1;
+}
 
-    unsigned short block_number = 1;
-    int attempts = 1;
-
-    while (1)
-    {
-        unsigned char data_packet[MAX_PACKET_SIZE];
-        ssize_t bytes_read = fread(data_packet + 4, 1, 512, file);
-
-        data_packet[1] = DATA_OPCODE;
-        data_packet[2] = block_number >> 8;
-        data_packet[3] = block_number & 0xFF;
-
-        if (sendto(data_socket, data_packet, 4 + bytes_read, 0, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0)
-        {
-            perror("Erreur lors de l'envoi du paquet de données");
-            break;
+//Affiche le bilan du transfert et libère la session.
+void end_session(struct Session *session)
+{
+    unsigned short port = ntohs(session->client_addr.sin_port);
+    if (session->opcode == RRQ_OPCODE) {
+        printf("Retransmissions pour le client sur le port %d : %lu rapides, %lu après délai d'attente\n",
+               port, session->sender.stats.fast, session->sender.stats.timeout);
+        if (session->delta)
+            printf("Delta : %lu blocs remplacés par un MATCH\n", session->sender.matched_blocks);
+        if (session->fd >= 0) {
+            printf("Lecture pour le client sur le port %d : %llu octets de trous\n", port, session->hole_bytes);
+            close(session->fd);
         }
-        printf("Sent data block %d (%ld bytes) to client on port %d\n", block_number, bytes_read, ntohs(client_addr.sin_port));
+        if (session->manifest.chunks != NULL)
+            printf("Fichier dédupliqué pour le client sur le port %d : %lu morceaux lus dont %lu depuis le cache\n",
+                   port, session->manifest.chunk_reads, session->manifest.cache_hits);
+        manifest_close(&session->manifest);
+    } else {
+        finish_received_file(session);
+        receiver_close(&session->receiver);
+    }
+    if (session->slot >= 0)
+        release_session(session->slot);
+
+    if (session->responses > 0)
+        printf("Temps de réponse pour le client sur le port %d : %lu réponses, moyenne %.1f µs, max %.1f µs\n",
+               port, session->responses, session->response_us / session->responses, session->max_response_us);
+
+    session_unlink(session);
+    close(session->data_socket);
+    free(session->filename);
+    free(session);
+    session_count--;
+    if (session_count == 0)
+        print_latency_histogram();
+}
 
-        ssize_t bytes_received = recvfrom(data_socket, ack_packet, 4, 0, NULL, NULL);
-        if (bytes_received < 0)
-        {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-            {
-                if (attempts >= 2)
-                {
-                    fprintf(stderr, "Nombre maximal de tentatives atteint. Sortie...\n");
-                    break;
-                }
-                attempts++;
-                fprintf(stderr, "Un délai d'attente s'est produit, nouvelle tentative...\n");
-                continue;
-            }
-            else
-            {
-                perror("Erreur de réception du paquet ACK");
-                break;
-            }
-        }
-        else if (bytes_received == 0)
-        {
-            fprintf(stderr, "Connexion fermée par le client.\n");
-            break;
-        }
+//Demande au noyau d'attendre activement, pendant BUSY_POLL_USECS, les paquets de ce
+//socket plutôt que de laisser dormir la boucle jusqu'à l'interruption de la carte réseau.
+bool set_busy_poll(int socket_fd)
+{
+    int usecs = BUSY_POLL_USECS;
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0)
+        return false;
+#ifdef SO_PREFER_BUSY_POLL
+    int prefer = 1;
+    setsockopt(socket_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#endif
+    return true;
+}
 
-        if (ack_packet[1] != ACK_OPCODE || (ack_packet[2] != (block_number >> 8)) || (ack_packet[3] != (block_number & 0xFF)))
-        {
-            fprintf(stderr, "Paquet ACK invalide reçu. Sortie...\n");
-            break;
-        }
+//Fixe la boucle sur le cœur cpu et, si fifo, la fait passer en temps réel (SCHED_FIFO) :
+//sur un cœur qui lui est réservé, elle n'est alors jamais interrompue par d'autres tâches.
+bool start_busy_poll(int cpu, bool fifo)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+        perror("Impossible de fixer le serveur sur le cœur demandé");
+        return false;
+    }
 
-        if (block_number == 65535 && !bigfile) {
-            send_error_packet(server_socket, client_addr, 3, "Fichier trop volumineux");
-            fprintf(stderr, "Fichier trop volumineux. Sortie...\n");
-            break;
+    if (fifo) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = 1;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+            perror("Impossible de passer en ordonnancement SCHED_FIFO");
+            return false;
         }
+    }
 
-        block_number++;
+    busy_poll = true;
+    printf("Attente active sur le cœur %d%s\n", cpu, fifo ? " en SCHED_FIFO" : "");
+    return true;
+}
 
-        if (block_number == 0) {
-            block_number = 1;
+//Reçoit une requête et calcule depuis combien de temps elle attend dans la file du
+//socket, grâce à l'horodatage noyau SO_TIMESTAMP (0 s'il est absent).
+ssize_t receive_request(int server_socket, char *packet, struct sockaddr_in *client_addr, double *queued_seconds)
+{
+    struct iovec iov = { packet, MAX_PACKET_SIZE };
+    char control[CMSG_SPACE(sizeof(struct timeval))];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = client_addr;
+    message.msg_namelen = sizeof(*client_addr);
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t bytes_received = recvmsg(server_socket, &message, 0);
+    if (bytes_received < 0)
+        return -1;
+
+    *queued_seconds = 0;
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_TIMESTAMP) {
+            struct timeval arrival, now;
+            memcpy(&arrival, CMSG_DATA(header), sizeof(arrival));
+            gettimeofday(&now, NULL);
+            *queued_seconds = (now.tv_sec - arrival.tv_sec) + (now.tv_usec - arrival.tv_usec) / 1e6;
         }
-
-        if (bytes_read < 512)
-            break;
     }
-
-    fclose(file);
-    close(data_socket);
+    return bytes_received;
 }
 
-
-int main(){
+int main(int argc, char *argv[]){
     int server_socket;
     struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+
+    //Option -b <cœur> : attente active, pour les serveurs dédiés qui échangent du temps
+    //processeur contre un temps de réponse plus court ; -f ajoute SCHED_FIFO.
+    int busy_poll_cpu = -1;
+    bool fifo = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            busy_poll_cpu = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0)
+            fifo = true;
+        else
+            busy_poll_cpu = -2;
+    }
+    if (busy_poll_cpu < -1 || (fifo && busy_poll_cpu < 0)) {
+        fprintf(stderr, "Utilisation: %s [-b <cœur> [-f]]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (busy_poll_cpu >= 0 && !start_busy_poll(busy_poll_cpu, fifo))
+        exit(EXIT_FAILURE);
 
     server_socket = socket(AF_INET, SOCK_DGRAM, 0);
     if (server_socket < 0)
@@ -311,64 +778,99 @@ int main(){
         exit(EXIT_FAILURE);
     }
 
-    printf("Serveur en écoute sur le port %d...\n", SERVER_PORT);
+    int timestamps = 1;
+    if (setsockopt(server_socket, SOL_SOCKET, SO_TIMESTAMP, &timestamps, sizeof(timestamps)) < 0)
+        perror("Erreur lors de l'activation de SO_TIMESTAMP");
+    if (busy_poll && !set_busy_poll(server_socket))
+        perror("Erreur lors de l'activation de SO_BUSY_POLL");
+
+    timer_wheel_init(&timers, monotonic_ms());
+    epoll_fd = epoll_create1(0);
+    struct epoll_event server_event;
+    server_event.events = EPOLLIN;
+    server_event.data.ptr = NULL;
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &server_event) < 0)
+    {
+        perror("Erreur lors de la création de la file epoll");
+        exit(EXIT_FAILURE);
+    }
 
-    fd_set read_fds;
-    int max_fd = server_socket + 1;
+    printf("Serveur en écoute sur le port %d (%zu octets par session)...\n", SERVER_PORT, sizeof(struct Session));
 
+    //Boucle d'événements : une requête crée une session, un paquet de données la fait
+    //reprendre, et les sessions dont l'échéance est passée reprennent sur un délai d'attente.
+    struct epoll_event events[MAX_EVENTS];
     char request_packet[MAX_PACKET_SIZE];
     while (1)
     {
-        FD_ZERO(&read_fds);
-        FD_SET(server_socket, &read_fds);
+        //En attente active, epoll est interrogé sans jamais attendre.
+        int wait_ms = -1;
+        if (busy_poll) {
+            wait_ms = 0;
+        } else if (timer_next_expiry(&timers) >= 0) {
+            long long remaining = timer_next_expiry(&timers) - monotonic_ms();
+            wait_ms = remaining > 0 ? (int)remaining : 0;
+        }
 
-        int activity = select(max_fd, &read_fds, NULL, NULL, NULL);
-        if (activity < 0)
+        int event_count = epoll_wait(epoll_fd, events, MAX_EVENTS, wait_ms);
+        if (event_count < 0)
         {
-            perror("Erreur dans select");
+            if (errno != EINTR)
+                perror("Erreur dans epoll_wait");
             continue;
         }
 
-        if (FD_ISSET(server_socket, &read_fds))
+        for (int i = 0; i < event_count; ++i)
         {
-            memset(request_packet, 0, MAX_PACKET_SIZE);
-            ssize_t bytes_received = recvfrom(server_socket, request_packet, MAX_PACKET_SIZE, 0, (struct sockaddr *)&client_addr, &client_addr_len);
+            if (events[i].data.ptr != NULL) {
+                receive_session_packet(events[i].data.ptr);
+                continue;
+            }
+
+            double queued_seconds;
+            ssize_t bytes_received = receive_request(server_socket, request_packet, &client_addr, &queued_seconds);
             if (bytes_received < 0)
             {
                 perror("Erreur de réception du paquet de requête");
                 continue;
             }
-            unsigned short opcode;
-            memcpy(&opcode, request_packet, sizeof(opcode));
-            opcode = ntohs(opcode);
-
-            char filename[MAX_PACKET_SIZE];
-            strcpy(filename, request_packet + 2);
-
-            bool bigfile = false;
-            char *option = request_packet + strlen(filename) + 9;
-            while (*option != '\0') {
-                if (strcmp(option, "bigfile") == 0) {
-                    bigfile = true;
-                    break;
-                }
-                option += strlen(option) + 1;
+
+            //Une requête ne reste dans la file que si la boucle est saturée : restée trop
+            //longtemps, elle est refusée pour que son client réessaie plus tard, au lieu
+            //d'être servie alors qu'il a peut-être déjà abandonné.
+            if (queued_seconds > ADMISSION_WAIT_SECONDS) {
+                fprintf(stderr, "Requête de %s en attente depuis %.1f s, refusée\n", inet_ntoa(client_addr.sin_addr), queued_seconds);
+                send_error_packet(server_socket, client_addr, 0, "Serveur surchargé, réessayez plus tard");
+                continue;
+            }
+
+            struct TftpRequest request;
+            if (parse_request(request_packet, bytes_received, &request) < 0)
+            {
+                fprintf(stderr, "Requête mal formée reçue. Envoi d'un paquet d'erreur au client\n");
+                send_error_packet(server_socket, client_addr, 4, "Requête mal formée");
+                continue;
             }
 
-            switch (opcode)
+            if (!is_safe_path(request.filename)) {
+                send_error_packet(server_socket, client_addr, 2, "Accès refusé");
+                continue;
+            }
+
+            switch (request.opcode)
             {
             case RRQ_OPCODE:
-                handle_rrq(server_socket, client_addr, filename, bigfile);
-                break;
             case WRQ_OPCODE:
-                handle_wrq(server_socket, client_addr, filename, bigfile);
+                start_session(server_socket, client_addr, &request);
                 break;
             default:
-                printf("Opcode %d non supporté. Envoi d'un paquet d'erreur au client\n", opcode);
+                printf("Opcode %d non supporté. Envoi d'un paquet d'erreur au client\n", request.opcode);
                 send_error_packet(server_socket, client_addr, 1, "Opération non supportée");
                 break;
             }
         }
+
+        expire_sessions();
     }
 
     close(server_socket);
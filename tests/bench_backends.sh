@@ -0,0 +1,60 @@
+#!/bin/sh
+# Comparaison des moteurs de transfert (make bench-backends) : serveur à threads avec
+# chacun des modes d'envoi de BACKENDS (-B gso, sendmmsg, sendto, le client dans le même
+# mode), puis, si sendto en fait partie, serveur epoll (fenêtre d'un bloc, sans mode
+# d'envoi). Pour chacun, un get et un put de SIZE_MB Mio avec windowsize=WINDOW sur la
+# boucle locale ; on relève la durée et le débit affichés par le client, et le nombre
+# moyen de paquets par réception du côté qui reçoit (UDP_GRO). make bench-offload ne
+# compare que gso et sendmmsg, avec la plus grande fenêtre. Le serveur écoute sur le
+# port 69.
+BUILD=${BUILD:-build}
+BUILD=$(cd "$BUILD" && pwd)
+SIZE_MB=${SIZE_MB:-64}
+WINDOW=${WINDOW:-16}
+BACKENDS=${BACKENDS:-gso sendmmsg sendto}
+
+run() {
+    server=$1
+    backend=$2
+    dir=$(mktemp -d)
+    mkdir "$dir/srv" "$dir/cli"
+    head -c $((SIZE_MB * 1048576)) /dev/urandom > "$dir/srv/get.bin"
+    head -c $((SIZE_MB * 1048576)) /dev/urandom > "$dir/cli/put.bin"
+    touch "$dir/srv/put.bin"
+    # Journal du serveur ligne par ligne, pour y lire les réceptions d'un put terminé.
+    if [ "$server" = server ]; then
+        (cd "$dir/srv" && exec stdbuf -oL "$BUILD/server" -B "$backend" > "$dir/server.log" 2>&1) &
+    else
+        (cd "$dir/srv" && exec stdbuf -oL "$BUILD/server_select" > "$dir/server.log" 2>&1) &
+    fi
+    pid=$!
+    sleep 0.5
+    for operation in get put; do
+        output=$(cd "$dir/cli" && "$BUILD/client" $operation $operation.bin 127.0.0.1 69 bigfile windowsize=$WINDOW backend=$backend 2>/dev/null)
+        result=$(echo "$output" | sed -n 's/^Transfert terminé en \([0-9.]*\) s : [0-9]* octets, \([0-9.]*\) Kio\/s$/\1 \2/p')
+        # Le client reçoit les DATA d'un get, le serveur celles d'un put.
+        sleep 0.1
+        if [ $operation = get ]; then
+            bursts=$(echo "$output" | sed -n 's/^Réception groupée : \([0-9]*\) paquets en \([0-9]*\) réceptions$/\1 \2/p')
+        else
+            bursts=$(sed -n 's/^Réception groupée pour le client sur le port [0-9]* : \([0-9]*\) paquets en \([0-9]*\) réceptions$/\1 \2/p' "$dir/server.log" | tail -n 1)
+        fi
+        if [ -n "$result" ] && cmp -s "$dir/srv/$operation.bin" "$dir/cli/$operation.bin"; then
+            set -- $result ${bursts:-0 0}
+            awk -v s="$server" -v b="$backend" -v o=$operation -v t="$1" -v r="$2" -v p="$3" -v n="$4" \
+                'BEGIN { printf "%-14s %-9s %-4s %8s s %10.1f Mio/s %6.1f paquets/réception\n", s, b, o, t, r / 1024, (n > 0 ? p / n : 1) }'
+        else
+            printf "%-14s %-9s %-4s   échec\n" "$server" "$backend" $operation
+        fi
+    done
+    kill $pid
+    wait $pid 2>/dev/null
+    rm -rf "$dir"
+}
+
+for backend in $BACKENDS; do
+    run server $backend
+done
+case " $BACKENDS " in
+    *" sendto "*) run server_select sendto ;;
+esac
@@ -0,0 +1,60 @@
+//Mesure de parse_request (make bench-parse) : temps moyen par requête, pour une requête
+//sans option, une requête avec les options habituelles et une requête refusée (trop
+//d'options).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "../protocol.h"
+
+size_t build_request(char *packet, const char *const *fields)
+{
+    packet[0] = 0;
+    packet[1] = 1;
+    size_t length = 2;
+    for (int i = 0; fields[i] != NULL; ++i) {
+        size_t field_size = strlen(fields[i]) + 1;
+        memcpy(packet + length, fields[i], field_size);
+        length += field_size;
+    }
+    return length;
+}
+
+double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 10000000;
+    static const char *const requests[][24] = {
+        {"f.bin", "octet", NULL},
+        {"images/disk.img", "octet", "bigfile", "rollover", "0", "windowsize", "16", "resume", "1048576", "delta", "1", NULL},
+        {"f.bin", "octet", "a", "1", "b", "1", "c", "1", "d", "1", "e", "1", "f", "1", "g", "1", "h", "1", "i", "1", NULL},
+    };
+    static const char *const names[] = {"sans option", "5 options", "9 options (refusée)"};
+
+    for (size_t r = 0; r < sizeof(requests) / sizeof(requests[0]); ++r) {
+        char packet[516];
+        size_t length = build_request(packet, requests[r]);
+        struct TftpRequest request;
+        long accepted = 0;
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long i = 0; i < iterations; ++i) {
+            //Empêche le compilateur de sortir l'analyse de la boucle.
+            __asm__ volatile("" : : "r"(packet) : "memory");
+            accepted += parse_request(packet, length, &request) == 0;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        printf("parse_request %-20s %4zu octets : %6.1f ns/requête (%ld acceptées)\n",
+               names[r], length, elapsed_ns(&start, &end) / iterations, accepted);
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+//Temps d'établissement des transferts sous une rafale de requêtes (make bench-setup) :
+//count RRQ partent en même temps, chacun de son propre socket et d'une adresse
+//127.0.0.x différente (pour ne pas buter sur la limite de sessions par client), sur les
+//fichiers setup_<i % FILE_COUNT>.bin. On mesure le délai jusqu'à la première réponse du
+//serveur (OACK), qui comprend l'admission, l'ouverture du fichier et l'obtention du
+//socket de données ; chaque transfert est ensuite abandonné par une erreur.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../transfer.h"
+
+#define FILE_COUNT 32
+#define MAX_BURST 1024
+#define WAIT_MS 5000
+
+double now_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4) {
+        fprintf(stderr, "Utilisation: %s <ip> <port> <rafale>\n", argv[0]);
+        return 1;
+    }
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+    server_addr.sin_port = htons(atoi(argv[2]));
+    int count = atoi(argv[3]);
+    if (count < 1 || count > MAX_BURST)
+        count = 1;
+
+    static struct pollfd fds[MAX_BURST];
+    static double sent_us[MAX_BURST];
+    static double latencies[MAX_BURST];
+    static bool answered[MAX_BURST];
+    for (int i = 0; i < count; ++i) {
+        fds[i].fd = socket(AF_INET, SOCK_DGRAM, 0);
+        fds[i].events = POLLIN;
+        struct sockaddr_in local_addr;
+        memset(&local_addr, 0, sizeof(local_addr));
+        local_addr.sin_family = AF_INET;
+        local_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 2 + i % 250);
+        if (fds[i].fd < 0 || bind(fds[i].fd, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0) {
+            perror("Erreur lors de la création des sockets");
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        char request[64];
+        request[0] = 0;
+        request[1] = RRQ_OPCODE;
+        int length = 2 + sprintf(request + 2, "setup_%d.bin", i % FILE_COUNT) + 1;
+        memcpy(request + length, "octet", sizeof("octet"));
+        length += sizeof("octet");
+        sent_us[i] = now_us();
+        sendto(fds[i].fd, request, length, 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
+    }
+
+    int pending = count;
+    int errors = 0;
+    double deadline = now_us() + WAIT_MS * 1000.0;
+    while (pending > 0 && now_us() < deadline) {
+        if (poll(fds, count, WAIT_MS) <= 0)
+            break;
+        for (int i = 0; i < count; ++i) {
+            if (answered[i] || !(fds[i].revents & POLLIN))
+                continue;
+            unsigned char packet[MAX_PACKET_SIZE];
+            struct sockaddr_in data_addr;
+            socklen_t addr_len = sizeof(data_addr);
+            ssize_t size = recvfrom(fds[i].fd, packet, sizeof(packet), 0, (struct sockaddr *)&data_addr, &addr_len);
+            if (size < 4)
+                continue;
+            latencies[count - pending] = now_us() - sent_us[i];
+            answered[i] = true;
+            pending--;
+            if (packet[1] == ERROR_OPCODE) {
+                errors++;
+                continue;
+            }
+            unsigned char error_packet[MAX_PACKET_SIZE];
+            size_t error_size = build_error_packet(error_packet, 0, "Fin de la mesure");
+            sendto(fds[i].fd, error_packet, error_size, 0, (struct sockaddr *)&data_addr, sizeof(data_addr));
+        }
+    }
+
+    int measured = count - pending;
+    qsort(latencies, measured, sizeof(latencies[0]), compare_doubles);
+    double total = 0;
+    for (int i = 0; i < measured; ++i)
+        total += latencies[i];
+    if (measured > 0)
+        printf("rafale %4d : %4d réponses (%d erreurs, %d sans réponse), moyenne %8.0f us, médiane %8.0f us, p99 %8.0f us, max %8.0f us\n",
+               count, measured, errors, pending, total / measured, latencies[measured / 2],
+               latencies[(int)(measured * 0.99)], latencies[measured - 1]);
+    else
+        printf("rafale %4d : aucune réponse\n", count);
+
+    for (int i = 0; i < count; ++i)
+        close(fds[i].fd);
+    return pending > 0;
+}
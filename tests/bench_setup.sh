@@ -0,0 +1,23 @@
+#!/bin/sh
+# Temps d'établissement sous rafale pour chaque serveur (make bench-setup). Chaque serveur
+# est lancé dans un répertoire temporaire garni des fichiers demandés par bench_setup.
+# Le serveur écoute sur le port 69 : il faut pouvoir s'y lier.
+BUILD=${BUILD:-build}
+BUILD=$(cd "$BUILD" && pwd)
+for server in server server_select; do
+    dir=$(mktemp -d)
+    for i in $(seq 0 31); do
+        head -c 65536 /dev/zero > "$dir/setup_$i.bin"
+    done
+    (cd "$dir" && exec "$BUILD/$server" > "$dir/server.log" 2>&1) &
+    pid=$!
+    sleep 0.5
+    echo "== $server"
+    for burst in 1 8 32 64; do
+        "$BUILD/bench_setup" 127.0.0.1 69 $burst
+        sleep 0.2
+    done
+    kill $pid
+    wait $pid 2>/dev/null
+    rm -rf "$dir"
+done
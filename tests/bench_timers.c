@@ -0,0 +1,209 @@
+//Mesure de la roue de temporisation (make bench-timers) contre un tas binaire, sur la
+//charge du serveur epoll : n sessions dont chacune a une échéance, réarmée à chaque
+//paquet reçu avec un délai variable (renvoi adaptatif, délai d'attente, attente du
+//dernier ACK), et traitée puis réarmée quand elle expire. Le temps est simulé, un tic
+//(1 ms) par pas. Les deux structures reçoivent la même suite d'opérations : elles
+//doivent déclencher les mêmes échéances, chacune exactement à son tic.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "../timers.h"
+
+#define STEPS 20000
+
+//Tas binaire de référence : chaque échéance connaît sa position dans le tas, ce qui
+//permet de la réarmer ou de l'annuler en O(log n).
+struct HeapTimer {
+    long long expires;
+    long index;
+};
+
+struct Heap {
+    struct HeapTimer **items;
+    long length;
+};
+
+void heap_swap(struct Heap *heap, long a, long b)
+{
+    struct HeapTimer *item = heap->items[a];
+    heap->items[a] = heap->items[b];
+    heap->items[b] = item;
+    heap->items[a]->index = a;
+    heap->items[b]->index = b;
+}
+
+void heap_sift(struct Heap *heap, long index)
+{
+    while (index > 0 && heap->items[(index - 1) / 2]->expires > heap->items[index]->expires) {
+        heap_swap(heap, index, (index - 1) / 2);
+        index = (index - 1) / 2;
+    }
+    while (1) {
+        long smallest = index;
+        long left = 2 * index + 1;
+        if (left < heap->length && heap->items[left]->expires < heap->items[smallest]->expires)
+            smallest = left;
+        if (left + 1 < heap->length && heap->items[left + 1]->expires < heap->items[smallest]->expires)
+            smallest = left + 1;
+        if (smallest == index)
+            return;
+        heap_swap(heap, index, smallest);
+        index = smallest;
+    }
+}
+
+void heap_arm(struct Heap *heap, struct HeapTimer *timer, long long expires)
+{
+    timer->expires = expires;
+    if (timer->index < 0) {
+        timer->index = heap->length;
+        heap->items[heap->length++] = timer;
+    }
+    heap_sift(heap, timer->index);
+}
+
+struct HeapTimer *heap_expire(struct Heap *heap, long long now)
+{
+    if (heap->length == 0 || heap->items[0]->expires > now)
+        return NULL;
+    struct HeapTimer *timer = heap->items[0];
+    heap_swap(heap, 0, --heap->length);
+    if (heap->length > 0)
+        heap_sift(heap, 0);
+    timer->index = -1;
+    return timer;
+}
+
+unsigned long long next_random(unsigned long long *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+//Délai d'une échéance : surtout des renvois adaptatifs (de 20 ms à 2 s), parfois le
+//délai d'attente de 5 s ou l'attente de 15 s du dernier ACK. Il ne dépend que de la
+//session et du tic (mélange splitmix64), pas de l'ordre dans lequel chaque structure
+//rend les échéances d'un même tic.
+long long next_delay(long session, long long now)
+{
+    unsigned long long value = (unsigned long long)session * 0x9e3779b97f4a7c15ULL + (unsigned long long)now;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    value ^= value >> 31;
+    if (value % 16 == 0)
+        return 15000;
+    if (value % 16 == 1)
+        return 5000;
+    return 20 + (value >> 8) % 1980;
+}
+
+double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+//Renvoie le nombre d'échéances déclenchées ; *wrong compte celles qui ne l'ont pas été
+//à leur tic, *operations les armements.
+unsigned long run_wheel(long sessions, long packets_per_step, unsigned long *wrong, unsigned long *operations, double *ns)
+{
+    struct TimerWheel *wheel = malloc(sizeof(*wheel));
+    struct Timer *timers = malloc(sessions * sizeof(*timers));
+    unsigned long long state = 88172645463325252ULL;
+    unsigned long fired = 0;
+    *wrong = 0;
+    *operations = 0;
+
+    timer_wheel_init(wheel, 0);
+    for (long i = 0; i < sessions; ++i) {
+        timer_init(&timers[i], &timers[i]);
+        timer_arm(wheel, &timers[i], next_delay(i, 0));
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long long now = 1; now <= STEPS; ++now) {
+        for (long p = 0; p < packets_per_step; ++p) {
+            long session = next_random(&state) % sessions;
+            timer_arm(wheel, &timers[session], now + next_delay(session, now));
+            (*operations)++;
+        }
+        struct Timer *timer;
+        while ((timer = timer_expire(wheel, now)) != NULL) {
+            *wrong += timer->expires != now;
+            fired++;
+            timer_arm(wheel, timer, now + next_delay(timer - timers, now));
+            (*operations)++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *ns = elapsed_ns(&start, &end);
+    free(timers);
+    free(wheel);
+    return fired;
+}
+
+unsigned long run_heap(long sessions, long packets_per_step, unsigned long *wrong, unsigned long *operations, double *ns)
+{
+    struct Heap heap;
+    heap.items = malloc(sessions * sizeof(*heap.items));
+    heap.length = 0;
+    struct HeapTimer *timers = malloc(sessions * sizeof(*timers));
+    unsigned long long state = 88172645463325252ULL;
+    unsigned long fired = 0;
+    *wrong = 0;
+    *operations = 0;
+
+    for (long i = 0; i < sessions; ++i) {
+        timers[i].index = -1;
+        heap_arm(&heap, &timers[i], next_delay(i, 0));
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long long now = 1; now <= STEPS; ++now) {
+        for (long p = 0; p < packets_per_step; ++p) {
+            long session = next_random(&state) % sessions;
+            heap_arm(&heap, &timers[session], now + next_delay(session, now));
+            (*operations)++;
+        }
+        struct HeapTimer *timer;
+        while ((timer = heap_expire(&heap, now)) != NULL) {
+            *wrong += timer->expires != now;
+            fired++;
+            heap_arm(&heap, timer, now + next_delay(timer - timers, now));
+            (*operations)++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *ns = elapsed_ns(&start, &end);
+    free(timers);
+    free(heap.items);
+    return fired;
+}
+
+int main()
+{
+    static const long sessions[] = {1000, 10000, 100000};
+    int status = 0;
+    for (size_t i = 0; i < sizeof(sessions) / sizeof(sessions[0]); ++i) {
+        //Une session sur cinquante reçoit un paquet à chaque milliseconde.
+        long packets_per_step = sessions[i] / 50;
+        unsigned long wheel_wrong, heap_wrong, wheel_operations, heap_operations;
+        double wheel_ns, heap_ns;
+        unsigned long wheel_fired = run_wheel(sessions[i], packets_per_step, &wheel_wrong, &wheel_operations, &wheel_ns);
+        unsigned long heap_fired = run_heap(sessions[i], packets_per_step, &heap_wrong, &heap_operations, &heap_ns);
+
+        printf("%6ld sessions : roue %6.1f ns/armement, tas %6.1f ns/armement (%lu échéances déclenchées)\n",
+               sessions[i], wheel_ns / wheel_operations, heap_ns / heap_operations, wheel_fired);
+        if (wheel_fired != heap_fired || wheel_wrong != 0 || heap_wrong != 0) {
+            printf("  écart : roue %lu échéances (%lu hors de leur tic), tas %lu (%lu hors de leur tic)\n",
+                   wheel_fired, wheel_wrong, heap_fired, heap_wrong);
+            status = 1;
+        }
+    }
+    return status;
+}
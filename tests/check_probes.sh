@@ -0,0 +1,19 @@
+#!/bin/sh
+# Sondes USDT (make check-probes) : le serveur, compilé avec le remplaçant de <sys/sdt.h>
+# (tests/sys/sdt.h), range le nom de chaque sonde dans la section tftp_probes. Chaque
+# sonde suivie par serveur/trace_sessions.bt doit s'y trouver ; le code de sortie
+# signale celles qui manquent.
+BUILD=${BUILD:-build}
+SCRIPT=serveur/trace_sessions.bt
+status=0
+
+present=$(readelf -p tftp_probes "$BUILD/server_probes" | sed -n 's/.*tftp:\([a-z_]*\)$/\1/p' | sort -u)
+for probe in $(sed -n 's/^usdt:\*:tftp:\([a-z_]*\)$/\1/p' "$SCRIPT" | sort -u); do
+    if echo "$present" | grep -qx "$probe"; then
+        echo "tftp:$probe"
+    else
+        echo "tftp:$probe suivie par $SCRIPT mais absente du serveur"
+        status=1
+    fi
+done
+exit $status
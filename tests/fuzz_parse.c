@@ -0,0 +1,138 @@
+//Fuzz de parse_request. Compilé avec -DLIBFUZZER et -fsanitize=fuzzer (clang), seul
+//LLVMFuzzerTestOneInput est défini ; sinon main mute lui-même, à partir de requêtes
+//valides et d'une graine fixe, assez de datagrammes pour un contrôle rapide (make fuzz,
+//avec ASan et UBSan). Chaque requête acceptée doit pointer dans le datagramme, sur des
+//champs terminés par un octet nul avant sa fin.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../protocol.h"
+
+#define FUZZ_PACKET_SIZE 516
+
+bool field_inside(const char *field, const char *packet, size_t length)
+{
+    return field >= packet && field < packet + length && memchr(field, '\0', packet + length - field) != NULL;
+}
+
+//Analyse une copie exacte des données, pour qu'ASan signale toute lecture au-delà.
+int check_request(const uint8_t *data, size_t size)
+{
+    char *packet = malloc(size > 0 ? size : 1);
+    if (packet == NULL)
+        return 0;
+    memcpy(packet, data, size);
+
+    struct TftpRequest request;
+    if (parse_request(packet, size, &request) == 0) {
+        if (!field_inside(request.filename, packet, size) || !field_inside(request.mode, packet, size)
+            || request.option_count < 0 || request.option_count > MAX_OPTIONS)
+            abort();
+        for (int i = 0; i < request.option_count; ++i) {
+            if (!field_inside(request.options[i].name, packet, size)
+                || (request.options[i].value != NULL && !field_inside(request.options[i].value, packet, size)))
+                abort();
+            if (find_option(&request, request.options[i].name) == NULL)
+                abort();
+        }
+    }
+    free(packet);
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    return check_request(data, size);
+}
+
+#ifndef LIBFUZZER
+
+uint64_t fuzz_state = 0x2545F4914F6CDD1DULL;
+
+uint64_t fuzz_random()
+{
+    fuzz_state ^= fuzz_state << 13;
+    fuzz_state ^= fuzz_state >> 7;
+    fuzz_state ^= fuzz_state << 17;
+    return fuzz_state;
+}
+
+size_t build_seed(uint8_t *packet, int index)
+{
+    static const char *const fields[][12] = {
+        {"f.bin", "octet", NULL},
+        {"f.bin", "octet", "bigfile", "resume", "1024", NULL},
+        {"dir/f.bin", "netascii", "windowsize", "16", "rollover", "0", "delta", "1", NULL},
+        {"f.bin", "octet", "blksize", "1428", "tsize", "0", "timeout", "5", "x", "y", NULL},
+    };
+    int seed = index % (int)(sizeof(fields) / sizeof(fields[0]));
+    packet[0] = 0;
+    packet[1] = 1 + index % 2;
+    size_t length = 2;
+    for (int i = 0; fields[seed][i] != NULL; ++i) {
+        size_t field_size = strlen(fields[seed][i]) + 1;
+        memcpy(packet + length, fields[seed][i], field_size);
+        length += field_size;
+    }
+    return length;
+}
+
+//Mutations : octets changés, octets nuls ajoutés ou retirés, datagramme tronqué ou
+//prolongé de bruit, options répétées au-delà de MAX_OPTIONS.
+size_t mutate(uint8_t *packet, size_t length)
+{
+    int count = 1 + fuzz_random() % 4;
+    for (int i = 0; i < count; ++i) {
+        switch (fuzz_random() % 6) {
+        case 0:
+            if (length > 0)
+                packet[fuzz_random() % length] = fuzz_random();
+            break;
+        case 1:
+            if (length > 0)
+                packet[fuzz_random() % length] = 0;
+            break;
+        case 2:
+            if (length > 0)
+                packet[fuzz_random() % length] ^= 0xFF;
+            break;
+        case 3:
+            length = length > 0 ? fuzz_random() % (length + 1) : 0;
+            break;
+        case 4:
+            while (length < FUZZ_PACKET_SIZE && fuzz_random() % 8 != 0)
+                packet[length++] = fuzz_random() % 3 == 0 ? 0 : 'a' + fuzz_random() % 26;
+            break;
+        case 5:
+            for (int j = 0; j < 3 * MAX_OPTIONS && length + 4 <= FUZZ_PACKET_SIZE; ++j) {
+                memcpy(packet + length, "o\0v", 4);
+                length += 4;
+            }
+            break;
+        }
+    }
+    return length;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+    if (argc > 2)
+        fuzz_state = strtoull(argv[2], NULL, 0) | 1;
+
+    uint8_t packet[FUZZ_PACKET_SIZE];
+    for (long i = 0; i < iterations; ++i) {
+        size_t length = build_seed(packet, i);
+        if (i % 16 != 0)
+            length = mutate(packet, length);
+        check_request(packet, length);
+    }
+    printf("fuzz_parse : %ld datagrammes analysés sans erreur\n", iterations);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,574 @@
+//Simulateur de lien déterministe (make bench-netsim) : le cœur de transfert (Sender,
+//Receiver) tourne dans ce processus, de part et d'autre d'un lien UDP simulé dont on
+//choisit l'aller-retour, la gigue, les pertes, les doublons, le désordre et le débit.
+//Le temps est virtuel : rien n'attend, et des heures de transfert simulé durent quelques
+//secondes. Les deux extrémités reprennent les boucles d'une lecture (RRQ) : celle du
+//serveur à threads (send_file, send_and_wait_ack), qui renvoie la fenêtre entière après
+//TIMEOUT_SECONDS sans ACK, au plus MAX_RETRIES fois, et celle du client (handle_rrq,
+//receive_data), qui n'acquitte qu'en fin de fenêtre et renvoie son dernier paquet après
+//le même délai. Pour chaque lien et chaque jeu d'options, on affiche le temps de transfert
+//et le débit utile. Avec la même graine (argument ou NETSIM_SEED), les résultats sont
+//identiques d'une exécution à l'autre : le programme le vérifie en rejouant tous les
+//scénarios. Les données reçues sont comparées à celles du fichier simulé.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "../transfer.h"
+#include "../protocol.h"
+
+#define TIMEOUT_SECONDS 5
+#define TIMEOUT_US (TIMEOUT_SECONDS * 1000000LL)
+#define FILE_SIZE (1024 * 1024 + 300)
+#define ROLLOVER_FILE_SIZE (33 * 1024 * 1024 + 300)
+#define UDP_OVERHEAD 28
+#define TO_SENDER 0
+#define TO_RECEIVER 1
+
+//Un lien : aller-retour et gigue en millisecondes, pertes, doublons et désordre en
+//pourcentage de paquets (dans chaque sens), débit en octets par seconde (0 : illimité).
+//Un paquet mis en désordre est retardé d'un aller simple de plus, et se fait doubler
+//par ceux qui le suivent.
+struct LinkModel {
+    const char *name;
+    double rtt_ms;
+    double jitter_ms;
+    double loss;
+    double duplicate;
+    double reorder;
+    long rate;
+};
+
+//Options d'une lecture, telles que l'OACK les a acceptées. file_size nul : FILE_SIZE.
+struct OptionSet {
+    const char *name;
+    int window_size;
+    int rollover;
+    off_t file_size;
+};
+
+//Un datagramme en vol, livré à l'extrémité to à l'instant arrival (en microsecondes
+//virtuelles). sequence départage deux livraisons au même instant.
+struct Datagram {
+    long long arrival;
+    unsigned long sequence;
+    int to;
+    size_t size;
+    unsigned char data[MAX_PACKET_SIZE];
+};
+
+//Le lien dans les deux sens : un tas des datagrammes en vol, et pour chaque sens
+//l'instant où le dernier paquet aura fini de passer (busy_until), qui fait attendre les
+//suivants quand le débit est limité.
+struct Network {
+    const struct LinkModel *model;
+    unsigned long long random;
+    struct Datagram *queue;
+    size_t length;
+    size_t capacity;
+    unsigned long sequence;
+    long long busy_until[2];
+    unsigned long sent;
+    unsigned long lost;
+    unsigned long duplicated;
+    unsigned long reordered;
+};
+
+//Côté serveur : la fenêtre en cours (l'OACK tant que oack vaut vrai), comme dans
+//send_file. read_offset est la position du prochain bloc à lire dans le fichier simulé.
+struct SenderSide {
+    struct Sender sender;
+    int window_size;
+    off_t file_size;
+    off_t read_offset;
+    bool started;
+    bool oack;
+    bool end_of_file;
+    unsigned char window[MAX_WINDOW_BLOCKS][MAX_PACKET_SIZE];
+    size_t block_sizes[MAX_WINDOW_BLOCKS];
+    size_t packet_sizes[MAX_WINDOW_BLOCKS];
+    int count;
+    int attempts;
+    long long deadline;
+    bool finished;
+    bool failed;
+};
+
+//Côté client : last_packet est la requête, puis le dernier ACK envoyé.
+struct ReceiverSide {
+    struct Receiver receiver;
+    off_t file_size;
+    bool got_oack;
+    bool finished;
+    bool failed;
+    bool corrupt;
+    unsigned char last_packet[MAX_PACKET_SIZE];
+    size_t last_packet_size;
+    int attempts;
+    long long deadline;
+};
+
+struct Result {
+    bool complete;
+    bool corrupt;
+    long long elapsed_us;
+    off_t received;
+    unsigned long sent;
+    unsigned long lost;
+    unsigned long duplicated;
+    unsigned long reordered;
+    unsigned long fast;
+    unsigned long timeout;
+};
+
+const struct LinkModel links[] = {
+    {"local", 0.1, 0, 0, 0, 0, 0},
+    {"lan", 1, 0.2, 0.1, 0, 0.5, 12500000},
+    {"wan", 80, 5, 0.5, 0.1, 1, 2000000},
+    {"lossy", 40, 10, 3, 1, 5, 1000000},
+    {"satellite", 600, 20, 1, 0, 0, 524288},
+};
+
+const struct OptionSet option_sets[] = {
+    {"sans option", 1, ROLLOVER_NONE, 0},
+    {"windowsize=4", 4, ROLLOVER_NONE, 0},
+    {"windowsize=8", 8, ROLLOVER_NONE, 0},
+    {"windowsize=16", 16, ROLLOVER_NONE, 0},
+    {"windowsize=64", 64, ROLLOVER_NONE, 0},
+    {"windowsize=16 rollover=0", 16, 0, ROLLOVER_FILE_SIZE},
+    {"windowsize=16 rollover=1", 16, 1, ROLLOVER_FILE_SIZE},
+};
+
+unsigned long long next_random(unsigned long long *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+bool chance(struct Network *network, double percent)
+{
+    return percent > 0 && (next_random(&network->random) % 1000000) < percent * 10000;
+}
+
+//Octet du fichier simulé à la position offset.
+unsigned char file_byte(off_t offset)
+{
+    unsigned long long value = (unsigned long long)offset * 0x9e3779b97f4a7c15ULL;
+    return value >> 56;
+}
+
+bool datagram_before(const struct Datagram *a, const struct Datagram *b)
+{
+    return a->arrival < b->arrival || (a->arrival == b->arrival && a->sequence < b->sequence);
+}
+
+void queue_swap(struct Network *network, size_t a, size_t b)
+{
+    struct Datagram datagram = network->queue[a];
+    network->queue[a] = network->queue[b];
+    network->queue[b] = datagram;
+}
+
+void queue_push(struct Network *network, long long arrival, int to, const unsigned char *data, size_t size)
+{
+    if (network->length == network->capacity) {
+        network->capacity = network->capacity == 0 ? 256 : network->capacity * 2;
+        network->queue = realloc(network->queue, network->capacity * sizeof(*network->queue));
+        if (network->queue == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t index = network->length++;
+    struct Datagram *datagram = &network->queue[index];
+    datagram->arrival = arrival;
+    datagram->sequence = network->sequence++;
+    datagram->to = to;
+    datagram->size = size;
+    memcpy(datagram->data, data, size);
+    while (index > 0 && datagram_before(&network->queue[index], &network->queue[(index - 1) / 2])) {
+        queue_swap(network, index, (index - 1) / 2);
+        index = (index - 1) / 2;
+    }
+}
+
+void queue_pop(struct Network *network, struct Datagram *datagram)
+{
+    *datagram = network->queue[0];
+    network->queue[0] = network->queue[--network->length];
+    size_t index = 0;
+    while (1) {
+        size_t smallest = index;
+        size_t left = 2 * index + 1;
+        if (left < network->length && datagram_before(&network->queue[left], &network->queue[smallest]))
+            smallest = left;
+        if (left + 1 < network->length && datagram_before(&network->queue[left + 1], &network->queue[smallest]))
+            smallest = left + 1;
+        if (smallest == index)
+            return;
+        queue_swap(network, index, smallest);
+        index = smallest;
+    }
+}
+
+//Envoie un datagramme vers l'extrémité to : il attend que le lien soit libre dans ce
+//sens, occupe le lien le temps de passer au débit du lien, puis arrive un aller simple
+//(gigue comprise) plus tard, sauf s'il est perdu.
+void network_send(struct Network *network, long long now, int to, const unsigned char *data, size_t size)
+{
+    const struct LinkModel *model = network->model;
+    network->sent++;
+    if (chance(network, model->loss)) {
+        network->lost++;
+        return;
+    }
+
+    long long departure = now > network->busy_until[to] ? now : network->busy_until[to];
+    if (model->rate > 0)
+        departure += (long long)(size + UDP_OVERHEAD) * 1000000 / model->rate;
+    network->busy_until[to] = departure;
+
+    long long delay = model->rtt_ms * 500;
+    long long jitter = model->jitter_ms * 1000;
+    if (jitter > 0)
+        delay += (long long)(next_random(&network->random) % (2 * jitter + 1)) - jitter;
+    if (chance(network, model->reorder)) {
+        delay += model->rtt_ms * 500 + 1000;
+        network->reordered++;
+    }
+    if (delay < 0)
+        delay = 0;
+    queue_push(network, departure + delay, to, data, size);
+    if (chance(network, model->duplicate)) {
+        network->duplicated++;
+        queue_push(network, departure + delay + 50, to, data, size);
+    }
+}
+
+//Complète la fenêtre jusqu'à window_size blocs, comme send_file.
+void fill_window(struct SenderSide *side)
+{
+    struct Sender *sender = &side->sender;
+    while (!side->end_of_file && sender->window_sent < side->window_size
+           && (sender->rollover != ROLLOVER_NONE || sender->block_number + sender->window_sent <= 65535)) {
+        int index = sender->window_sent;
+        size_t size = side->file_size - side->read_offset < 512 ? (size_t)(side->file_size - side->read_offset) : 512;
+        for (size_t i = 0; i < size; ++i)
+            side->window[index][4 + i] = file_byte(side->read_offset + i);
+        side->read_offset += size;
+        side->block_sizes[index] = size;
+        side->packet_sizes[index] = sender_packet(sender, side->window[index], size);
+        side->end_of_file = size < 512;
+    }
+    side->count = sender->window_sent;
+}
+
+void send_window_packets(struct SenderSide *side, struct Network *network, long long now)
+{
+    for (int i = 0; i < side->count; ++i)
+        network_send(network, now, TO_RECEIVER, side->window[i], side->packet_sizes[i]);
+    side->deadline = now + TIMEOUT_US;
+}
+
+//La requête arrive : le serveur envoie l'OACK et attend l'ACK 0. Une requête en double
+//est ignorée (le vrai serveur ouvrirait une seconde session, sans effet sur celle-ci).
+void sender_start(struct SenderSide *side, struct Network *network, long long now, const struct OptionSet *options)
+{
+    if (side->started)
+        return;
+    side->started = true;
+    side->oack = true;
+    sender_init(&side->sender, options->rollover, false, 0);
+
+    struct TftpOption accepted_options[2];
+    int accepted_count = 0;
+    char window_text[12];
+    if (options->window_size > 1) {
+        snprintf(window_text, sizeof(window_text), "%d", options->window_size);
+        accepted_options[accepted_count].name = "windowsize";
+        accepted_options[accepted_count].value = window_text;
+        accepted_count++;
+    }
+    if (options->rollover != ROLLOVER_NONE) {
+        accepted_options[accepted_count].name = "rollover";
+        accepted_options[accepted_count].value = options->rollover == 0 ? "0" : "1";
+        accepted_count++;
+    }
+    side->packet_sizes[0] = build_oack(side->window[0], accepted_options, accepted_count);
+    side->count = 1;
+    send_window_packets(side, network, now);
+}
+
+void sender_receive(struct SenderSide *side, struct Network *network, long long now, const unsigned char *packet, size_t size)
+{
+    if (side->finished || side->failed)
+        return;
+    side->deadline = now + TIMEOUT_US;
+
+    struct Sender *sender = &side->sender;
+    int action = sender_ack(sender, packet, size);
+    if (action == ACK_ERROR || action == ACK_INVALID) {
+        side->failed = true;
+        side->deadline = -1;
+        return;
+    }
+    if (action == ACK_RESEND)
+        send_window_packets(side, network, now);
+    if (action != ACK_DONE)
+        return;
+
+    side->attempts = 0;
+    if (side->oack) {
+        side->oack = false;
+        sender->block_number = 1;
+        sender->window_sent = 0;
+    } else {
+        int acked_blocks = sender->acked_blocks;
+        bool more = true;
+        for (int i = 0; i < acked_blocks && more; ++i)
+            more = sender_next(sender, side->block_sizes[i]);
+        if (!more) {
+            side->finished = !sender->too_big;
+            side->failed = sender->too_big;
+            side->deadline = -1;
+            return;
+        }
+        memmove(side->window, side->window[acked_blocks], (side->count - acked_blocks) * sizeof(side->window[0]));
+        memmove(side->block_sizes, side->block_sizes + acked_blocks, (side->count - acked_blocks) * sizeof(side->block_sizes[0]));
+        memmove(side->packet_sizes, side->packet_sizes + acked_blocks, (side->count - acked_blocks) * sizeof(side->packet_sizes[0]));
+    }
+    fill_window(side);
+    send_window_packets(side, network, now);
+}
+
+void sender_expire(struct SenderSide *side, struct Network *network, long long now)
+{
+    if (side->attempts >= MAX_RETRIES) {
+        side->failed = true;
+        side->deadline = -1;
+        return;
+    }
+    side->attempts++;
+    sender_timeout(&side->sender);
+    send_window_packets(side, network, now);
+}
+
+void receiver_send_last(struct ReceiverSide *side, struct Network *network, long long now)
+{
+    network_send(network, now, TO_SENDER, side->last_packet, side->last_packet_size);
+    side->deadline = now + TIMEOUT_US;
+}
+
+void receiver_receive(struct ReceiverSide *side, struct Network *network, long long now, const unsigned char *packet, size_t size)
+{
+    if (side->finished || side->failed)
+        return;
+    side->attempts = 0;
+    side->deadline = now + TIMEOUT_US;
+
+    //Avant l'OACK, seul l'OACK compte ; il est acquitté par l'ACK 0.
+    if (!side->got_oack) {
+        if (size >= 2 && packet[1] == OACK_OPCODE) {
+            side->got_oack = true;
+            side->last_packet_size = build_ack(side->last_packet, 0, -1, 0, 0);
+            receiver_send_last(side, network, now);
+        }
+        return;
+    }
+
+    struct Receiver *receiver = &side->receiver;
+    unsigned char data_packet[MAX_PACKET_SIZE];
+    memcpy(data_packet, packet, size);
+    int action = data_packet[1] == OACK_OPCODE && receiver->expected == 1 ? RECEIVE_REPEAT_ACK : receiver_accept(receiver, data_packet, size);
+    if (action == RECEIVE_INVALID) {
+        side->failed = true;
+        side->deadline = -1;
+        return;
+    }
+    if (action == RECEIVE_REPEAT_ACK)
+        receiver_send_last(side, network, now);
+    if (action == RECEIVE_DELIVER) {
+        size_t data_size = size - 4;
+        do {
+            for (size_t i = 0; i < data_size; ++i)
+                side->corrupt |= data_packet[4 + i] != file_byte(receiver->write_offset + i);
+        } while (receiver_next(receiver, data_packet + 4, &data_size));
+    }
+    if (!receiver_ack_due(receiver))
+        return;
+
+    side->last_packet_size = build_ack(side->last_packet, receiver->acked, -1, 0, 0);
+    receiver_send_last(side, network, now);
+    if (receiver->complete || receiver->too_big) {
+        side->finished = receiver->complete;
+        side->failed = receiver->too_big;
+        side->corrupt |= receiver->complete && receiver->write_offset != side->file_size;
+        side->deadline = -1;
+    }
+}
+
+void receiver_expire(struct ReceiverSide *side, struct Network *network, long long now)
+{
+    if (side->attempts >= MAX_RETRIES) {
+        side->failed = true;
+        side->deadline = -1;
+        return;
+    }
+    side->attempts++;
+    receiver_send_last(side, network, now);
+}
+
+//Simule une lecture complète sur le lien model avec les options données. Le transfert
+//se termine quand le client a reçu le dernier bloc (ou abandonne).
+struct Result simulate(const struct LinkModel *model, const struct OptionSet *options, unsigned long long seed)
+{
+    struct Network network;
+    memset(&network, 0, sizeof(network));
+    network.model = model;
+    network.random = seed != 0 ? seed : 1;
+
+    struct SenderSide *sender_side = calloc(1, sizeof(*sender_side));
+    struct ReceiverSide receiver_side;
+    memset(&receiver_side, 0, sizeof(receiver_side));
+    if (sender_side == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    off_t file_size = options->file_size != 0 ? options->file_size : FILE_SIZE;
+    sender_side->window_size = options->window_size;
+    sender_side->file_size = file_size;
+    sender_side->deadline = -1;
+    receiver_side.file_size = file_size;
+    receiver_init(&receiver_side.receiver, options->rollover, false, 0);
+    receiver_side.receiver.window_size = options->window_size;
+
+    //La requête : son contenu n'est pas lu, seul son opcode compte.
+    static const unsigned char request[] = {0, RRQ_OPCODE, 'n', 'e', 't', 's', 'i', 'm', 0, 'o', 'c', 't', 'e', 't', 0};
+    memcpy(receiver_side.last_packet, request, sizeof(request));
+    receiver_side.last_packet_size = sizeof(request);
+    long long now = 0;
+    receiver_send_last(&receiver_side, &network, now);
+
+    while (!receiver_side.finished && !receiver_side.failed) {
+        long long next = -1;
+        int event = -1;
+        if (network.length > 0) {
+            next = network.queue[0].arrival;
+            event = 0;
+        }
+        if (sender_side->deadline >= 0 && (next < 0 || sender_side->deadline < next)) {
+            next = sender_side->deadline;
+            event = 1;
+        }
+        if (receiver_side.deadline >= 0 && (next < 0 || receiver_side.deadline < next)) {
+            next = receiver_side.deadline;
+            event = 2;
+        }
+        if (event < 0)
+            break;
+
+        now = next;
+        if (event == 1) {
+            sender_expire(sender_side, &network, now);
+        } else if (event == 2) {
+            receiver_expire(&receiver_side, &network, now);
+        } else {
+            struct Datagram datagram;
+            queue_pop(&network, &datagram);
+            if (datagram.to == TO_RECEIVER)
+                receiver_receive(&receiver_side, &network, now, datagram.data, datagram.size);
+            else if (datagram.size >= 2 && datagram.data[1] == RRQ_OPCODE)
+                sender_start(sender_side, &network, now, options);
+            else if (sender_side->started)
+                sender_receive(sender_side, &network, now, datagram.data, datagram.size);
+        }
+    }
+
+    struct Result result;
+    result.complete = receiver_side.finished && !receiver_side.corrupt;
+    result.corrupt = receiver_side.corrupt;
+    result.elapsed_us = now;
+    result.received = receiver_side.receiver.write_offset;
+    result.sent = network.sent;
+    result.lost = network.lost;
+    result.duplicated = network.duplicated;
+    result.reordered = network.reordered;
+    result.fast = sender_side->sender.stats.fast;
+    result.timeout = sender_side->sender.stats.timeout;
+    receiver_close(&receiver_side.receiver);
+    free(sender_side);
+    free(network.queue);
+    return result;
+}
+
+//Graine d'un scénario : chaque couple (lien, options) a sa propre suite aléatoire,
+//indépendante de l'ordre dans lequel les scénarios sont joués.
+unsigned long long scenario_seed(unsigned long long seed, size_t link, size_t options)
+{
+    unsigned long long value = seed * 0x9e3779b97f4a7c15ULL + link * 0x100000001b3ULL + options;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *seed_text = argc > 1 ? argv[1] : getenv("NETSIM_SEED");
+    unsigned long long seed = seed_text != NULL ? strtoull(seed_text, NULL, 10) : 1;
+    size_t link_count = sizeof(links) / sizeof(links[0]);
+    size_t option_count = sizeof(option_sets) / sizeof(option_sets[0]);
+    struct Result results[sizeof(links) / sizeof(links[0])][sizeof(option_sets) / sizeof(option_sets[0])];
+    int status = 0;
+
+    printf("Graine %llu ; délai d'attente %d s, %d tentatives\n", seed, TIMEOUT_SECONDS, MAX_RETRIES);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double simulated = 0;
+    for (size_t l = 0; l < link_count; ++l) {
+        const struct LinkModel *model = &links[l];
+        char rate_text[32] = "illimité";
+        if (model->rate > 0)
+            snprintf(rate_text, sizeof(rate_text), "%ld Kio/s", model->rate / 1024);
+        printf("\nLien %s : aller-retour %.1f ms, gigue %.1f ms, pertes %.1f %%, doublons %.1f %%, désordre %.1f %%, débit %s\n",
+               model->name, model->rtt_ms, model->jitter_ms, model->loss, model->duplicate, model->reorder, rate_text);
+        printf("  %-26s %10s %10s %12s %8s %7s %9s\n", "options", "octets", "temps (s)", "débit (Kio/s)", "paquets", "perdus", "renvois");
+        for (size_t o = 0; o < option_count; ++o) {
+            struct Result *result = &results[l][o];
+            *result = simulate(model, &option_sets[o], scenario_seed(seed, l, o));
+            simulated += result->elapsed_us / 1e6;
+            double seconds = result->elapsed_us / 1e6;
+            if (result->complete)
+                printf("  %-26s %10lld %10.3f %12.1f %8lu %7lu %4lu+%-4lu\n", option_sets[o].name, (long long)result->received, seconds,
+                       seconds > 0 ? result->received / seconds / 1024 : 0.0, result->sent, result->lost, result->fast, result->timeout);
+            else
+                printf("  %-26s %10lld %10.3f %12s %8lu %7lu %4lu+%-4lu %s\n", option_sets[o].name, (long long)result->received, seconds,
+                       "échec", result->sent, result->lost, result->fast, result->timeout, result->corrupt ? "(données fausses)" : "");
+            if (result->corrupt)
+                status = 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("\n%.0f s de transfert simulées en %.2f s (renvois : rapides+après délai d'attente)\n",
+           simulated, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    //Les mêmes scénarios, rejoués avec la même graine, doivent donner les mêmes résultats.
+    for (size_t l = 0; l < link_count; ++l) {
+        for (size_t o = 0; o < option_count; ++o) {
+            struct Result replay = simulate(&links[l], &option_sets[o], scenario_seed(seed, l, o));
+            const struct Result *result = &results[l][o];
+            if (replay.elapsed_us != result->elapsed_us || replay.received != result->received || replay.sent != result->sent
+                || replay.fast != result->fast || replay.timeout != result->timeout) {
+                printf("Résultat différent en rejouant %s / %s\n", links[l].name, option_sets[o].name);
+                status = 1;
+            }
+        }
+    }
+    if (status == 0)
+        printf("Résultats identiques en rejouant chaque scénario\n");
+    return status;
+}
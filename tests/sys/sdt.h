@@ -0,0 +1,53 @@
+#ifndef TESTS_SYS_SDT_H
+#define TESTS_SYS_SDT_H
+
+//Remplaçant de <sys/sdt.h> pour make check-probes, qui compile le serveur avec -Itests :
+//TRACE_PROBE passe alors par STAP_PROBEV comme avec le vrai en-tête, sans qu'il soit
+//installé. Comme le vrai, STAP_PROBEV n'accepte que de 1 à 12 arguments, chacun un
+//entier ou un pointeur d'au plus 8 octets ; une sonde qui ne les respecte pas ne compile
+//pas. Chaque sonde range son nom, fournisseur:nom, dans la section SDT_STANDIN_SECTION,
+//où tests/check_probes.sh vérifie que toutes celles que suit trace_sessions.bt existent.
+
+#define SDT_STANDIN_SECTION "tftp_probes"
+
+#define _SDT_ARG(x) (void)sizeof(char[sizeof((x) + 0) <= 8 ? 1 : -1])
+
+#define _SDT_NARG(...) _SDT_NARG_N(__VA_ARGS__, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define _SDT_NARG_N(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, N, ...) N
+#define _SDT_CONCAT(a, b) _SDT_CONCAT_(a, b)
+#define _SDT_CONCAT_(a, b) a##b
+
+#define _SDT_PROBE(provider, name, args) do { \
+    static const char _sdt_name[] __attribute__((used, section(SDT_STANDIN_SECTION))) = #provider ":" #name; \
+    args; \
+} while (0)
+
+#define STAP_PROBE1(p, n, a1) _SDT_PROBE(p, n, _SDT_ARG(a1))
+#define STAP_PROBE2(p, n, a1, a2) _SDT_PROBE(p, n, _SDT_ARG(a1); _SDT_ARG(a2))
+#define STAP_PROBE3(p, n, a1, a2, a3) _SDT_PROBE(p, n, _SDT_ARG(a1); _SDT_ARG(a2); _SDT_ARG(a3))
+#define STAP_PROBE4(p, n, a1, a2, a3, a4) _SDT_PROBE(p, n, _SDT_ARG(a1); _SDT_ARG(a2); _SDT_ARG(a3); _SDT_ARG(a4))
+#define STAP_PROBE5(p, n, a1, a2, a3, a4, a5) \
+    _SDT_PROBE(p, n, _SDT_ARG(a1); _SDT_ARG(a2); _SDT_ARG(a3); _SDT_ARG(a4); _SDT_ARG(a5))
+#define STAP_PROBE6(p, n, a1, a2, a3, a4, a5, a6) \
+    _SDT_PROBE(p, n, _SDT_ARG(a1); _SDT_ARG(a2); _SDT_ARG(a3); _SDT_ARG(a4); _SDT_ARG(a5); _SDT_ARG(a6))
+#define STAP_PROBE7(p, n, a1, a2, a3, a4, a5, a6, a7) \
+    _SDT_PROBE(p, n, _SDT_ARG(a1); _SDT_ARG(a2); _SDT_ARG(a3); _SDT_ARG(a4); _SDT_ARG(a5); _SDT_ARG(a6); _SDT_ARG(a7))
+#define STAP_PROBE8(p, n, a1, a2, a3, a4, a5, a6, a7, a8) \
+    _SDT_PROBE(p, n, _SDT_ARG(a1); _SDT_ARG(a2); _SDT_ARG(a3); _SDT_ARG(a4); _SDT_ARG(a5); _SDT_ARG(a6); _SDT_ARG(a7); _SDT_ARG(a8))
+#define STAP_PROBE9(p, n, a1, a2, a3, a4, a5, a6, a7, a8, a9) \
+    _SDT_PROBE(p, n, _SDT_ARG(a1); _SDT_ARG(a2); _SDT_ARG(a3); _SDT_ARG(a4); _SDT_ARG(a5); _SDT_ARG(a6); _SDT_ARG(a7); _SDT_ARG(a8); \
+               _SDT_ARG(a9))
+#define STAP_PROBE10(p, n, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10) \
+    _SDT_PROBE(p, n, _SDT_ARG(a1); _SDT_ARG(a2); _SDT_ARG(a3); _SDT_ARG(a4); _SDT_ARG(a5); _SDT_ARG(a6); _SDT_ARG(a7); _SDT_ARG(a8); \
+               _SDT_ARG(a9); _SDT_ARG(a10))
+#define STAP_PROBE11(p, n, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11) \
+    _SDT_PROBE(p, n, _SDT_ARG(a1); _SDT_ARG(a2); _SDT_ARG(a3); _SDT_ARG(a4); _SDT_ARG(a5); _SDT_ARG(a6); _SDT_ARG(a7); _SDT_ARG(a8); \
+               _SDT_ARG(a9); _SDT_ARG(a10); _SDT_ARG(a11))
+#define STAP_PROBE12(p, n, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12) \
+    _SDT_PROBE(p, n, _SDT_ARG(a1); _SDT_ARG(a2); _SDT_ARG(a3); _SDT_ARG(a4); _SDT_ARG(a5); _SDT_ARG(a6); _SDT_ARG(a7); _SDT_ARG(a8); \
+               _SDT_ARG(a9); _SDT_ARG(a10); _SDT_ARG(a11); _SDT_ARG(a12))
+
+//Plus de 12 arguments donne un STAP_PROBE inexistant, 0 aussi.
+#define STAP_PROBEV(provider, name, ...) _SDT_CONCAT(STAP_PROBE, _SDT_NARG(__VA_ARGS__))(provider, name, __VA_ARGS__)
+
+#endif
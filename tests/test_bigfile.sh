@@ -0,0 +1,66 @@
+#!/bin/sh
+# Fichiers de plus de 4 Gio (make test-bigfile) : un fichier creux de BIG_SIZE octets,
+# avec des données aléatoires au début, de part et d'autre de la limite des 4 Gio et à
+# la fin, passe en get et en put avec rollover=0 puis rollover=1, contre le serveur à
+# threads (windowsize=WINDOW) puis le serveur epoll. On vérifie le fichier reçu, qu'il
+# est resté creux, et on relève la durée et le débit. Le serveur écoute sur le port 69 ;
+# le code de sortie signale un échec.
+BUILD=${BUILD:-build}
+BUILD=$(cd "$BUILD" && pwd)
+BIG_SIZE=${BIG_SIZE:-4400000000}
+WINDOW=${WINDOW:-16}
+status=0
+
+# fill <fichier> : crée le fichier creux et écrit 1 Mio de données à chaque endroit.
+fill() {
+    truncate -s $BIG_SIZE "$1"
+    for offset in 0 $((4294967296 - 524288)) $((BIG_SIZE - 1048576)); do
+        head -c 1048576 /dev/urandom | dd of="$1" bs=1048576 seek=$offset oflag=seek_bytes conv=notrunc 2>/dev/null
+    done
+}
+
+run() {
+    server=$1
+    dir=$(mktemp -d)
+    mkdir "$dir/srv" "$dir/cli"
+    fill "$dir/srv/get.bin"
+    fill "$dir/cli/put.bin"
+    # Le serveur à threads ne connaît que les fichiers présents à son démarrage.
+    touch "$dir/srv/put.bin"
+    if [ "$server" = server ]; then
+        (cd "$dir/srv" && exec "$BUILD/server" > /dev/null 2>&1) &
+    else
+        (cd "$dir/srv" && exec "$BUILD/server_select" > /dev/null 2>&1) &
+    fi
+    pid=$!
+    sleep 0.5
+    for rollover in 0 1; do
+        for operation in get put; do
+            rm -f "$dir/cli/get.bin"
+            result=$(cd "$dir/cli" && "$BUILD/client" $operation $operation.bin 127.0.0.1 69 bigfile rollover=$rollover windowsize=$WINDOW 2>/dev/null \
+                     | sed -n 's/^Transfert terminé en \([0-9.]*\) s : [0-9]* octets, \([0-9.]*\) Kio\/s$/\1 \2/p')
+            if [ $operation = get ]; then
+                received="$dir/cli/get.bin"
+            else
+                received="$dir/srv/put.bin"
+            fi
+            # Les 3 Mio de données et quelques blocs de métadonnées au plus.
+            used_kb=$(du -k "$received" | cut -f 1)
+            if [ -n "$result" ] && cmp -s "$dir/srv/$operation.bin" "$dir/cli/$operation.bin" && [ "$used_kb" -lt 8192 ]; then
+                set -- $result
+                awk -v s="$server" -v r=$rollover -v o=$operation -v t="$1" -v d="$2" -v u="$used_kb" \
+                    'BEGIN { printf "%-14s rollover=%s %-4s %9s s %10.1f Mio/s  (%d Kio sur le disque)\n", s, r, o, t, d / 1024, u }'
+            else
+                printf "%-14s rollover=%s %-4s    échec\n" "$server" $rollover $operation
+                status=1
+            fi
+        done
+    done
+    kill $pid
+    wait $pid 2>/dev/null
+    rm -rf "$dir"
+}
+
+run server
+run server_select
+exit $status
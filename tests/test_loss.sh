@@ -0,0 +1,90 @@
+#!/bin/sh
+# Transferts sur un lien dégradé (make test-loss) : le client compilé avec -DNETSIM perd,
+# double ou réordonne ses paquets selon le profil, contre le serveur à threads puis le
+# serveur epoll. Pour chaque profil, un get et un put de SIZE_KB Kio, en pas à pas puis
+# avec windowsize=WINDOW ; on vérifie le fichier reçu et on relève le débit utile.
+# Enfin, un fichier creux de BIG_SIZE octets (plus de 4 Gio, donc plusieurs retours du
+# numéro de bloc à 0 ou à 1) passe sous doublons et réordonnancement, pour chaque
+# rollover (BIG_SIZE=0 saute cette étape, la plus longue). Le serveur écoute sur le port
+# 69 ; le code de sortie signale un échec.
+BUILD=${BUILD:-build}
+BUILD=$(cd "$BUILD" && pwd)
+SIZE_KB=${SIZE_KB:-128}
+WINDOW=${WINDOW:-8}
+BIG_SIZE=${BIG_SIZE:-4400000000}
+SEED=${SEED:-1}
+status=0
+
+start_server() {
+    if [ "$1" = server ]; then
+        (cd "$dir/srv" && exec "$BUILD/server" > "$dir/server.log" 2>&1) &
+    else
+        (cd "$dir/srv" && exec "$BUILD/server_select" > "$dir/server.log" 2>&1) &
+    fi
+    pid=$!
+    sleep 0.5
+}
+
+# transfer <serveur> <profil> <opération> <fichier> <réglages NETSIM> <options du client...>
+transfer() {
+    server=$1
+    profile=$2
+    operation=$3
+    file=$4
+    settings=$5
+    shift 5
+    output=$(cd "$dir/cli" && env NETSIM_SEED=$SEED $settings "$BUILD/client_netsim" $operation $file 127.0.0.1 69 "$@" 2>/dev/null)
+    result=$(echo "$output" | sed -n 's/^Transfert terminé en \([0-9.]*\) s : [0-9]* octets, \([0-9.]*\) Kio\/s$/\1 \2/p')
+    link=$(echo "$output" | sed -n 's/^Lien simulé : \([0-9]*\) paquets envoyés, \([0-9]*\) perdus, \([0-9]*\) doublés, \([0-9]*\) réordonnés$/\2 \3 \4/p')
+    if [ -n "$result" ] && cmp -s "$dir/srv/$file" "$dir/cli/$file"; then
+        set -- $result $link
+        awk -v s="$server" -v p="$profile" -v o=$operation -v w="$window" -v t="$1" -v r="$2" -v l="$3" -v d="$4" -v m="$5" \
+            'BEGIN { printf "%-14s %-8s %-4s %-12s %9s s %10.1f Kio/s  (%s perdus, %s doublés, %s réordonnés)\n", s, p, o, w, t, r, l, d, m }'
+    else
+        printf "%-14s %-8s %-4s %-12s    échec\n" "$server" "$profile" $operation "$window"
+        status=1
+    fi
+}
+
+run() {
+    server=$1
+    dir=$(mktemp -d)
+    mkdir "$dir/srv" "$dir/cli"
+    head -c $((SIZE_KB * 1024)) /dev/urandom > "$dir/srv/get.bin"
+    head -c $((SIZE_KB * 1024)) /dev/urandom > "$dir/cli/put.bin"
+    # Le fichier creux n'occupe pas de place : seuls ses derniers octets sont écrits. Le
+    # serveur à threads ne connaît que les fichiers présents à son démarrage.
+    if [ "$BIG_SIZE" -gt 0 ]; then
+        truncate -s $BIG_SIZE "$dir/srv/big_get.bin" "$dir/cli/big_put.bin"
+        printf 'fin du fichier' | dd of="$dir/srv/big_get.bin" bs=1 seek=$((BIG_SIZE - 14)) conv=notrunc 2>/dev/null
+        printf 'fin du fichier' | dd of="$dir/cli/big_put.bin" bs=1 seek=$((BIG_SIZE - 14)) conv=notrunc 2>/dev/null
+    fi
+    touch "$dir/srv/put.bin" "$dir/srv/big_put.bin"
+    start_server $server
+    for profile in doublons:NETSIM_DUP=5 desordre:NETSIM_REORDER=5 pertes:NETSIM_LOSS=1 mixte:"NETSIM_LOSS=1 NETSIM_DUP=5 NETSIM_REORDER=5"; do
+        name=${profile%%:*}
+        settings=${profile#*:}
+        for window in 1 $WINDOW; do
+            for operation in get put; do
+                transfer $server $name $operation $operation.bin "$settings" windowsize=$window
+            done
+        done
+    done
+
+    if [ "$BIG_SIZE" -gt 0 ]; then
+        for rollover in 0 1; do
+            window="rollover=$rollover"
+            for operation in get put; do
+                rm -f "$dir/cli/big_get.bin"
+                transfer $server "4 Gio+" $operation big_$operation.bin "NETSIM_DUP=1 NETSIM_REORDER=1" bigfile rollover=$rollover windowsize=$WINDOW
+            done
+        done
+    fi
+    kill $pid
+    wait $pid 2>/dev/null
+    rm -rf "$dir"
+}
+
+run server
+run server_select
+exit $status
@@ -0,0 +1,135 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "timers.h"
+
+void timer_wheel_init(struct TimerWheel *wheel, long long now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+void timer_init(struct Timer *timer, void *data)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->data = data;
+}
+
+bool timer_armed(const struct Timer *timer)
+{
+    return timer->slot != NULL;
+}
+
+//Range une échéance dans le compartiment qui correspond à sa distance au tic en cours :
+//le niveau 0 si elle tombe dans les TIMER_WHEEL_SLOTS prochains tics, sinon le premier
+//niveau qui la couvre. Une échéance passée est due au tic en cours ; une échéance
+//au-delà du dernier niveau y est rangée au plus loin, et y retourne à chaque cascade
+//jusqu'à ce qu'elle soit à portée.
+void timer_place(struct TimerWheel *wheel, struct Timer *timer)
+{
+    long long expires = timer->expires < wheel->now ? wheel->now : timer->expires;
+    long long delta = expires - wheel->now;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= 1LL << (TIMER_WHEEL_BITS * (level + 1)))
+        level++;
+    if (delta >= 1LL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+        expires = wheel->now + (1LL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+    struct Timer **slot = &wheel->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    timer->slot = slot;
+    timer->previous = NULL;
+    timer->next = *slot;
+    if (*slot != NULL)
+        (*slot)->previous = timer;
+    *slot = timer;
+}
+
+void timer_unlink(struct Timer *timer)
+{
+    if (timer->previous != NULL)
+        timer->previous->next = timer->next;
+    else
+        *timer->slot = timer->next;
+    if (timer->next != NULL)
+        timer->next->previous = timer->previous;
+    timer->slot = NULL;
+    timer->previous = NULL;
+    timer->next = NULL;
+}
+
+//Arme (ou réarme) une échéance au tic expires.
+void timer_arm(struct TimerWheel *wheel, struct Timer *timer, long long expires)
+{
+    if (timer_armed(timer))
+        timer_unlink(timer);
+    else
+        wheel->count++;
+    timer->expires = expires;
+    timer_place(wheel, timer);
+}
+
+void timer_cancel(struct TimerWheel *wheel, struct Timer *timer)
+{
+    if (!timer_armed(timer))
+        return;
+    timer_unlink(timer);
+    wheel->count--;
+}
+
+//Fait redescendre les échéances d'un compartiment du niveau level vers les niveaux
+//inférieurs, maintenant que la roue atteint la plage qu'il couvre.
+void timer_cascade(struct TimerWheel *wheel, int level)
+{
+    struct Timer **slot = &wheel->slots[level][(wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    struct Timer *timer = *slot;
+    *slot = NULL;
+    while (timer != NULL) {
+        struct Timer *next = timer->next;
+        timer_place(wheel, timer);
+        timer = next;
+    }
+}
+
+//Renvoie une échéance arrivée à terme au tic now, désarmée, ou NULL quand il n'y en a
+//plus : l'appelant la traite (et peut la réarmer) puis rappelle timer_expire. La roue
+//avance d'un tic à la fois, ce qui coûte une vérification par milliseconde écoulée ;
+//vide, elle saute directement à now.
+struct Timer *timer_expire(struct TimerWheel *wheel, long long now)
+{
+    while (1) {
+        struct Timer *timer = wheel->slots[0][wheel->now & TIMER_WHEEL_MASK];
+        if (timer != NULL) {
+            timer_unlink(timer);
+            wheel->count--;
+            return timer;
+        }
+        if (wheel->now >= now)
+            return NULL;
+        if (wheel->count == 0) {
+            wheel->now = now;
+            return NULL;
+        }
+
+        wheel->now++;
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+            if ((wheel->now & ((1LL << (TIMER_WHEEL_BITS * level)) - 1)) != 0)
+                break;
+            timer_cascade(wheel, level);
+        }
+    }
+}
+
+//Tic auquel la roue doit être relancée (délai d'epoll_wait), -1 si elle est vide : la
+//prochaine échéance du niveau 0 si elle précède la prochaine cascade, sinon cette
+//cascade, après laquelle la roue est à nouveau interrogée.
+long long timer_next_expiry(const struct TimerWheel *wheel)
+{
+    if (wheel->count == 0)
+        return -1;
+    long long cascade = (wheel->now | TIMER_WHEEL_MASK) + 1;
+    for (long long tick = wheel->now; tick < cascade; ++tick) {
+        if (wheel->slots[0][tick & TIMER_WHEEL_MASK] != NULL)
+            return tick;
+    }
+    return cascade;
+}
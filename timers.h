@@ -0,0 +1,48 @@
+#ifndef TIMERS_H
+#define TIMERS_H
+
+//Roue de temporisation hiérarchique du serveur epoll : renvois après délai d'attente,
+//abandon des sessions muettes et attente du dernier ACK. Armer et annuler une échéance
+//coûtent O(1), quelle que soit sa durée : une session réarmée à chaque paquet ne paie
+//pas le O(log n) d'un tas. Le temps est compté en millisecondes (tics). Le niveau 0 a
+//un compartiment par tic ; chaque niveau suivant couvre TIMER_WHEEL_SLOTS compartiments
+//du précédent, et ses échéances y redescendent (cascade) quand la roue l'atteint.
+//Comparée à un tas binaire par tests/bench_timers.c.
+
+#include <stdbool.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+//Une échéance, rangée dans la liste d'un compartiment. slot pointe sur la tête de cette
+//liste (NULL si l'échéance n'est pas armée) : l'annulation n'a rien à chercher. data
+//appartient au propriétaire de l'échéance.
+struct Timer {
+    long long expires;
+    struct Timer **slot;
+    struct Timer *previous;
+    struct Timer *next;
+    void *data;
+};
+
+//now est le tic en cours : les tics précédents sont traités, et les cascades de now faites.
+struct TimerWheel {
+    long long now;
+    unsigned long count;
+    struct Timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(struct TimerWheel *wheel, long long now);
+void timer_init(struct Timer *timer, void *data);
+bool timer_armed(const struct Timer *timer);
+void timer_place(struct TimerWheel *wheel, struct Timer *timer);
+void timer_unlink(struct Timer *timer);
+void timer_arm(struct TimerWheel *wheel, struct Timer *timer, long long expires);
+void timer_cancel(struct TimerWheel *wheel, struct Timer *timer);
+void timer_cascade(struct TimerWheel *wheel, int level);
+struct Timer *timer_expire(struct TimerWheel *wheel, long long now);
+long long timer_next_expiry(const struct TimerWheel *wheel);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+//Sondes USDT (fournisseur tftp) des sessions, suivies par serveur/trace_sessions.bt.
+//Non suivie, une sonde n'est qu'un nop ; sans <sys/sdt.h> (paquet systemtap-sdt-dev),
+//ou compilées avec -DNO_TRACE_PROBES, elles disparaissent. Chaque sonde a au moins un
+//argument, le port du client quand il est connu.
+#if defined(__has_include) && !defined(NO_TRACE_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBES
+#endif
+#endif
+
+//Issue d'une session, dernier argument de la sonde close. Une requête refusée (chemin,
+//fichier, options ou place) est fermée aussitôt, avec 0 octet.
+#define TRACE_CLOSE_FAILED 0
+#define TRACE_CLOSE_DONE 1
+#define TRACE_CLOSE_HANDED_OFF 2
+#define TRACE_CLOSE_REFUSED 3
+
+#ifdef TRACE_PROBES
+#define TRACE_PROBE(name, ...) STAP_PROBEV(tftp, name, __VA_ARGS__)
+#else
+#define TRACE_PROBE(name, ...) do { if (0) trace_probe_disabled(__VA_ARGS__); } while (0)
+void trace_probe_disabled(int first, ...);
+#endif
+
+#endif
@@ -0,0 +1,713 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include "transfer.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+//Nombre de blocs qui séparent expected de received, négatif pour un bloc déjà reçu.
+//Avec rollover 0, les numéros font le tour de 0 à 65535 ; sinon ils vont de 1 à 65535
+//puis repassent à 1 (rollover 1) : le bloc 0 n'existe pas.
+int block_distance(unsigned short expected, unsigned short received, int rollover)
+{
+    int modulus = rollover == 0 ? 65536 : 65535;
+    int distance = ((int)received - (int)expected + modulus) % modulus;
+    if (distance > 32767)
+        distance -= modulus;
+    return distance;
+}
+
+//Numéro du bloc qui suit block_number de count blocs, en sautant le bloc 0 sauf avec
+//rollover 0.
+unsigned short block_after(unsigned short block_number, int count, int rollover)
+{
+    if (rollover == 0)
+        return (block_number + count) & 0xFFFF;
+    return (block_number - 1 + count) % 65535 + 1;
+}
+
+//Met de côté un bloc arrivé en avance. Un bloc déjà gardé, ou un tampon plein, est ignoré.
+void store_early_block(struct ReorderBuffer *reorder, unsigned short block_number, const unsigned char *data, size_t size)
+{
+    int free_slot = -1;
+    for (int i = 0; i < REORDER_BLOCKS; ++i) {
+        if (reorder->blocks[i].used && reorder->blocks[i].block_number == block_number)
+            return;
+        if (!reorder->blocks[i].used && free_slot < 0)
+            free_slot = i;
+    }
+    if (free_slot < 0)
+        return;
+
+    reorder->blocks[free_slot].used = true;
+    reorder->blocks[free_slot].block_number = block_number;
+    reorder->blocks[free_slot].size = size;
+    memcpy(reorder->blocks[free_slot].data, data, size);
+}
+
+//Retire le bloc block_number du tampon et le copie dans data. Renvoie sa taille, ou -1
+//s'il n'est pas arrivé.
+ssize_t take_early_block(struct ReorderBuffer *reorder, unsigned short block_number, unsigned char *data)
+{
+    for (int i = 0; i < REORDER_BLOCKS; ++i) {
+        if (reorder->blocks[i].used && reorder->blocks[i].block_number == block_number) {
+            reorder->blocks[i].used = false;
+            memcpy(data, reorder->blocks[i].data, reorder->blocks[i].size);
+            return reorder->blocks[i].size;
+        }
+    }
+    return -1;
+}
+
+const uint32_t sha256_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+void sha256_init(struct Sha256 *hash)
+{
+    const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(hash->state, initial, sizeof(initial));
+    hash->length = 0;
+    hash->used = 0;
+}
+
+uint32_t rotate_right(uint32_t value, int bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+//Traite un bloc de 64 octets (FIPS 180-4, section 6.2.2).
+void sha256_transform(struct Sha256 *hash, const unsigned char *block)
+{
+    uint32_t words[64];
+    for (int i = 0; i < 16; ++i)
+        words[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotate_right(words[i - 15], 7) ^ rotate_right(words[i - 15], 18) ^ (words[i - 15] >> 3);
+        uint32_t s1 = rotate_right(words[i - 2], 17) ^ rotate_right(words[i - 2], 19) ^ (words[i - 2] >> 10);
+        words[i] = words[i - 16] + s0 + words[i - 7] + s1;
+    }
+
+    uint32_t a = hash->state[0], b = hash->state[1], c = hash->state[2], d = hash->state[3];
+    uint32_t e = hash->state[4], f = hash->state[5], g = hash->state[6], h = hash->state[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = h + (rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25)) + ((e & f) ^ (~e & g)) + sha256_constants[i] + words[i];
+        uint32_t t2 = (rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    hash->state[0] += a;
+    hash->state[1] += b;
+    hash->state[2] += c;
+    hash->state[3] += d;
+    hash->state[4] += e;
+    hash->state[5] += f;
+    hash->state[6] += g;
+    hash->state[7] += h;
+}
+
+void sha256_update(struct Sha256 *hash, const unsigned char *data, size_t size)
+{
+    hash->length += size;
+    while (size > 0) {
+        if (hash->used == 0 && size >= 64) {
+            sha256_transform(hash, data);
+            data += 64;
+            size -= 64;
+            continue;
+        }
+
+        size_t part = 64 - hash->used;
+        if (part > size)
+            part = size;
+        memcpy(hash->block + hash->used, data, part);
+        hash->used += part;
+        data += part;
+        size -= part;
+        if (hash->used == 64) {
+            sha256_transform(hash, hash->block);
+            hash->used = 0;
+        }
+    }
+}
+
+void sha256_final(struct Sha256 *hash, unsigned char *digest)
+{
+    uint64_t bits = hash->length * 8;
+    unsigned char padding[64] = {0x80};
+    sha256_update(hash, padding, (hash->used < 56 ? 56 : 120) - hash->used);
+
+    unsigned char length_bytes[8];
+    for (int i = 0; i < 8; ++i)
+        length_bytes[i] = bits >> (56 - 8 * i);
+    sha256_update(hash, length_bytes, sizeof(length_bytes));
+
+    for (int i = 0; i < 8; ++i) {
+        digest[4 * i] = hash->state[i] >> 24;
+        digest[4 * i + 1] = hash->state[i] >> 16;
+        digest[4 * i + 2] = hash->state[i] >> 8;
+        digest[4 * i + 3] = hash->state[i];
+    }
+}
+
+//Signature d'un bloc pour le mode delta : son SHA-256. Un MATCH fait garder au
+//destinataire le bloc de sa copie au lieu de celui de l'expéditeur ; une collision y
+//laisserait un bloc faux sans que rien ne le signale, ce qu'un hachage non
+//cryptographique ne permet pas d'exclure face à des données choisies.
+void block_signature(const unsigned char *data, size_t size, unsigned char *signature)
+{
+    struct Sha256 hash;
+    sha256_init(&hash);
+    sha256_update(&hash, data, size);
+    sha256_final(&hash, signature);
+}
+
+bool match_block(const struct BlockSignature *signature, const unsigned char *data, size_t size)
+{
+    if (signature == NULL || !signature->present)
+        return false;
+    unsigned char computed[SIGNATURE_SIZE];
+    block_signature(data, size, computed);
+    return memcmp(computed, signature->hash, SIGNATURE_SIZE) == 0;
+}
+
+//Vrai si le bloc ne contient que des zéros. Le bloc est lu par mots de 64 bits dont on
+//accumule le OU, sans branche dans la boucle : le compilateur la vectorise.
+bool is_zero_block(const unsigned char *data, size_t size)
+{
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        bits |= word;
+    }
+    for (; i < size; ++i)
+        bits |= data[i];
+    return bits == 0;
+}
+
+//Remplit un paquet ERROR ; un message trop long est tronqué. Renvoie sa taille.
+size_t build_error_packet(unsigned char *error_packet, int error_code, const char *error_message)
+{
+    size_t message_size = strlen(error_message);
+    if (message_size > MAX_PACKET_SIZE - 5)
+        message_size = MAX_PACKET_SIZE - 5;
+
+    error_packet[0] = 0;
+    error_packet[1] = ERROR_OPCODE;
+    error_packet[2] = 0;
+    error_packet[3] = error_code;
+    memcpy(error_packet + 4, error_message, message_size);
+    error_packet[4 + message_size] = '\0';
+    return message_size + 5;
+}
+
+void sender_init(struct Sender *sender, int rollover, bool delta, unsigned short block_number)
+{
+    memset(sender, 0, sizeof(*sender));
+    sender->rollover = rollover;
+    sender->delta = delta;
+    sender->block_number = block_number;
+}
+
+//Prépare l'en-tête du bloc suivant de la fenêtre (block_number sans fenêtre) autour des
+//data_size octets déjà placés dans data_packet + 4. En mode delta, un bloc identique à
+//celui du destinataire est remplacé par un MATCH. Renvoie la taille du paquet à envoyer.
+size_t sender_packet(struct Sender *sender, unsigned char *data_packet, size_t data_size)
+{
+    unsigned short block_number = block_after(sender->block_number, sender->window_sent, sender->rollover);
+    sender->window_sent++;
+    data_packet[0] = 0;
+    data_packet[1] = DATA_OPCODE;
+    data_packet[2] = block_number >> 8;
+    data_packet[3] = block_number & 0xFF;
+    if (sender->delta && match_block(&sender->next_signature, data_packet + 4, data_size)) {
+        data_packet[1] = MATCH_OPCODE;
+        sender->matched_blocks++;
+        return 4;
+    }
+    return 4 + data_size;
+}
+
+//Traite un paquet reçu en attendant l'ACK du bloc en cours : ACK_DONE s'il l'acquitte
+//(avec une fenêtre, s'il en acquitte au moins le premier bloc : acked_blocks donne
+//combien), ACK_RESEND pour renvoyer tout de suite, ACK_WAIT pour l'ignorer et continuer
+//d'attendre, ACK_ERROR pour un paquet ERROR et ACK_INVALID pour tout autre paquet.
+//Un OACK en double, qui tient lieu d'ACK 0 pour une écriture, compte comme un ACK 0 ;
+//sauf avec rollover 0, où block_distance le range comme les autres, cet ACK 0 précède
+//le bloc 1.
+int sender_ack(struct Sender *sender, const unsigned char *ack_packet, size_t size)
+{
+    if (size > 4 && ack_packet[1] == ERROR_OPCODE)
+        return ACK_ERROR;
+    if (size < 4 || (ack_packet[1] != ACK_OPCODE && ack_packet[1] != OACK_OPCODE))
+        return ACK_INVALID;
+
+    //Un ACK d'un bloc précédent (doublon ou arrivé en retard) ne fait pas renvoyer le
+    //paquet : y répondre ferait doubler chaque bloc (syndrome de l'apprenti sorcier).
+    unsigned short block_number = sender->block_number;
+    unsigned short acked_block_number = ack_packet[1] == OACK_OPCODE ? 0 : (ack_packet[2] << 8) | ack_packet[3];
+    bool oack_pending = block_number == 0 && !sender->wrapped;
+    bool acked_oack = acked_block_number == 0 && sender->rollover != 0;
+    if (!oack_pending && acked_block_number != block_number && (acked_oack || block_distance(block_number, acked_block_number, sender->rollover) < 0)) {
+        //Sauf un nouvel ACK du bloc précédent : le destinataire attend toujours
+        //celui-ci, on le renvoie tout de suite. Une seule fois par bloc, et pas si cet
+        //ACK peut être l'écho d'un renvoi du bloc précédent.
+        bool previous_block = acked_oack ? block_number == 1 : block_distance(block_number, acked_block_number, sender->rollover) == -1;
+        if (!previous_block || sender->fast_retransmitted || sender->stats.previous_retransmitted)
+            return ACK_WAIT;
+        sender->fast_retransmitted = true;
+        sender->retransmitted = true;
+        sender->stats.fast++;
+        return ACK_RESEND;
+    }
+
+    int acked_blocks = acked_block_number == block_number ? 0 : block_distance(block_number, acked_block_number, sender->rollover);
+    if (acked_block_number != block_number && (oack_pending || acked_blocks >= sender->window_sent))
+        return ACK_INVALID;
+
+    sender->acked_blocks = acked_blocks + 1;
+    sender->stats.previous_retransmitted = sender->retransmitted;
+    sender->retransmitted = false;
+    sender->fast_retransmitted = false;
+    sender->next_signature.present = sender->delta && size >= 4 + SIGNATURE_SIZE;
+    if (sender->next_signature.present)
+        memcpy(sender->next_signature.hash, ack_packet + 4, SIGNATURE_SIZE);
+    return ACK_DONE;
+}
+
+//Le délai d'attente de l'ACK a expiré : le bloc en cours va être renvoyé.
+void sender_timeout(struct Sender *sender)
+{
+    sender->retransmitted = true;
+    sender->stats.timeout++;
+}
+
+//Passe au bloc suivant une fois acquitté un bloc de data_size octets (à appeler pour
+//chacun des acked_blocks blocs d'une fenêtre). Renvoie faux si le transfert est fini :
+//dernier bloc (moins de 512 octets) ou, sans rollover, bloc 65535 atteint (too_big).
+bool sender_next(struct Sender *sender, size_t data_size)
+{
+    if (sender->window_sent > 0)
+        sender->window_sent--;
+    if (data_size < 512)
+        return false;
+    if (sender->block_number == 65535) {
+        if (sender->rollover == ROLLOVER_NONE) {
+            sender->too_big = true;
+            return false;
+        }
+        sender->wrapped = true;
+    }
+    sender->block_number = block_after(sender->block_number, 1, sender->rollover);
+    return true;
+}
+
+void receiver_init(struct Receiver *receiver, int rollover, bool delta, off_t offset)
+{
+    memset(receiver, 0, sizeof(*receiver));
+    receiver->rollover = rollover;
+    receiver->delta = delta;
+    receiver->expected = 1;
+    receiver->window_size = 1;
+    receiver->write_offset = offset;
+}
+
+//Traite un paquet reçu. RECEIVE_DELIVER : c'est le bloc attendu, à écrire puis à faire
+//suivre de receiver_next. RECEIVE_REPEAT_ACK : doublon du dernier bloc reçu, notre ACK
+//s'est perdu et doit être renvoyé. RECEIVE_MATCH : le bloc se trouve dans la copie
+//locale à match_offset, à relire avant d'appeler receiver_accept_match.
+//RECEIVE_IGNORE : bloc ancien, ou arrivé en avance et mis de côté. RECEIVE_INVALID :
+//ce n'est pas un paquet de données. Avec une fenêtre, un doublon du dernier bloc reçu
+//ou un bloc en avance qui clôt la fenêtre (il en manque donc un avant lui) rend l'ACK
+//dû tout de suite (receiver_ack_due), pour que l'expéditeur reprenne au bon bloc.
+int receiver_accept(struct Receiver *receiver, const unsigned char *data_packet, size_t size)
+{
+    if (size < 4 || (data_packet[1] != DATA_OPCODE && !(receiver->delta && data_packet[1] == MATCH_OPCODE)))
+        return RECEIVE_INVALID;
+
+    unsigned short received_block_number = (data_packet[2] << 8) | data_packet[3];
+    if (received_block_number == 0 && receiver->rollover != 0)
+        return RECEIVE_IGNORE;
+    int distance = block_distance(receiver->expected, received_block_number, receiver->rollover);
+    if (distance < 0 && receiver->window_size > 1) {
+        if (distance == -1)
+            receiver->window_received = receiver->window_size;
+        return RECEIVE_IGNORE;
+    }
+    if (distance < 0)
+        return distance == -1 ? RECEIVE_REPEAT_ACK : RECEIVE_IGNORE;
+
+    if (data_packet[1] == MATCH_OPCODE) {
+        receiver->match_offset = receiver->write_offset + (off_t)distance * 512;
+        return RECEIVE_MATCH;
+    }
+
+    if (distance > 0) {
+        if (distance <= REORDER_BLOCKS && receiver->reorder == NULL)
+            receiver->reorder = calloc(1, sizeof(*receiver->reorder));
+        if (distance <= REORDER_BLOCKS && receiver->reorder != NULL)
+            store_early_block(receiver->reorder, received_block_number, data_packet + 4, size - 4);
+        if (receiver->window_size > 1 && (receiver->window_received + distance + 1 >= receiver->window_size || size - 4 < 512))
+            receiver->window_received = receiver->window_size;
+        return RECEIVE_IGNORE;
+    }
+    return RECEIVE_DELIVER;
+}
+
+//Le bloc local annoncé par un MATCH a été relu dans data_packet + 4 (local_size
+//octets) : le paquet devient un DATA ordinaire, traité par receiver_accept.
+int receiver_accept_match(struct Receiver *receiver, unsigned char *data_packet, size_t local_size)
+{
+    data_packet[1] = DATA_OPCODE;
+    receiver->matched_blocks++;
+    return receiver_accept(receiver, data_packet, 4 + local_size);
+}
+
+//Le bloc attendu (size octets) vient d'être écrit. Renvoie vrai en plaçant dans data le
+//bloc suivant s'il était déjà arrivé ; faux sinon, ou si le transfert est fini
+//(complete), ou si le bloc 65535 est atteint sans rollover (too_big). acked désigne
+//ensuite le dernier bloc écrit.
+bool receiver_next(struct Receiver *receiver, unsigned char *data, size_t *size)
+{
+    receiver->write_offset += *size;
+    receiver->window_received++;
+    receiver->acked = receiver->expected;
+    receiver->expected = block_after(receiver->expected, 1, receiver->rollover);
+    if (*size < 512) {
+        receiver->complete = true;
+        return false;
+    }
+    if (receiver->acked == 65535 && receiver->rollover == ROLLOVER_NONE) {
+        receiver->too_big = true;
+        return false;
+    }
+
+    ssize_t buffered_size = receiver->reorder != NULL ? take_early_block(receiver->reorder, receiver->expected, data) : -1;
+    if (buffered_size < 0)
+        return false;
+    *size = buffered_size;
+    return true;
+}
+
+//Indique s'il faut acquitter acked maintenant : après chaque bloc sans fenêtre, après
+//window_size blocs ou en fin de transfert avec une fenêtre.
+bool receiver_ack_due(struct Receiver *receiver)
+{
+    if (receiver->window_received < receiver->window_size && !receiver->complete && !receiver->too_big)
+        return false;
+    receiver->window_received = 0;
+    return true;
+}
+
+void receiver_close(struct Receiver *receiver)
+{
+    free(receiver->reorder);
+    receiver->reorder = NULL;
+}
+
+//Accès au fichier local, communs aux trois programmes.
+
+//Prépare l'ACK de block_number. En mode delta (local_fd >= 0), on y joint la signature
+//du bloc de notre copie qui se trouve à next_offset, s'il existe : l'expéditeur enverra
+//un simple MATCH si son bloc est identique. Renvoie la taille de l'ACK.
+size_t build_ack(unsigned char *ack_packet, unsigned short block_number, int local_fd, off_t next_offset, off_t local_size)
+{
+    ack_packet[0] = 0;
+    ack_packet[1] = ACK_OPCODE;
+    ack_packet[2] = block_number >> 8;
+    ack_packet[3] = block_number & 0xFF;
+    if (local_fd < 0 || next_offset >= local_size)
+        return 4;
+
+    unsigned char block[512];
+    ssize_t bytes_read = pread(local_fd, block, sizeof(block), next_offset);
+    if (bytes_read <= 0)
+        return 4;
+    block_signature(block, bytes_read, ack_packet + 4);
+    return 4 + SIGNATURE_SIZE;
+}
+
+//Ecrit un bloc reçu à offset, par pwrite : la position vient du destinataire et tient
+//sur 64 bits, au-delà de 4 Gio. Un bloc nul n'est pas écrit, ce qui laisse un trou. Dans
+//l'ancienne copie (avant old_size), on perce un trou à la place des anciennes données.
+//Avec batch, le bloc est seulement ajouté au lot s'il prolonge les blocs déjà gardés ;
+//sinon le lot est d'abord écrit. flush_writes écrit ce qui reste avant chaque ACK.
+//Renvoie 1 si le bloc a été sauté, 0 s'il a été écrit, -1 en cas d'erreur d'écriture.
+int write_sparse(int fd, struct WriteBatch *batch, const unsigned char *data, size_t size, off_t offset, off_t old_size)
+{
+    if (is_zero_block(data, size)
+        && (offset >= old_size || fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0))
+        return 1;
+
+    if (batch == NULL)
+        return write_at(fd, data, size, offset);
+
+    if (batch->length > 0 && (batch->offset + (off_t)batch->length != offset || batch->length + size > sizeof(batch->data))
+        && flush_writes(fd, batch) < 0)
+        return -1;
+    if (batch->length == 0)
+        batch->offset = offset;
+    memcpy(batch->data + batch->length, data, size);
+    batch->length += size;
+    return 0;
+}
+
+int flush_writes(int fd, struct WriteBatch *batch)
+{
+    if (batch->length == 0)
+        return 0;
+    size_t length = batch->length;
+    batch->length = 0;
+    return write_at(fd, batch->data, length, batch->offset);
+}
+
+//pwrite complet de size octets, repris après une interruption.
+int write_at(int fd, const unsigned char *data, size_t size, off_t offset)
+{
+    size_t written = 0;
+    while (written < size) {
+        ssize_t result = pwrite(fd, data + written, size - written, offset + written);
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += result;
+    }
+    return 0;
+}
+
+//Lit jusqu'à size octets à offset, comme pread. Les trous du fichier, repérés avec
+//SEEK_DATA et SEEK_HOLE, sont remplis de zéros sans lecture ; *hole_bytes les compte.
+//Renvoie le nombre d'octets lus, moins que size seulement en fin de fichier.
+ssize_t read_sparse(int fd, unsigned char *buffer, size_t size, off_t offset, unsigned long long *hole_bytes)
+{
+    size_t length = 0;
+    while (length < size) {
+        off_t position = offset + length;
+        size_t chunk = size - length;
+
+        //Pas de données après position : trou final jusqu'à la fin du fichier.
+        struct stat stat_buf;
+        off_t data = lseek(fd, position, SEEK_DATA);
+        if (data < 0 && errno == ENXIO && fstat(fd, &stat_buf) == 0)
+            data = stat_buf.st_size;
+
+        if (data > position) {
+            if (data - position < (off_t)chunk)
+                chunk = data - position;
+            memset(buffer + length, 0, chunk);
+            length += chunk;
+            *hole_bytes += chunk;
+            continue;
+        }
+        if (data == position) {
+            off_t hole = lseek(fd, position, SEEK_HOLE);
+            if (hole > position && hole - position < (off_t)chunk)
+                chunk = hole - position;
+        }
+
+        ssize_t bytes_read = pread(fd, buffer + length, chunk, position);
+        if (bytes_read < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (bytes_read == 0)
+            break;
+        length += bytes_read;
+    }
+    return length;
+}
+
+//Envoi et réception groupés des fenêtres, communs aux trois programmes.
+
+//Sans -B ni backend=, GSO est essayé d'abord ; -DNO_UDP_GSO fait partir de sendmmsg.
+#ifdef NO_UDP_GSO
+int io_backend = BACKEND_SENDMMSG;
+#else
+int io_backend = BACKEND_GSO;
+#endif
+
+const char *const backend_names[] = {"gso", "sendmmsg", "sendto"};
+
+//Renvoie le mode d'envoi nommé name, -1 s'il n'existe pas.
+int parse_backend(const char *name)
+{
+    for (int i = 0; i < (int)(sizeof(backend_names) / sizeof(backend_names[0])); ++i) {
+        if (strcmp(name, backend_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+const char *backend_name(int backend)
+{
+    return backend_names[backend];
+}
+
+//Envoie count paquets rangés bout à bout tous les MAX_PACKET_SIZE octets, tous pleins
+//sauf peut-être le dernier (last_size octets), selon io_backend : en un seul appel
+//découpé par le noyau (GSO), par sendmmsg, ou par un sendto par paquet. GSO est
+//abandonné pour sendmmsg au premier refus du noyau. Renvoie le nombre d'appels système,
+//-1 en cas d'erreur.
+int send_window(int socket_fd, const struct sockaddr_in *addr, const unsigned char *packets, size_t count, size_t last_size)
+{
+    if (count == 1)
+        return sendto(socket_fd, packets, last_size, 0, (const struct sockaddr *)addr, sizeof(*addr)) < 0 ? -1 : 1;
+
+    if (io_backend == BACKEND_SENDTO) {
+        for (size_t i = 0; i < count; ++i) {
+            if (sendto(socket_fd, packets + i * MAX_PACKET_SIZE, i + 1 < count ? MAX_PACKET_SIZE : last_size, 0, (const struct sockaddr *)addr, sizeof(*addr)) < 0)
+                return -1;
+        }
+        return count;
+    }
+
+    if (io_backend == BACKEND_GSO) {
+        struct iovec iov = { (void *)packets, (count - 1) * MAX_PACKET_SIZE + last_size };
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        memset(control, 0, sizeof(control));
+        message.msg_name = (void *)addr;
+        message.msg_namelen = sizeof(*addr);
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_UDP;
+        header->cmsg_type = UDP_SEGMENT;
+        header->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t segment_size = MAX_PACKET_SIZE;
+        memcpy(CMSG_DATA(header), &segment_size, sizeof(segment_size));
+
+        if (sendmsg(socket_fd, &message, 0) >= 0)
+            return 1;
+        if (errno != EIO && errno != EINVAL && errno != ENOPROTOOPT && errno != EOPNOTSUPP)
+            return -1;
+        io_backend = BACKEND_SENDMMSG;
+    }
+
+    struct mmsghdr messages[MAX_WINDOW_BLOCKS];
+    struct iovec iovs[MAX_WINDOW_BLOCKS];
+    memset(messages, 0, sizeof(messages));
+    for (size_t i = 0; i < count; ++i) {
+        iovs[i].iov_base = (void *)(packets + i * MAX_PACKET_SIZE);
+        iovs[i].iov_len = i + 1 < count ? MAX_PACKET_SIZE : last_size;
+        messages[i].msg_hdr.msg_name = (void *)addr;
+        messages[i].msg_hdr.msg_namelen = sizeof(*addr);
+        messages[i].msg_hdr.msg_iov = &iovs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int calls = 0;
+    for (size_t sent = 0; sent < count; ++calls) {
+        int result = sendmmsg(socket_fd, messages + sent, count - sent, 0);
+        if (result < 0)
+            return -1;
+        sent += result;
+    }
+    return calls;
+}
+
+//UDP_GRO n'est demandé qu'avec le mode GSO : les deux autres modes mesurent une
+//réception paquet par paquet.
+bool set_udp_gro(int socket_fd, bool enabled)
+{
+    if (enabled && io_backend != BACKEND_GSO)
+        return false;
+    int value = enabled;
+    return setsockopt(socket_fd, SOL_UDP, UDP_GRO, &value, sizeof(value)) == 0;
+}
+
+void burst_reader_init(struct BurstReader *reader)
+{
+    reader->length = 0;
+    reader->position = 0;
+    reader->receives = 0;
+    reader->packets = 0;
+}
+
+//Renvoie le paquet suivant du socket, comme recvfrom. Avec UDP_GRO, le noyau peut livrer
+//en une fois plusieurs datagrammes du même expéditeur : ils sont rendus un à un, sans
+//nouvel appel système.
+ssize_t receive_burst_packet(int socket_fd, struct BurstReader *reader, unsigned char *packet, size_t size, struct sockaddr_in *addr)
+{
+    if (reader->position >= reader->length) {
+        struct iovec iov = { reader->buffer, sizeof(reader->buffer) };
+        char control[CMSG_SPACE(sizeof(int))];
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_name = &reader->addr;
+        message.msg_namelen = sizeof(reader->addr);
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t length = recvmsg(socket_fd, &message, 0);
+        if (length < 0)
+            return -1;
+
+        reader->length = length;
+        reader->position = 0;
+        reader->segment_size = length;
+        for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+            if (header->cmsg_level == SOL_UDP && header->cmsg_type == UDP_GRO) {
+                int segment_size;
+                memcpy(&segment_size, CMSG_DATA(header), sizeof(segment_size));
+                if (segment_size > 0)
+                    reader->segment_size = segment_size;
+            }
+        }
+        reader->receives++;
+    }
+
+    size_t segment = reader->length - reader->position;
+    if (segment > reader->segment_size)
+        segment = reader->segment_size;
+    size_t copied = segment < size ? segment : size;
+    memcpy(packet, reader->buffer + reader->position, copied);
+    reader->position += segment;
+    reader->packets++;
+    *addr = reader->addr;
+    return copied;
+}
@@ -0,0 +1,200 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+//Moteur de transfert commun au client et aux deux serveurs : numérotation des blocs,
+//fenêtres, réordonnancement, retransmission rapide et mode delta. Le cœur (Sender,
+//Receiver) ne fait aucune entrée/sortie : il reçoit les paquets lus par le programme qui
+//l'utilise et lui dit quoi envoyer. Le client et le serveur à threads l'entourent des
+//mêmes boucles d'attente bloquantes (protocol.c), le serveur epoll de ses coroutines.
+//L'accès au fichier local et l'envoi groupé des fenêtres, selon le mode choisi au
+//lancement (io_backend), sont partagés ici.
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#define MAX_PACKET_SIZE 516
+#define REORDER_BLOCKS 8
+#define SIGNATURE_SIZE 32
+#define MAX_WINDOW_BLOCKS 64
+#define BURST_BUFFER_SIZE 65536
+
+#define RRQ_OPCODE 1
+#define WRQ_OPCODE 2
+#define DATA_OPCODE 3
+#define ACK_OPCODE 4
+#define ERROR_OPCODE 5
+#define OACK_OPCODE 6
+#define MATCH_OPCODE 7
+
+//Modes d'envoi et de réception des fenêtres (io_backend), choisis au lancement : option
+//-B des serveurs, argument backend= du client. BACKEND_GSO envoie une fenêtre en un
+//appel (UDP_SEGMENT) et reçoit les rafales avec UDP_GRO ; BACKEND_SENDMMSG envoie par
+//sendmmsg et reçoit paquet par paquet ; BACKEND_SENDTO fait un appel par paquet.
+#define BACKEND_GSO 0
+#define BACKEND_SENDMMSG 1
+#define BACKEND_SENDTO 2
+
+//Option rollover : numéro qui suit le bloc 65535 (0 ou 1), ou pas de tour des numéros
+//du tout, ce qui borne le fichier à 65535 blocs.
+#define ROLLOVER_NONE -1
+
+//Décisions de receiver_accept.
+#define RECEIVE_IGNORE 0
+#define RECEIVE_REPEAT_ACK 1
+#define RECEIVE_MATCH 2
+#define RECEIVE_DELIVER 3
+#define RECEIVE_INVALID 4
+
+//Décisions de sender_ack.
+#define ACK_WAIT 0
+#define ACK_RESEND 1
+#define ACK_DONE 2
+#define ACK_ERROR 3
+#define ACK_INVALID 4
+
+//Hachage SHA-256 calculé au fil des données : signatures des blocs en mode delta et
+//morceaux du stockage dédupliqué du serveur à threads.
+struct Sha256 {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+};
+
+//Retransmissions d'un transfert : rapides (sur ACK en double) et après un délai
+//d'attente. previous_retransmitted indique si le bloc précédent a été renvoyé : un ACK
+//en double peut alors n'être que l'écho de ce renvoi et ne déclenche rien.
+struct RetransmitStats {
+    unsigned long fast;
+    unsigned long timeout;
+    bool previous_retransmitted;
+};
+
+//Mode delta : signature, jointe à un ACK, du bloc suivant de la copie du destinataire.
+struct BlockSignature {
+    bool present;
+    unsigned char hash[SIGNATURE_SIZE];
+};
+
+//Blocs DATA arrivés en avance, gardés jusqu'à ce que les blocs qui les précèdent
+//soient écrits. used est faux pour une place libre.
+struct PendingBlock {
+    bool used;
+    unsigned short block_number;
+    size_t size;
+    unsigned char data[512];
+};
+
+struct ReorderBuffer {
+    struct PendingBlock blocks[REORDER_BLOCKS];
+};
+
+//Expéditeur des blocs d'un fichier. block_number est le premier bloc en attente d'ACK
+//(0 pour l'OACK d'une lecture) ; window_sent blocs à partir de lui sont préparés, plus
+//d'un avec l'option windowsize (RFC 7440). acked_blocks est le nombre de ces blocs
+//acquittés par le dernier ACK. retransmitted et fast_retransmitted valent pour la
+//fenêtre en cours ; next_signature est la signature reçue avec le dernier ACK en mode delta.
+//wrapped indique que les numéros ont déjà fait un tour : avec rollover 0, le bloc 0 est
+//alors un bloc de données et plus l'OACK.
+struct Sender {
+    int rollover;
+    bool wrapped;
+    bool delta;
+    unsigned short block_number;
+    unsigned short window_sent;
+    unsigned short acked_blocks;
+    bool retransmitted;
+    bool fast_retransmitted;
+    bool too_big;
+    struct RetransmitStats stats;
+    struct BlockSignature next_signature;
+    unsigned long matched_blocks;
+};
+
+//Destinataire des blocs d'un fichier. expected est le prochain bloc attendu, acked le
+//dernier bloc écrit (celui à acquitter) et write_offset la position où s'écrit expected.
+//match_offset est la position, dans la copie locale, du bloc annoncé par un MATCH.
+//reorder n'est alloué qu'à l'arrivée du premier bloc en avance (receiver_close le libère) :
+//un transfert sans désordre n'occupe que quelques dizaines d'octets. Avec windowsize,
+//un ACK n'est dû qu'après window_size blocs : window_received compte ceux reçus depuis
+//le dernier ACK.
+struct Receiver {
+    int rollover;
+    bool delta;
+    unsigned short expected;
+    unsigned short acked;
+    unsigned short window_size;
+    unsigned short window_received;
+    off_t write_offset;
+    off_t match_offset;
+    bool complete;
+    bool too_big;
+    unsigned long matched_blocks;
+    struct ReorderBuffer *reorder;
+};
+
+//Blocs d'une fenêtre reçue qui se suivent dans le fichier, gardés pour être écrits par
+//un seul pwrite à offset. length vaut 0 pour un lot vide.
+struct WriteBatch {
+    off_t offset;
+    size_t length;
+    unsigned char data[MAX_WINDOW_BLOCKS * 512];
+};
+
+//Réception groupée (UDP_GRO) : un appel peut rapporter plusieurs datagrammes du même
+//expéditeur, mis bout à bout dans buffer et découpés tous les segment_size octets.
+struct BurstReader {
+    unsigned char buffer[BURST_BUFFER_SIZE];
+    size_t length;
+    size_t position;
+    size_t segment_size;
+    struct sockaddr_in addr;
+    unsigned long receives;
+    unsigned long packets;
+};
+
+int block_distance(unsigned short expected, unsigned short received, int rollover);
+unsigned short block_after(unsigned short block_number, int count, int rollover);
+void store_early_block(struct ReorderBuffer *reorder, unsigned short block_number, const unsigned char *data, size_t size);
+ssize_t take_early_block(struct ReorderBuffer *reorder, unsigned short block_number, unsigned char *data);
+void sha256_init(struct Sha256 *hash);
+uint32_t rotate_right(uint32_t value, int bits);
+void sha256_transform(struct Sha256 *hash, const unsigned char *block);
+void sha256_update(struct Sha256 *hash, const unsigned char *data, size_t size);
+void sha256_final(struct Sha256 *hash, unsigned char *digest);
+void block_signature(const unsigned char *data, size_t size, unsigned char *signature);
+bool match_block(const struct BlockSignature *signature, const unsigned char *data, size_t size);
+bool is_zero_block(const unsigned char *data, size_t size);
+size_t build_error_packet(unsigned char *error_packet, int error_code, const char *error_message);
+
+void sender_init(struct Sender *sender, int rollover, bool delta, unsigned short block_number);
+size_t sender_packet(struct Sender *sender, unsigned char *data_packet, size_t data_size);
+int sender_ack(struct Sender *sender, const unsigned char *ack_packet, size_t size);
+void sender_timeout(struct Sender *sender);
+bool sender_next(struct Sender *sender, size_t data_size);
+
+void receiver_init(struct Receiver *receiver, int rollover, bool delta, off_t offset);
+int receiver_accept(struct Receiver *receiver, const unsigned char *data_packet, size_t size);
+int receiver_accept_match(struct Receiver *receiver, unsigned char *data_packet, size_t local_size);
+bool receiver_next(struct Receiver *receiver, unsigned char *data, size_t *size);
+bool receiver_ack_due(struct Receiver *receiver);
+void receiver_close(struct Receiver *receiver);
+
+size_t build_ack(unsigned char *ack_packet, unsigned short block_number, int local_fd, off_t next_offset, off_t local_size);
+int write_sparse(int fd, struct WriteBatch *batch, const unsigned char *data, size_t size, off_t offset, off_t old_size);
+int flush_writes(int fd, struct WriteBatch *batch);
+int write_at(int fd, const unsigned char *data, size_t size, off_t offset);
+ssize_t read_sparse(int fd, unsigned char *buffer, size_t size, off_t offset, unsigned long long *hole_bytes);
+
+extern int io_backend;
+int parse_backend(const char *name);
+const char *backend_name(int backend);
+int send_window(int socket_fd, const struct sockaddr_in *addr, const unsigned char *packets, size_t count, size_t last_size);
+bool set_udp_gro(int socket_fd, bool enabled);
+void burst_reader_init(struct BurstReader *reader);
+ssize_t receive_burst_packet(int socket_fd, struct BurstReader *reader, unsigned char *packet, size_t size, struct sockaddr_in *addr);
+
+#endif